@@ -1,34 +1,137 @@
 #include "pixz.h"
 
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <setjmp.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <math.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 
 #pragma mark UTILS
 
-FILE *gInFile = NULL, *gOutFile = NULL;
-lzma_stream gStream = LZMA_STREAM_INIT;
+// Errors that only come from a failing device or a closed peer, never from a
+// call that happened to leave errno set earlier
+static bool io_errno(int err) {
+    return err == EIO || err == ENOSPC || err == EDQUOT || err == EFBIG
+        || err == EROFS || err == EPIPE || err == ECONNRESET;
+}
+
+static _Thread_local jmp_buf *gUnwind = NULL; // where this job started
 
+static void engine_fail(engine_t *e, const char *why, bool io);
+static void tar_reader_undo(void *ar);
 
+// The command just exits. A library engine keeps the first message, and this
+// thread gives up its job.
 void die(const char *fmt, ...) {
+    int err = errno;
+    engine_t *e = gEngine;
+    va_list args;
+    va_start(args, fmt);
+    if (!e->recover || !gUnwind) {
+        vfprintf(stderr, fmt, args);
+        fprintf(stderr, "\n");
+        fflush(stderr);
+        va_end(args);
+        exit(1);
+    }
+    char why[sizeof(e->message)];
+    vsnprintf(why, sizeof(why), fmt, args);
+    va_end(args);
+    engine_fail(e, why, io_errno(err));
+    longjmp(*gUnwind, 1);
+}
+
+void warn(const char *fmt, ...) {
+    if (gEngine->recover)
+        return;
     va_list args;
     va_start(args, fmt);
     vfprintf(stderr, fmt, args);
     fprintf(stderr, "\n");
-    fflush(stderr);
     va_end(args);
-    exit(1);
 }
 
-char *xstrdup(const char *s) {
-    if (!s)
-        return NULL;
-    size_t len = strlen(s);
-    char *r = malloc(len + 1);
-    if (!r)
-        return NULL;
-    return memcpy(r, s, len + 1); 
+// Whole blocks go straight to the output descriptor or write function,
+// without a pass through stdio's buffer. Nothing else may buffer output in
+// the output file.
+bool write_output(const void *buf, size_t size) {
+    engine_t *e = gEngine;
+    int fd = fileno(e->out_file);
+    const uint8_t *pos = buf;
+    while (size) {
+        ssize_t wr = e->out_write ? e->out_write(e->io_opaque, pos, size)
+            : write(fd, pos, size);
+        if (wr == -1 && errno == EINTR)
+            continue;
+        if (wr <= 0)
+            return false;
+        pos += wr;
+        size -= wr;
+    }
+    return true;
+}
+
+// Streamed input bypasses stdio too, nothing may be buffered in the input file
+ssize_t read_input(void *buf, size_t size) {
+    engine_t *e = gEngine;
+    if (e->in_read)
+        return e->in_read(e->io_opaque, buf, size);
+    return read(fileno(e->in_file), buf, size);
+}
+
+int close_file(FILE *f) {
+    engine_release(f);
+    return fclose(f);
+}
+
+FILE *open_output(const char *ipath, const char *opath) {
+    FILE *out;
+    if (!ipath) {
+        // can't read permissions of original file, because we read from stdin,
+        // using umask permissions
+        if (!(out = fopen(opath, "w")))
+            die("can not open output file: %s: %s", opath, strerror(errno));
+    } else {
+        // read permissions of original file,
+        // use them to create / open output file
+        struct stat input_stat;
+        int output_fd;
+        
+        stat(ipath, &input_stat);
+        
+        if ((output_fd = open(opath, O_CREAT | O_WRONLY, input_stat.st_mode)) == -1)
+            die("can not open output file: %s: %s", opath, strerror(errno));
+        
+        if (!(out = fdopen(output_fd, "w")))
+            die("can not open output file: %s: %s", opath, strerror(errno));
+    }
+    return out;
+}
+
+struct archive *tar_reader(void) {
+    struct archive *ar = archive_read_new();
+    if (!ar)
+        die("Can't allocate archive reader");
+    prevent_compression(ar);
+    archive_read_support_format_tar(ar);
+    engine_defer(&tar_reader_undo, ar);
+    return ar;
+}
+
+void tar_reader_free(struct archive *ar) {
+    engine_release(ar);
+    finish_reading(ar);
+}
+
+static void tar_reader_undo(void *ar) {
+    finish_reading(ar);
 }
 
 bool is_multi_header(const char *name) {
@@ -39,28 +142,200 @@ bool is_multi_header(const char *name) {
     return strncmp(name + i, "._", 2) == 0;
 }
 
+// Bytes, with an optional binary suffix, or a percentage of RAM
+bool parse_size(const char *arg, uint64_t *limit) {
+    char *end;
+    double val = strtod(arg, &end);
+    if (end == arg || val < 0)
+        return false;
+    
+    uint64_t mult = 1;
+    if (*end == '%') {
+        if (val > 100 || !(mult = physical_memory()))
+            return false;
+        val /= 100;
+        ++end;
+    } else if (*end) {
+        const char *suffixes = "KMGT";
+        const char *suf = strchr(suffixes, toupper((unsigned char)*end));
+        if (!suf)
+            return false;
+        for (const char *c = suffixes; c <= suf; ++c)
+            mult *= 1024;
+        ++end;
+        if (strcmp(end, "iB") == 0 || strcmp(end, "B") == 0)
+            end += strlen(end);
+    }
+    if (*end)
+        return false;
+    *limit = val * mult;
+    return true;
+}
+
+// A number in a tar header: octal, or base-256 for big values
+uint64_t tar_number(const uint8_t *field, size_t size) {
+    uint64_t n = 0;
+    if (field[0] & 0x80) {
+        for (size_t i = 1; i < size; ++i)
+            n = (n << 8) | field[i];
+        return n;
+    }
+    for (size_t i = 0; i < size && field[i]; ++i) {
+        if (field[i] >= '0' && field[i] <= '7')
+            n = n * 8 + field[i] - '0';
+        else if (n)
+            break;
+    }
+    return n;
+}
+
+
+#pragma mark BUFFERS
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define BUFFER_MMAP_MIN HUGE_PAGE_SIZE // smaller buffers just use malloc
+
+#if defined(MAP_ANONYMOUS)
+    #define BUFFER_MMAP 1
+#endif
+
+static bool buffer_mapped(size_t size) {
+#ifdef BUFFER_MMAP
+    return gEngine->huge_pages != HUGE_PAGES_NONE && size >= BUFFER_MMAP_MIN;
+#else
+    return false;
+#endif
+}
+
+static size_t buffer_mapped_size(size_t size) {
+    return (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+}
+
+void *buffer_alloc(size_t size) {
+    void *buf = NULL;
+    if (!buffer_mapped(size)) {
+        if (!(buf = malloc(size)))
+            die("Can't allocate %zu byte buffer", size);
+        return buf;
+    }
+    
+#ifdef BUFFER_MMAP
+    size_t msize = buffer_mapped_size(size);
+    #ifdef MAP_HUGETLB
+    if (gEngine->huge_pages == HUGE_PAGES_HUGETLB) {
+        buf = mmap(NULL, msize, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buf != MAP_FAILED)
+            return buf;
+        // No reserved huge pages, fall through to THP
+    }
+    #endif
+    
+    // Over-allocate, so we can trim to a huge-page aligned region
+    uint8_t *raw = mmap(NULL, msize + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        die("Can't map %zu byte buffer: %s", size, strerror(errno));
+    uint8_t *aligned = (uint8_t*)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1)
+        & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned != raw)
+        munmap(raw, aligned - raw);
+    size_t tail = (raw + HUGE_PAGE_SIZE) - aligned;
+    if (tail)
+        munmap(aligned + msize, tail);
+    buf = aligned;
+    
+    #ifdef MADV_HUGEPAGE
+    madvise(buf, msize, MADV_HUGEPAGE); // just a hint, ok to fail
+    #endif
+#endif
+    return buf;
+}
+
+void *buffer_grow(void *buf, size_t oldsize, size_t newsize) {
+    if (!buf)
+        return buffer_alloc(newsize);
+    if (!buffer_mapped(oldsize) && !buffer_mapped(newsize)) {
+        if (!(buf = realloc(buf, newsize)))
+            die("Can't grow buffer to %zu bytes", newsize);
+        return buf;
+    }
+    if (buffer_mapped(oldsize) && buffer_mapped_size(oldsize) >= newsize)
+        return buf; // slack at the end of the mapping already covers it
+    
+    void *nbuf = buffer_alloc(newsize);
+    memcpy(nbuf, buf, oldsize);
+    buffer_free(buf, oldsize);
+    return nbuf;
+}
+
+void buffer_free(void *buf, size_t size) {
+    if (!buf)
+        return;
+#ifdef BUFFER_MMAP
+    if (buffer_mapped(size)) {
+        munmap(buf, buffer_mapped_size(size));
+        return;
+    }
+#endif
+    free(buf);
+}
+
 
 #pragma mark INDEX
 
-lzma_index *gIndex = NULL;
-file_index_t *gFileIndex = NULL, *gLastFile = NULL;
+#define FILE_ARENA_CHUNK (64 * 1024)
+#define FILE_ARENA_CHUNK_MAX (4 * 1024 * 1024)
 
-static uint8_t *gFileIndexBuf = NULL;
-static size_t gFIBSize = CHUNKSIZE, gFIBPos = 0;
-static lzma_ret gFIBErr = LZMA_OK;
-static uint8_t gFIBInputBuf[CHUNKSIZE];
-static size_t gMoved = 0;
+struct file_arena_t {
+    file_arena_t *next;
+    size_t size, used;
+    max_align_t data[];
+};
 
+// A version 2 index is found through its directory of chunks
+typedef struct {
+    size_t entries;
+    lzma_vli usize;
+    const uint8_t *first; // name of its first entry, not nul-terminated
+    size_t firstlen;
+} index_chunk_t;
+
+typedef struct {
+    off_t offset, size;
+    char *name;
+} index_entry_t;
+
+static void *file_arena_take(size_t size, size_t align);
+static file_index_t *file_index_link(off_t offset, char *name);
 static void *decode_file_index_start(off_t block_seek, lzma_check check);
-static lzma_vli find_file_index(void **bdatap);
+static lzma_vli find_file_index(file_index_stream_t *fs, lzma_vli end,
+    void **bdatap);
+static lzma_vli read_stream_file_index(file_index_stream_t *fs, lzma_vli end,
+    size_t count, char **specs);
+
+static lzma_vli read_file_index_v2(void *bdata, file_index_stream_t *fs,
+    lzma_vli stream_end, size_t count, char **specs);
+static size_t read_file_index_block(lzma_vli loc, uint8_t **bufp);
+static void read_file_index_rest(void);
+static bool *index_chunks_wanted(index_chunk_t *chunks, size_t nchunks,
+    size_t count, char **specs);
+static size_t index_chunk_find(index_chunk_t *chunks, size_t nchunks,
+    const char *name, size_t len);
+static size_t index_chunk_read(const uint8_t *p, const uint8_t *end,
+    index_chunk_t *chunk, index_entry_t *entries);
+static int index_entry_cmp(const void *a, const void *b);
 
 static char *read_file_index_name(void);
 static void read_file_index_make_space(void);
 static void read_file_index_data(void);
 
+static off_t tar_pax_size(off_t pos, size_t size);
+static void tar_data_read(off_t pos, uint8_t *buf, size_t size);
+
 
 void dump_file_index(FILE *out, bool verbose) {
-    for (file_index_t *f = gFileIndex; f != NULL; f = f->next) {
+    for (file_index_t *f = gEngine->file_index; f != NULL; f = f->next) {
         if (verbose) {
             fprintf(out, "%10"PRIuMAX" %s\n", (uintmax_t)f->offset,
                 f->name ? f->name : "");
@@ -72,13 +347,73 @@ void dump_file_index(FILE *out, bool verbose) {
 }
 
 void free_file_index(void) {
-    for (file_index_t *f = gFileIndex; f != NULL; ) {
-        file_index_t *next = f->next;
-        free(f->name);
-        free(f);
-        f = next;
+    engine_t *e = gEngine;
+    file_arena_free(e->file_arena);
+    e->file_arena = NULL;
+    e->file_index = e->last_file = NULL;
+    free(e->file_index_streams);
+    e->file_index_streams = NULL;
+}
+
+// Chunks grow as the index does, so huge indices need only a few mallocs
+static void *file_arena_take(size_t size, size_t align) {
+    engine_t *e = gEngine;
+    file_arena_t *a = e->file_arena;
+    size_t pos = a ? (a->used + align - 1) & ~(align - 1) : 0;
+    if (!a || pos + size > a->size) {
+        size_t cap = a ? a->size * 2 : FILE_ARENA_CHUNK;
+        if (cap > FILE_ARENA_CHUNK_MAX)
+            cap = FILE_ARENA_CHUNK_MAX;
+        if (cap < size)
+            cap = size;
+        if (!(a = malloc(sizeof(file_arena_t) + cap)))
+            die("Can't allocate memory for the file index");
+        a->next = e->file_arena;
+        a->size = cap;
+        e->file_arena = a;
+        pos = 0;
     }
-    gFileIndex = gLastFile = NULL;
+    a->used = pos + size;
+    return (uint8_t*)a->data + pos;
+}
+
+void *file_arena_alloc(size_t size) {
+    return file_arena_take(size, _Alignof(max_align_t));
+}
+
+void file_arena_free(file_arena_t *arena) {
+    while (arena) {
+        file_arena_t *next = arena->next;
+        free(arena);
+        arena = next;
+    }
+}
+
+file_index_t *file_index_append(off_t offset, const char *name) {
+    char *copy = NULL;
+    if (name) {
+        size_t len = strlen(name) + 1;
+        copy = memcpy(file_arena_take(len, 1), name, len);
+    }
+    return file_index_link(offset, copy);
+}
+
+// Append an entry whose name is already in the arena
+static file_index_t *file_index_link(off_t offset, char *name) {
+    engine_t *e = gEngine;
+    file_index_t *f = file_arena_take(sizeof(file_index_t),
+        _Alignof(file_index_t));
+    f->offset = offset;
+    f->name = name;
+    f->next = NULL;
+    
+    if (e->last_file) {
+        e->last_file->next = f;
+    } else {
+        e->file_index = f;
+    }
+    e->last_file = f;
+    return f;
 }
 
 typedef struct {
@@ -87,7 +422,8 @@ typedef struct {
 } block_wrapper_t;
 
 static void *decode_file_index_start(off_t block_seek, lzma_check check) {
-    if (fseeko(gInFile, block_seek, SEEK_SET) == -1)
+    engine_t *e = gEngine;
+    if (fseeko(e->in_file, block_seek, SEEK_SET) == -1)
         die("Error seeking to block");
     
     // Some memory in which to keep the discovered filters safe
@@ -95,49 +431,61 @@ static void *decode_file_index_start(off_t block_seek, lzma_check check) {
     bw->block = (lzma_block){ .check = check, .filters = bw->filters,
 	 	.version = 0 };
     
-    int b = fgetc(gInFile);
+    int b = fgetc(e->in_file);
     if (b == EOF || b == 0)
         die("Error reading block size");
     bw->block.header_size = lzma_block_header_size_decode(b);
     uint8_t hdrbuf[bw->block.header_size];
     hdrbuf[0] = (uint8_t)b;
-    if (fread(hdrbuf + 1, bw->block.header_size - 1, 1, gInFile) != 1)
+    if (fread(hdrbuf + 1, bw->block.header_size - 1, 1, e->in_file) != 1)
         die("Error reading block header");
     if (lzma_block_header_decode(&bw->block, NULL, hdrbuf) != LZMA_OK)
         die("Error decoding file index block header");
     
-    if (lzma_block_decoder(&gStream, &bw->block) != LZMA_OK)
+    if (lzma_block_decoder(&e->stream, &bw->block) != LZMA_OK)
         die("Error initializing file index stream");
+    for (lzma_filter *f = bw->filters; f->id != LZMA_VLI_UNKNOWN; ++f)
+        free(f->options);
     
     return bw;
 }
 
-static lzma_vli find_file_index(void **bdatap) {
-    if (!gIndex)
-        decode_index();
-        
-    // find the last block
+// A stream's file index is its last block, for a stream whose data runs
+// up to end
+static lzma_vli find_file_index(file_index_stream_t *fs, lzma_vli end,
+        void **bdatap) {
+    if (end == fs->start)
+        return 0; // an empty file has no blocks at all
     lzma_index_iter iter;
-	lzma_index_iter_init(&iter, gIndex);
-    lzma_vli loc = lzma_index_uncompressed_size(gIndex) - 1;
-    if (lzma_index_iter_locate(&iter, loc))
+	lzma_index_iter_init(&iter, gEngine->index);
+    if (lzma_index_iter_locate(&iter, end - 1))
         die("Can't locate file index block");
-    if (iter.stream.number != 1)
-		return 0; // Too many streams for one file index
 	
     void *bdata = decode_file_index_start(iter.block.compressed_file_offset,
 		iter.stream.flags->check);
     
-    gFileIndexBuf = malloc(gFIBSize);
-    gStream.avail_out = gFIBSize;
-    gStream.avail_in = 0;
+    gEngine->fib_size = CHUNKSIZE;
+    gEngine->fib_pos = 0;
+    gEngine->fib_err = LZMA_OK;
+    gEngine->fib = malloc(gEngine->fib_size);
+    gEngine->stream.avail_out = gEngine->fib_size;
+    gEngine->stream.avail_in = 0;
     
     // Check if this is really an index
     read_file_index_data();
     lzma_vli ret = iter.block.compressed_file_offset;
-    if (xle64dec(gFileIndexBuf + gFIBPos) != PIXZ_INDEX_MAGIC)
+    uint64_t magic = gEngine->stream.avail_out
+        > gEngine->fib_size - sizeof(uint64_t) ? 0
+        : xle64dec(gEngine->fib + gEngine->fib_pos);
+    if (magic == PIXZ_INDEX_MAGIC)
+        gEngine->file_index_version = 1;
+    else if (magic == PIXZ_INDEX_V2_MAGIC)
+        gEngine->file_index_version = 2;
+    else
         ret = 0;
-    gFIBPos += sizeof(uint64_t);
+    gEngine->fib_pos += sizeof(uint64_t);
+    fs->offset = ret;
+    fs->index_start = iter.block.uncompressed_file_offset;
     
     if (bdatap && ret) {
         *bdatap = bdata;
@@ -146,55 +494,185 @@ static lzma_vli find_file_index(void **bdatap) {
         if (bdatap)
             *bdatap = NULL;
         free(bdata);
-        free(gFileIndexBuf);
-        gLastFile = gFileIndex = NULL;
-        lzma_end(&gStream);
+        free(gEngine->fib);
+        gEngine->fib = NULL;
+        lzma_end(&gEngine->stream);
     }
     return ret; 
 }  
 
 lzma_vli read_file_index() {
+    return read_file_index_specs(0, NULL);
+}
+
+// Appending or concatenating tarballs gives a stream for each, with a file
+// index of its own. They're merged into one list, each one's entries moved
+// to where its stream's data starts and ending in its own NULL entry.
+lzma_vli read_file_index_specs(size_t count, char **specs) {
+    engine_t *e = gEngine;
+    if (!e->index && !decode_index())
+        return 0;
+    free_file_index();
+    e->file_index_streams = malloc(lzma_index_stream_count(e->index)
+        * sizeof(file_index_stream_t));
+    
+    lzma_vli first = 0;
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, e->index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_STREAM)) {
+        file_index_stream_t *fs =
+            &e->file_index_streams[iter.stream.number - 1];
+        fs->start = iter.stream.uncompressed_offset;
+        if (!read_stream_file_index(fs,
+                fs->start + iter.stream.uncompressed_size, count, specs)) {
+            free_file_index(); // a stream that isn't a tarball spoils the rest
+            return 0;
+        }
+        if (!first)
+            first = fs->offset;
+    }
+    return first;
+}
+
+static lzma_vli read_stream_file_index(file_index_stream_t *fs, lzma_vli end,
+        size_t count, char **specs) {
     void *bdata = NULL;
-	lzma_vli offset = find_file_index(&bdata);
+	lzma_vli offset = find_file_index(fs, end, &bdata);
     if (!offset)
         return 0;
+    if (gEngine->file_index_version == 2)
+        return read_file_index_v2(bdata, fs, end, count, specs);
     
     while (true) {
         char *name = read_file_index_name();
         if (!name)
             break;
         
-        file_index_t *f = malloc(sizeof(file_index_t));
-        f->name = strlen(name) ? xstrdup(name) : NULL;
-        f->offset = xle64dec(gFileIndexBuf + gFIBPos);
-        gFIBPos += sizeof(uint64_t);
-        
-        if (gLastFile) {
-            gLastFile->next = f;
-        } else {
-            gFileIndex = f;
-        }
-        gLastFile = f;
+        file_index_append(fs->start + xle64dec(gEngine->fib + gEngine->fib_pos),
+            *name ? name : NULL);
+        gEngine->fib_pos += sizeof(uint64_t);
     }
-    free(gFileIndexBuf);
-    lzma_end(&gStream);
+    free(gEngine->fib);
+    gEngine->fib = NULL;
+    lzma_end(&gEngine->stream);
     free(bdata);
     
     return offset;
 }
 
+bool file_index_block(const lzma_index_iter *iter) {
+    return iter->block.compressed_file_offset
+        >= gEngine->file_index_streams[iter->stream.number - 1].offset;
+}
+
+// Where the tar data ends and the end-of-archive zeros begin. Files can end
+// in zeros too, so walk the headers from the last entry.
+off_t tar_data_end(off_t pos, off_t end) {
+    uint8_t h[512];
+    off_t pax_size = -1;
+    while (pos + (off_t)sizeof(h) <= end) {
+        tar_data_read(pos, h, sizeof(h));
+        size_t i = 0;
+        while (i < sizeof(h) && !h[i])
+            ++i;
+        if (i == sizeof(h))
+            break;
+        
+        char type = h[156];
+        off_t size = tar_number(h + 124, 12);
+        pos += sizeof(h);
+        if (type == 'x') {
+            pax_size = tar_pax_size(pos, size);
+        } else if (type != 'g' && type != 'L' && type != 'K') {
+            if (pax_size != -1)
+                size = pax_size;
+            pax_size = -1;
+            // Old GNU sparse files have more headers
+            for (bool ext = (type == 'S' && h[482]); ext && pos < end;
+                    ext = h[504]) {
+                tar_data_read(pos, h, sizeof(h));
+                pos += sizeof(h);
+            }
+        }
+        pos += (size + sizeof(h) - 1) / sizeof(h) * sizeof(h);
+    }
+    tar_data_read(0, NULL, 0);
+    return pos < end ? pos : end;
+}
+
+// A pax header can give the real size of the entry after it
+static off_t tar_pax_size(off_t pos, size_t size) {
+    if (size > 1024 * 1024)
+        return -1;
+    char *buf = malloc(size + 1);
+    tar_data_read(pos, (uint8_t*)buf, size);
+    buf[size] = '\0';
+    
+    off_t found = -1;
+    for (char *rec = buf; rec < buf + size; ) { // "len key=value\n"
+        char *key;
+        unsigned long len = strtoul(rec, &key, 10);
+        if (!len || len > (size_t)(buf + size - rec) || *key != ' ')
+            break;
+        if (strncmp(key + 1, "size=", 5) == 0)
+            found = strtoull(key + 6, NULL, 10);
+        rec += len;
+    }
+    free(buf);
+    return found;
+}
+
+// Read decoded archive data, a whole block at a time. The last block stays
+// around, since the next read is usually from it too. A NULL buf frees it.
+static void tar_data_read(off_t pos, uint8_t *buf, size_t size) {
+    engine_t *e = gEngine;
+    if (!buf) {
+        free(e->tar_data);
+        e->tar_data = NULL;
+        e->tar_data_len = 0;
+        return;
+    }
+    
+    while (size) {
+        if (pos < e->tar_data_start
+                || pos >= e->tar_data_start + (off_t)e->tar_data_len) {
+            lzma_index_iter iter;
+            lzma_index_iter_init(&iter, e->index);
+            if (lzma_index_iter_locate(&iter, pos))
+                die("Error reading archive data");
+            
+            e->tar_data_len = iter.block.uncompressed_size;
+            e->tar_data_start = iter.block.uncompressed_file_offset;
+            e->tar_data = realloc(e->tar_data,
+                e->tar_data_len ? e->tar_data_len : 1);
+            if (!decode_block(fileno(e->in_file), &iter, e->tar_data))
+                die("Error decoding archive data");
+        }
+        
+        size_t n = e->tar_data_start + e->tar_data_len - pos;
+        if (n > size)
+            n = size;
+        memcpy(buf, e->tar_data + (pos - e->tar_data_start), n);
+        buf += n;
+        pos += n;
+        size -= n;
+    }
+}
+
 static char *read_file_index_name(void) {
+    engine_t *e = gEngine;
     while (true) {
         // find a nul that ends a name
-        uint8_t *eos, *haystack = gFileIndexBuf + gFIBPos;
-        ssize_t len = gFIBSize - gStream.avail_out - gFIBPos - sizeof(uint64_t);
+        uint8_t *eos, *haystack = e->fib + e->fib_pos;
+        ssize_t len = e->fib_size - e->stream.avail_out - e->fib_pos
+            - sizeof(uint64_t);
         if (len > 0 && (eos = memchr(haystack, '\0', len))) { // found it
-            gFIBPos += eos - haystack + 1;
+            e->fib_pos += eos - haystack + 1;
             return (char*)haystack;
-        } else if (gFIBErr == LZMA_STREAM_END) { // nothing left
+        } else if (e->fib_err == LZMA_STREAM_END) { // nothing left
             return NULL;
         } else { // need more data
-            if (gStream.avail_out == 0)
+            if (e->stream.avail_out == 0)
                 read_file_index_make_space();
             read_file_index_data();            
         }
@@ -202,50 +680,285 @@ static char *read_file_index_name(void) {
 }
 
 static void read_file_index_make_space(void) {
-    bool expand = (gFIBPos == 0);
-    if (gFIBPos != 0) { // clear more space
-        size_t move = gFIBSize - gStream.avail_out - gFIBPos;        
-        memmove(gFileIndexBuf, gFileIndexBuf + gFIBPos, move);
-        gMoved += move;
-        gStream.avail_out += gFIBPos;
-        gFIBPos = 0;
+    engine_t *e = gEngine;
+    bool expand = (e->fib_pos == 0);
+    if (e->fib_pos != 0) { // clear more space
+        size_t move = e->fib_size - e->stream.avail_out - e->fib_pos;        
+        memmove(e->fib, e->fib + e->fib_pos, move);
+        e->fib_moved += move;
+        e->stream.avail_out += e->fib_pos;
+        e->fib_pos = 0;
     }
     // Try to reduce number of moves by expanding proactively
-    if (expand || gMoved >= gFIBSize) { // malloc more space
-        gStream.avail_out += gFIBSize;
-        gFIBSize *= 2;
+    if (expand || e->fib_moved >= e->fib_size) { // malloc more space
+        e->stream.avail_out += e->fib_size;
+        e->fib_size *= 2;
 
-        uint8_t *new_gFileIndexBuf = realloc(gFileIndexBuf, gFIBSize);
+        uint8_t *new_fib = realloc(e->fib, e->fib_size);
 
-        if (new_gFileIndexBuf == NULL) {
+        if (new_fib == NULL) {
           // TODO is recovery possible? does it even make sense?
           // @see https://github.com/vasi/pixz/issues/8#issuecomment-134113347
           die("memory re-allocation failure: %s", strerror(errno));
         } else {
-          gFileIndexBuf = new_gFileIndexBuf;
+          e->fib = new_fib;
         }
     }
 }
 
 static void read_file_index_data(void) {
-    gStream.next_out = gFileIndexBuf + gFIBSize - gStream.avail_out;
-    while (gFIBErr != LZMA_STREAM_END && gStream.avail_out) {
-        if (gStream.avail_in == 0) {
+    engine_t *e = gEngine;
+    e->stream.next_out = e->fib + e->fib_size - e->stream.avail_out;
+    while (e->fib_err != LZMA_STREAM_END && e->stream.avail_out) {
+        if (e->stream.avail_in == 0) {
             // It's ok to read past the end of the block, we'll still
             // get LZMA_STREAM_END at the right place
-            gStream.avail_in = fread(gFIBInputBuf, 1, CHUNKSIZE, gInFile);
-            if (ferror(gInFile))
+            e->stream.avail_in = fread(e->fib_input, 1, CHUNKSIZE, e->in_file);
+            if (ferror(e->in_file))
                 die("Error reading file index data");
-            gStream.next_in = gFIBInputBuf;
+            e->stream.next_in = e->fib_input;
         }
         
-        gFIBErr = lzma_code(&gStream, LZMA_RUN);
-        if (gFIBErr != LZMA_OK && gFIBErr != LZMA_STREAM_END)
+        e->fib_err = lzma_code(&e->stream, LZMA_RUN);
+        if (e->fib_err != LZMA_OK && e->fib_err != LZMA_STREAM_END)
             die("Error decoding file index data");
     }
 }
 
 
+// Decode the rest of the block in the buffer, however big it gets
+static void read_file_index_rest(void) {
+    engine_t *e = gEngine;
+    while (e->fib_err != LZMA_STREAM_END) {
+        if (e->stream.avail_out == 0) {
+            e->stream.avail_out += e->fib_size;
+            e->fib_size *= 2;
+            if (!(e->fib = realloc(e->fib, e->fib_size)))
+                die("memory re-allocation failure: %s", strerror(errno));
+        }
+        read_file_index_data();
+    }
+}
+
+// Decode a whole index block, given an uncompressed offset within it
+static size_t read_file_index_block(lzma_vli loc, uint8_t **bufp) {
+    engine_t *e = gEngine;
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, e->index);
+    if (lzma_index_iter_locate(&iter, loc)
+            || iter.block.uncompressed_file_offset != loc)
+        die("Can't locate file index chunk");
+    void *bdata = decode_file_index_start(iter.block.compressed_file_offset,
+		iter.stream.flags->check);
+    
+    e->fib_size = CHUNKSIZE;
+    e->fib_err = LZMA_OK;
+    e->fib = malloc(e->fib_size);
+    e->stream.avail_out = e->fib_size;
+    e->stream.avail_in = 0;
+    read_file_index_rest();
+    lzma_end(&e->stream);
+    free(bdata);
+    
+    *bufp = e->fib;
+    e->fib = NULL;
+    return e->fib_size - e->stream.avail_out;
+}
+
+// The directory's block is partly decoded already, by find_file_index
+static lzma_vli read_file_index_v2(void *bdata, file_index_stream_t *fs,
+        lzma_vli stream_end, size_t count, char **specs) {
+    lzma_vli base = fs->start;
+    read_file_index_rest();
+    lzma_end(&gEngine->stream);
+    free(bdata);
+    uint8_t *dir = gEngine->fib;
+    gEngine->fib = NULL;
+    size_t dirsize = gEngine->fib_size - gEngine->stream.avail_out;
+    const uint8_t *p = dir + gEngine->fib_pos, *end = dir + dirsize;
+    
+    off_t archive_end = xvarint_dec(&p, end);
+    size_t total = xvarint_dec(&p, end);
+    size_t nchunks = xvarint_dec(&p, end);
+    if (nchunks > dirsize)
+        die("Error decoding file index directory");
+    index_chunk_t *chunks = malloc((nchunks ? nchunks : 1)
+        * sizeof(index_chunk_t));
+    lzma_vli chunk_bytes = 0;
+    for (size_t i = 0; i < nchunks; ++i) {
+        chunks[i].entries = xvarint_dec(&p, end);
+        chunks[i].usize = xvarint_dec(&p, end);
+        chunks[i].firstlen = xvarint_dec(&p, end);
+        if (chunks[i].firstlen > (size_t)(end - p))
+            die("Error decoding file index directory");
+        chunks[i].first = p;
+        p += chunks[i].firstlen;
+        chunk_bytes += chunks[i].usize;
+    }
+    
+    // Chunks come just before the directory
+    lzma_vli dirloc = stream_end - dirsize;
+    if (chunk_bytes > dirloc - base)
+        die("Error decoding file index directory");
+    lzma_vli loc = dirloc - chunk_bytes;
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, gEngine->index);
+    if (lzma_index_iter_locate(&iter, loc))
+        die("Can't locate file index chunk");
+    lzma_vli offset = iter.block.compressed_file_offset;
+    fs->offset = offset;
+    fs->index_start = loc;
+    
+    bool *wanted = index_chunks_wanted(chunks, nchunks, count, specs);
+    size_t nentries = 0;
+    for (size_t i = 0; i < nchunks; ++i) {
+        if (wanted[i])
+            nentries += chunks[i].entries;
+    }
+    if (nentries > total)
+        die("Error decoding file index directory");
+    
+    index_entry_t *entries = malloc((nentries ? nentries : 1)
+        * sizeof(index_entry_t));
+    size_t got = 0;
+    for (size_t i = 0; i < nchunks; loc += chunks[i++].usize) {
+        if (!wanted[i])
+            continue;
+        uint8_t *buf;
+        size_t size = read_file_index_block(loc, &buf);
+        if (size != chunks[i].usize)
+            die("File index chunk has the wrong size");
+        got += index_chunk_read(buf, buf + size, &chunks[i], entries + got);
+        free(buf);
+    }
+    
+    // Back into archive order, marking the ends of runs
+    qsort(entries, got, sizeof(index_entry_t), index_entry_cmp);
+    for (size_t i = 0; i < got; ++i) {
+        file_index_link(base + entries[i].offset, entries[i].name);
+        off_t fend = entries[i].offset + entries[i].size;
+        if (i + 1 == got || entries[i + 1].offset != fend)
+            file_index_link(base + fend, NULL);
+    }
+    if (!got)
+        file_index_link(base + archive_end, NULL);
+    
+    free(entries);
+    free(wanted);
+    free(chunks);
+    free(dir);
+    return offset;
+}
+
+// Which chunks could hold names matching the specs, or all without specs
+static bool *index_chunks_wanted(index_chunk_t *chunks, size_t nchunks,
+        size_t count, char **specs) {
+    bool *wanted = calloc(nchunks ? nchunks : 1, sizeof(bool));
+    if (!count) {
+        memset(wanted, 1, nchunks * sizeof(bool));
+        return wanted;
+    }
+    
+    for (size_t i = 0; i < count && nchunks; ++i) {
+        // Matches sort from the spec itself to just before spec + "0", since
+        // '0' follows '/'
+        size_t len = strlen(specs[i]);
+        while (len && specs[i][len - 1] == '/')
+            --len;
+        char hi[len + 2];
+        memcpy(hi, specs[i], len);
+        hi[len] = '0';
+        hi[len + 1] = '\0';
+        
+        size_t lo = index_chunk_find(chunks, nchunks, specs[i], len),
+            up = index_chunk_find(chunks, nchunks, hi, len + 1);
+        // The last chunk to start before the spec may hold it too
+        if (lo)
+            --lo;
+        for (size_t c = lo; c < up; ++c)
+            wanted[c] = true;
+    }
+    return wanted;
+}
+
+// The number of chunks whose first name sorts before name
+static size_t index_chunk_find(index_chunk_t *chunks, size_t nchunks,
+        const char *name, size_t len) {
+    size_t lo = 0, hi = nchunks;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        size_t flen = chunks[mid].firstlen;
+        int cmp = memcmp(chunks[mid].first, name, flen < len ? flen : len);
+        if (cmp < 0 || (cmp == 0 && flen < len))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+// Each entry: shared prefix length, suffix, offset delta, size
+static size_t index_chunk_read(const uint8_t *p, const uint8_t *end,
+        index_chunk_t *chunk, index_entry_t *entries) {
+    if (end - p < (ssize_t)sizeof(uint64_t)
+            || xle64dec(p) != PIXZ_CHUNK_MAGIC)
+        die("Error decoding file index chunk");
+    p += sizeof(uint64_t);
+    if (xvarint_dec(&p, end) != chunk->entries)
+        die("Error decoding file index chunk");
+    
+    const char *prev = "";
+    size_t prevlen = 0;
+    off_t offset = 0;
+    for (size_t i = 0; i < chunk->entries; ++i) {
+        size_t shared = xvarint_dec(&p, end), len = xvarint_dec(&p, end);
+        if (shared > prevlen || len > (size_t)(end - p))
+            die("Error decoding file index chunk");
+        char *name = file_arena_take(shared + len + 1, 1);
+        memcpy(name, prev, shared);
+        memcpy(name + shared, p, len);
+        name[shared + len] = '\0';
+        p += len;
+        
+        uint64_t delta = xvarint_dec(&p, end);
+        offset += (delta & 1) ? -(off_t)(delta >> 1) - 1 : (off_t)(delta >> 1);
+        entries[i] = (index_entry_t){ .name = name, .offset = offset,
+            .size = xvarint_dec(&p, end) };
+        prev = name;
+        prevlen = shared + len;
+    }
+    return chunk->entries;
+}
+
+static int index_entry_cmp(const void *a, const void *b) {
+    off_t oa = ((const index_entry_t*)a)->offset,
+        ob = ((const index_entry_t*)b)->offset;
+    return (oa > ob) - (oa < ob);
+}
+
+size_t xvarint_enc(uint8_t *d, uint64_t n) {
+    size_t i = 0;
+    do {
+        d[i] = n & 0x7f;
+        n >>= 7;
+        d[i++] |= n ? 0x80 : 0;
+    } while (n);
+    return i;
+}
+
+uint64_t xvarint_dec(const uint8_t **d, const uint8_t *end) {
+    uint64_t n = 0;
+    for (int shift = 0; ; shift += 7) {
+        if (*d >= end || shift > 63)
+            die("Error decoding file index");
+        uint8_t b = *(*d)++;
+        n |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return n;
+    }
+}
+
+
 #define BWCHUNK 512
 
 typedef struct {
@@ -261,9 +974,9 @@ static uint32_t *bw_read(bw *b) {
 			return NULL; // EOF
 		b->size = (b->pos > BWCHUNK) ? BWCHUNK : b->pos;
 		b->pos -= b->size;
-		if (fseeko(gInFile, b->pos, SEEK_SET) == -1)
+		if (fseeko(gEngine->in_file, b->pos, SEEK_SET) == -1)
 			return NULL;
-		if (fread(b->buf, b->size, 1, gInFile) != 1)
+		if (fread(b->buf, b->size, 1, gEngine->in_file) != 1)
 			return NULL;
 	}
 	
@@ -300,6 +1013,7 @@ static void stream_footer(bw *b, lzma_stream_flags *flags) {
 }
 
 static lzma_index *next_index(off_t *pos) {
+    engine_t *e = gEngine;
 	bw b;
 	off_t pad = stream_padding(&b, *pos);
 	off_t eos = *pos - pad;
@@ -307,32 +1021,33 @@ static lzma_index *next_index(off_t *pos) {
 	lzma_stream_flags flags;
 	stream_footer(&b, &flags);
 	*pos = eos - LZMA_STREAM_HEADER_SIZE - flags.backward_size;
-    if (fseeko(gInFile, *pos, SEEK_SET) == -1)
+    if (fseeko(e->in_file, *pos, SEEK_SET) == -1)
         die("Error seeking to index");
 	
-    lzma_stream strm = LZMA_STREAM_INIT;
+    lzma_stream *strm = stream_new();
 	lzma_index *index;
-    if (lzma_index_decoder(&strm, &index, MEMLIMIT) != LZMA_OK)
+    if (lzma_index_decoder(strm, &index, MEMLIMIT) != LZMA_OK)
         die("Error creating index decoder");
     
     uint8_t ibuf[CHUNKSIZE];
-    strm.avail_in = 0;
+    strm->avail_in = 0;
     lzma_ret err = LZMA_OK;
     while (err != LZMA_STREAM_END) {
-        if (strm.avail_in == 0) {
-            strm.avail_in = fread(ibuf, 1, CHUNKSIZE, gInFile);
-            if (ferror(gInFile))
+        if (strm->avail_in == 0) {
+            strm->avail_in = fread(ibuf, 1, CHUNKSIZE, e->in_file);
+            if (ferror(e->in_file))
                 die("Error reading index");
-            strm.next_in = ibuf;
+            strm->next_in = ibuf;
         }
         
-        err = lzma_code(&strm, LZMA_RUN);
+        err = lzma_code(strm, LZMA_RUN);
         if (err != LZMA_OK && err != LZMA_STREAM_END)
             die("Error decoding index");
     }
+    stream_free(strm);
 	
 	*pos = eos - lzma_index_stream_size(index);
-	if (fseeko(gInFile, *pos, SEEK_SET) == -1)
+	if (fseeko(e->in_file, *pos, SEEK_SET) == -1)
 		die("Error seeking to beginning of stream");
 	
 	
@@ -344,233 +1059,1065 @@ static lzma_index *next_index(off_t *pos) {
 }
 
 bool decode_index(void) {
-	if (fseeko(gInFile, 0, SEEK_END) == -1) {
-		fprintf(stderr, "can not seek in input: %s\n", strerror(errno));
+    engine_t *e = gEngine;
+	e->index = NULL;
+	if (fseeko(e->in_file, 0, SEEK_END) == -1) {
+		warn("can not seek in input: %s", strerror(errno));
 		return false; // not seekable
 	}
 
-	off_t pos = ftello(gInFile);
+	off_t pos = ftello(e->in_file);
 
-	gIndex = NULL;
 	while (pos > 0) {
 		lzma_index *index = next_index(&pos);
-		if (gIndex && lzma_index_cat(index, gIndex, NULL) != LZMA_OK)
+		if (e->index && lzma_index_cat(index, e->index, NULL) != LZMA_OK)
 			die("Error concatenating indices");
-		gIndex = index;
+		e->index = index;
 	}
 
-	return (gIndex != NULL);
+	return (e->index != NULL);
+}
+
+// For random access: pread the block iter is at, and decode it all at once
+bool decode_block(int fd, const lzma_index_iter *iter, uint8_t *out) {
+    size_t tsize = iter->block.total_size, got = 0;
+    uint8_t *in = malloc(tsize);
+    while (got < tsize) {
+        ssize_t rd = pread(fd, in + got, tsize - got,
+            iter->block.compressed_file_offset + got);
+        if (rd == -1 && errno == EINTR)
+            continue;
+        if (rd <= 0)
+            break;
+        got += rd;
+    }
+    
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block = { .version = 0, .filters = filters,
+        .check = iter->stream.flags->check };
+    block.header_size = lzma_block_header_size_decode(in[0]);
+    bool ok = got == tsize && block.header_size <= tsize
+        && lzma_block_header_decode(&block, NULL, in) == LZMA_OK;
+    if (ok) {
+        size_t in_pos = block.header_size, out_pos = 0,
+            size = iter->block.uncompressed_size;
+        ok = lzma_block_buffer_decode(&block, NULL, in, &in_pos, tsize,
+            out, &out_pos, size) == LZMA_OK && out_pos == size;
+        for (lzma_filter *f = filters; f->id != LZMA_VLI_UNKNOWN; ++f)
+            free(f->options);
+    }
+    free(in);
+    return ok;
 }
 
 
 #pragma mark QUEUE
 
-queue_t *queue_new(queue_free_t freer) {
-    queue_t *q = malloc(sizeof(queue_t));
-    q->first = q->last = NULL;
+#define QUEUE_SPIN 64 // attempts before sleeping
+
+static bool queue_try_push(queue_t *q, int type, void *data);
+static uint64_t stats_since(const struct timespec *start);
+static bool queue_try_pop(queue_t *q, int *typep, void **datap);
+static void queue_wake(queue_t *q, atomic_size_t *waiters, pthread_cond_t *c);
+static void queue_sleep(queue_t *q, atomic_size_t *waiters, pthread_cond_t *c);
+static void engine_unwind(void);
+
+// Queues belong to the engine of the thread making them
+queue_t *queue_new(size_t capacity, queue_free_t freer) {
+    size_t size = 1;
+    while (size < capacity)
+        size *= 2;
+    
+    queue_t *q;
+    if (posix_memalign((void**)&q, QUEUE_CACHELINE, sizeof(queue_t)) != 0
+            || !(q->slots = malloc(size * sizeof(queue_slot_t))))
+        die("Can't allocate queue");
+    for (size_t i = 0; i < size; ++i)
+        atomic_init(&q->slots[i].seq, i);
+    q->mask = size - 1;
     q->freer = freer;
+    q->wait = NULL;
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+    atomic_init(&q->pop_waiters, 0);
+    atomic_init(&q->push_waiters, 0);
     pthread_mutex_init(&q->mutex, NULL);
     pthread_cond_init(&q->pop_cond, NULL);
+    pthread_cond_init(&q->push_cond, NULL);
+    
+    engine_t *e = q->engine = gEngine;
+    pthread_mutex_lock(&e->lock);
+    q->next = e->queues;
+    e->queues = q;
+    pthread_mutex_unlock(&e->lock);
     return q;
 }
 
 void queue_free(queue_t *q) {
-    for (queue_item_t *i = q->first; i; ) {
-        queue_item_t *tmp = i->next;
+    int type;
+    void *data;
+    while (queue_try_pop(q, &type, &data)) {
         if (q->freer)
-            q->freer(i->type, i->data);
-        free(i);
-        i = tmp;
+            q->freer(type, data);
     }
+    engine_t *e = q->engine;
+    pthread_mutex_lock(&e->lock);
+    queue_t **qp = &e->queues;
+    while (*qp != q)
+        qp = &(*qp)->next;
+    *qp = q->next;
+    pthread_mutex_unlock(&e->lock);
     pthread_mutex_destroy(&q->mutex);
     pthread_cond_destroy(&q->pop_cond);
+    pthread_cond_destroy(&q->push_cond);
+    free(q->slots);
     free(q);
 }
 
-void queue_push(queue_t *q, int type, void *data) {
+static bool queue_try_push(queue_t *q, int type, void *data) {
+    size_t pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    while (true) {
+        queue_slot_t *slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                slot->type = type;
+                slot->data = data;
+                atomic_store_explicit(&slot->seq, pos + 1,
+                    memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // full
+        } else {
+            pos = atomic_load_explicit(&q->tail, memory_order_relaxed);
+        }
+    }
+}
+
+static bool queue_try_pop(queue_t *q, int *typep, void **datap) {
+    size_t pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+    while (true) {
+        queue_slot_t *slot = &q->slots[pos & q->mask];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&q->head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                *typep = slot->type;
+                *datap = slot->data;
+                atomic_store_explicit(&slot->seq, pos + q->mask + 1,
+                    memory_order_release);
+                return true;
+            }
+        } else if (diff < 0) {
+            return false; // empty, or a push is still filling the slot
+        } else {
+            pos = atomic_load_explicit(&q->head, memory_order_relaxed);
+        }
+    }
+}
+
+// Pairs with the fence after a sleeper registers itself: either the sleeper
+// sees our change to the ring when it retries, or we see it waiting.
+static void queue_wake(queue_t *q, atomic_size_t *waiters, pthread_cond_t *c) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiters, memory_order_relaxed) == 0)
+        return;
     pthread_mutex_lock(&q->mutex);
-    
-    queue_item_t *i = malloc(sizeof(queue_item_t));
-    i->type = type;
-    i->data = data;
-    i->next = NULL;
-    
-    if (q->last) {
-        q->last->next = i;
-    } else {
-        q->first = i;
+    pthread_cond_signal(c);
+    pthread_mutex_unlock(&q->mutex);
+}
+
+// Wait for the other side, with the mutex held. An engine that's failing
+// wakes us, and then we give up.
+static void queue_sleep(queue_t *q, atomic_size_t *waiters, pthread_cond_t *c) {
+    if (atomic_load(&q->engine->aborted)) {
+        atomic_fetch_sub(waiters, 1);
+        pthread_mutex_unlock(&q->mutex);
+        engine_unwind();
     }
-    q->last = i;
+    pthread_cond_wait(c, &q->mutex);
+}
+
+void queue_push(queue_t *q, int type, void *data) {
+    bool pushed = false;
+    for (int i = 0; !pushed && i < QUEUE_SPIN; ++i)
+        pushed = queue_try_push(q, type, data);
     
-    pthread_cond_signal(&q->pop_cond);
-    pthread_mutex_unlock(&q->mutex);
+    if (!pushed) { // full, sleep until a pop makes room
+        pthread_mutex_lock(&q->mutex);
+        atomic_fetch_add(&q->push_waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!queue_try_push(q, type, data))
+            queue_sleep(q, &q->push_waiters, &q->push_cond);
+        atomic_fetch_sub(&q->push_waiters, 1);
+        pthread_mutex_unlock(&q->mutex);
+    }
+    queue_wake(q, &q->pop_waiters, &q->pop_cond);
+}
+
+size_t queue_length(queue_t *q) {
+    size_t head = atomic_load_explicit(&q->head, memory_order_relaxed),
+        tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    return tail > head ? tail - head : 0;
 }
 
 int queue_pop(queue_t *q, void **datap) {
-    pthread_mutex_lock(&q->mutex);
-    while (!q->first)
-        pthread_cond_wait(&q->pop_cond, &q->mutex);
-    
-    queue_item_t *i = q->first;
-    q->first = i->next;
-    if (!q->first)
-        q->last = NULL;
+    int type;
+    bool popped = false;
+    for (int i = 0; !popped && i < QUEUE_SPIN; ++i)
+        popped = queue_try_pop(q, &type, datap);
     
-    *datap = i->data;
-    int type = i->type;
-    free(i);
-    
-    pthread_mutex_unlock(&q->mutex);
+    if (!popped) { // empty, sleep until a push arrives
+        struct timespec start;
+        if (q->wait)
+            clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_mutex_lock(&q->mutex);
+        atomic_fetch_add(&q->pop_waiters, 1);
+        atomic_thread_fence(memory_order_seq_cst);
+        while (!queue_try_pop(q, &type, datap))
+            queue_sleep(q, &q->pop_waiters, &q->pop_cond);
+        atomic_fetch_sub(&q->pop_waiters, 1);
+        pthread_mutex_unlock(&q->mutex);
+        if (q->wait)
+            atomic_fetch_add(q->wait, stats_since(&start));
+    }
+    queue_wake(q, &q->push_waiters, &q->push_cond);
     return type;
 }
 
 
 #pragma mark PIPELINE
 
-queue_t *gPipelineStartQ = NULL,
-    *gPipelineSplitQ = NULL,
-    *gPipelineMergeQ = NULL;
+// The reorder window for pipeline_merged is indexed by seq % pl_window. Parked
+// items have seqs in [pl_merge_seq, pl_merge_seq + pl_window), so slots don't
+// collide. Reserved seqs can put an item further ahead than the pool size,
+// then the window grows to cover it.
 
-size_t gPipelineProcessMax = 0;
-size_t gPipelineQSize = 0;
+static void pipeline_window_grow(size_t ahead);
+static void pipeline_free(void);
+static void pipeline_thread_split(void *ignore);
+static void pipeline_thread_process(void *arg);
 
-pipeline_data_free_t gPLFreer = NULL;
-pipeline_split_t gPLSplit = NULL;
-pipeline_process_t gPLProcess = NULL;
-
-size_t gPLProcessCount = 0;
-pthread_t *gPLProcessThreads = NULL;
-pthread_t gPLSplitThread;
+size_t pipeline_threads(void) {
+    engine_t *e = gEngine;
+    size_t threads = num_threads();
+	if (e->process_max > 0 && e->process_max < threads)
+		threads = e->process_max;
+    return threads;
+}
 
-ssize_t gPLSplitSeq = 0;
-ssize_t gPLMergeSeq = 0;
-pipeline_item_t *gPLMergedItems = NULL;
+size_t pipeline_qsize(size_t threads) {
+    return gEngine->qsize ? gEngine->qsize : ceil(threads * 1.3 + 1);
+}
 
-static void pipeline_qfree(int type, void *p);
-static void *pipeline_thread_split(void *);
-static void *pipeline_thread_process(void *arg);
+// Find the most threads, and then the deepest queue, such that the pipeline
+// and fixed_mem stay under the memory limit. On success, makes them the
+// pipeline settings.
+bool pipeline_fit(uint64_t fixed_mem, uint64_t thread_mem, uint64_t item_mem,
+        size_t min_threads) {
+    engine_t *e = gEngine;
+    if (!e->mem_limit)
+        return true;
+    for (size_t threads = pipeline_threads(); threads >= min_threads
+            && threads > 0; --threads) {
+        uint64_t used = fixed_mem + thread_mem * threads;
+        if (used >= e->mem_limit)
+            continue;
+        uint64_t qmax = (e->mem_limit - used) / item_mem;
+        if (qmax < threads + 2)
+            continue; // the reader and writer each hold an item too
+        
+        size_t qsize = pipeline_qsize(threads);
+        e->process_max = threads;
+        e->qsize = (qsize < qmax) ? qsize : qmax;
+        return true;
+    }
+    return false;
+}
 
+// Other engines running at once may leave us fewer workers than we'd like
 void pipeline_create(
         pipeline_data_create_t create,
         pipeline_data_free_t destroy,
         pipeline_split_t split,
         pipeline_process_t process) {
-    gPLFreer = destroy;
-    gPLSplit = split;
-    gPLProcess = process;
+    engine_t *e = gEngine;
+    e->pl_freer = destroy;
+    e->pl_split = split;
+    e->pl_process = process;
     
-    gPipelineStartQ = queue_new(pipeline_qfree);
-    gPipelineSplitQ = queue_new(pipeline_qfree);
-    gPipelineMergeQ = queue_new(pipeline_qfree);
+    atomic_store(&e->pl_split_seq, 0);
+    e->pl_merge_seq = 0;
     
-    gPLSplitSeq = 0;
-    gPLMergeSeq = 0;
-    gPLMergedItems = NULL;
+    e->pl_process_count = e->pl_shared = pool_share(pipeline_threads());
+    e->pl_process_jobs = calloc(e->pl_process_count, sizeof(pool_job_t*));
+    size_t qsize = pipeline_qsize(e->pl_process_count);
+    if (qsize < 2)
+        qsize = 2; // tar reading holds one item while it waits for the next
+    if (qsize < e->pl_process_count) {
+        warn("Warning: queue size is less than thread count, "
+            "performance will suffer!");
+    }
+    e->item_count = qsize;
     
-    gPLProcessCount = num_threads();
-	if (gPipelineProcessMax > 0 && gPipelineProcessMax < gPLProcessCount)
-		gPLProcessCount = gPipelineProcessMax;
-	
-    gPLProcessThreads = malloc(gPLProcessCount * sizeof(pthread_t));
-    int qsize = gPipelineQSize ? gPipelineQSize
-        : ceil(gPLProcessCount * 1.3 + 1);
-    if (qsize < gPLProcessCount) {
-        fprintf(stderr, "Warning: queue size is less than thread count, "
-            "performance will suffer!\n");
+    // Room for every item, plus the stop messages
+    size_t qcap = qsize + e->pl_process_count + 1;
+    e->start_q = queue_new(qcap, NULL);
+    e->split_q = queue_new(qcap, NULL);
+    e->merge_q = queue_new(qcap, NULL);
+    if (gStats) {
+        e->start_q->wait = &gStatsWait[STATS_START_Q];
+        e->split_q->wait = &gStatsWait[STATS_SPLIT_Q];
+        e->merge_q->wait = &gStatsWait[STATS_MERGE_Q];
     }
+    e->pl_parked = 0;
+    
+    e->pl_window = qsize;
+    e->pl_merged = calloc(e->pl_window, sizeof(pipeline_item_t*));
+    if (!e->pl_merged)
+        die("Can't allocate reorder window");
     for (size_t i = 0; i < qsize; ++i) {
         // create blocks, including a margin of error
-        pipeline_item_t *item = malloc(sizeof(pipeline_item_t));
-        item->data = create();
-        // seq and next are garbage
-        queue_push(gPipelineStartQ, PIPELINE_ITEM, item);
-    }
-    for (size_t i = 0; i < gPLProcessCount; ++i) {
-        if (pthread_create(&gPLProcessThreads[i], NULL,
-                &pipeline_thread_process, (void*)(uintptr_t)i))
-            die("Error creating encode thread");
-    }
-    if (pthread_create(&gPLSplitThread, NULL, &pipeline_thread_split, NULL))
-        die("Error creating read thread");
-}
-
-static void pipeline_qfree(int type, void *p) {
-    switch (type) {
-        case PIPELINE_ITEM: {
-            pipeline_item_t *item = (pipeline_item_t*)p;
-            gPLFreer(item->data);
-            free(item);
-            break;
-        }
-        case PIPELINE_STOP:
-            break;
-        default:
-            die("Unknown msg type %d", type);
+        pipeline_item_t *item = pipeline_item_new(create());
+        // seq is garbage
+        queue_push(e->start_q, PIPELINE_ITEM, item);
     }
+    for (size_t i = 0; i < e->pl_process_count; ++i) {
+        e->pl_process_jobs[i] = pool_run(e, &pipeline_thread_process,
+            (void*)(uintptr_t)i);
+    }
+    e->pl_split_job = pool_run(e, &pipeline_thread_split, NULL);
+}
+
+pipeline_item_t *pipeline_item_new(void *data) {
+    engine_t *e = gEngine;
+    pipeline_item_t *item = malloc(sizeof(pipeline_item_t));
+    if (!item)
+        die("Can't allocate pipeline item");
+    item->data = data;
+    pthread_mutex_lock(&e->lock);
+    item->all = e->items;
+    e->items = item;
+    pthread_mutex_unlock(&e->lock);
+    return item;
 }
 
-static void *pipeline_thread_split(void *ignore) {
-    gPLSplit();
-    return NULL;
+static void pipeline_thread_split(void *ignore) {
+    gEngine->pl_split();
 }
 
-static void *pipeline_thread_process(void *arg) {
+static void pipeline_thread_process(void *arg) {
     size_t thnum = (uintptr_t)arg;
-    gPLProcess(thnum);
-    return NULL;
+    gEngine->pl_process(thnum);
 }
 
 void pipeline_stop(void) {
+    engine_t *e = gEngine;
     // ask the other threads to stop
-    for (size_t i = 0; i < gPLProcessCount; ++i)
-        queue_push(gPipelineSplitQ, PIPELINE_STOP, NULL);
-    for (size_t i = 0; i < gPLProcessCount; ++i) {
-        if (pthread_join(gPLProcessThreads[i], NULL))
-            die("Error joining processing thread");
+    for (size_t i = 0; i < e->pl_process_count; ++i)
+        queue_push(e->split_q, PIPELINE_STOP, NULL);
+    for (size_t i = 0; i < e->pl_process_count; ++i) {
+        pool_join(e->pl_process_jobs[i]);
+        e->pl_process_jobs[i] = NULL;
     }
-    queue_push(gPipelineMergeQ, PIPELINE_STOP, NULL);
+    queue_push(e->merge_q, PIPELINE_STOP, NULL);
 }
 
 void pipeline_destroy(void) {
-    if (pthread_join(gPLSplitThread, NULL))
-        die("Error joining splitter thread");
+    pool_join(gEngine->pl_split_job);
+    gEngine->pl_split_job = NULL;
+    pipeline_free();
+}
+
+// Every item is on the list, wherever it was left
+static void pipeline_free(void) {
+    engine_t *e = gEngine;
+    queue_free(e->start_q);
+    queue_free(e->split_q);
+    queue_free(e->merge_q);
+    e->start_q = e->split_q = e->merge_q = NULL;
+    free(e->pl_process_jobs);
+    e->pl_process_jobs = NULL;
+    pool_unshare(e->pl_shared);
+    e->pl_shared = 0;
     
-    queue_free(gPipelineStartQ);
-    queue_free(gPipelineSplitQ);
-    queue_free(gPipelineMergeQ);
-    free(gPLProcessThreads);
+    while (e->items) {
+        pipeline_item_t *item = e->items;
+        e->items = item->all;
+        e->pl_freer(item->data);
+        free(item);
+    }
+    free(e->pl_merged);
+    e->pl_merged = NULL;
+    e->pl_window = 0;
+}
+
+void pipeline_claim(pipeline_item_t *item) {
+    item->seq = atomic_fetch_add(&gEngine->pl_split_seq, 1);
+}
+
+size_t pipeline_reserve(size_t count) {
+    return atomic_fetch_add(&gEngine->pl_split_seq, count);
 }
 
 void pipeline_dispatch(pipeline_item_t *item, queue_t *q) {
-    item->seq = gPLSplitSeq++;
-    item->next = NULL;
+    pipeline_claim(item);
+    trace_instant("queued", item->seq);
     queue_push(q, PIPELINE_ITEM, item);
 }
 
 void pipeline_split(pipeline_item_t *item) {
-	pipeline_dispatch(item, gPipelineSplitQ);
+	pipeline_dispatch(item, gEngine->split_q);
 }
 
 pipeline_item_t *pipeline_merged() {
+    engine_t *e = gEngine;
     pipeline_item_t *item;
-    while (!gPLMergedItems || gPLMergedItems->seq != gPLMergeSeq) {
+    while (true) {
+        pipeline_item_t **slot = &e->pl_merged[e->pl_merge_seq % e->pl_window];
+        if (*slot && (*slot)->seq == e->pl_merge_seq) {
+            // Got the next item
+            item = *slot;
+            *slot = NULL;
+            ++e->pl_merge_seq;
+            --e->pl_parked;
+            trace_instant("merged", item->seq);
+            return item;
+        }
+        
         // We don't have the next item, wait for a new one
-        pipeline_tag_t tag = queue_pop(gPipelineMergeQ, (void**)&item);
+        pipeline_tag_t tag = queue_pop(e->merge_q, (void**)&item);
         if (tag == PIPELINE_STOP)
             return NULL; // Done processing items
         
-        // Insert the item into the queue
-        pipeline_item_t **prev = &gPLMergedItems;
-        while (*prev && (*prev)->seq < item->seq) {
-            prev = &(*prev)->next;
+        // Park the item in its slot of the window
+        if (++e->pl_parked > gStatsReorderMax)
+            gStatsReorderMax = e->pl_parked;
+        size_t ahead = item->seq - e->pl_merge_seq;
+        if (ahead >= e->pl_window)
+            pipeline_window_grow(ahead);
+        e->pl_merged[item->seq % e->pl_window] = item;
+    }
+}
+
+// Make room for an item ahead of the next one, keeping every parked item in
+// its slot for the new size
+static void pipeline_window_grow(size_t ahead) {
+    engine_t *e = gEngine;
+    size_t size = e->pl_window * 2;
+    if (size <= ahead)
+        size = ahead + 1;
+    pipeline_item_t **items = calloc(size, sizeof(pipeline_item_t*));
+    if (!items)
+        die("Can't allocate reorder window");
+    for (size_t i = 0; i < e->pl_window; ++i) {
+        if (e->pl_merged[i])
+            items[e->pl_merged[i]->seq % size] = e->pl_merged[i];
+    }
+    free(e->pl_merged);
+    e->pl_merged = items;
+    e->pl_window = size;
+}
+
+
+#pragma mark POOL
+
+#define POOL_IDLE_MAX 64 // more idle threads than this just exit
+
+struct pool_job_t {
+    void (*fn)(void *);
+    void *arg;
+    engine_t *engine;
+    bool done;
+    pool_job_t *queued; // waiting for a thread
+    pool_job_t *sibling; // in its engine's list, until joined
+};
+
+static pthread_mutex_t gPoolMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gPoolWork = PTHREAD_COND_INITIALIZER,
+    gPoolDone = PTHREAD_COND_INITIALIZER;
+static pool_job_t *gPoolQueue = NULL, **gPoolTail = &gPoolQueue;
+static size_t gPoolPending = 0, gPoolIdle = 0, gPoolShared = 0;
+
+static void engine_enter(engine_t *e, void (*fn)(void *), void *arg);
+static void stats_job_start(void);
+static void trace_job_end(void);
+static void *pool_thread(void *ignore);
+
+// Without an engine to fail, NULL if there's no memory or thread to be had
+pool_job_t *pool_run(engine_t *e, void (*fn)(void *), void *arg) {
+    pool_job_t *job = malloc(sizeof(pool_job_t));
+    if (!job && !e)
+        return NULL;
+    if (!job)
+        die("Can't allocate job");
+    *job = (pool_job_t){ .fn = fn, .arg = arg, .engine = e };
+    
+    pthread_mutex_lock(&gPoolMutex);
+    if (gPoolPending + 1 > gPoolIdle) {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        int err = pthread_create(&thread, &attr, &pool_thread, NULL);
+        pthread_attr_destroy(&attr);
+        if (err) {
+            pthread_mutex_unlock(&gPoolMutex);
+            free(job);
+            if (!e)
+                return NULL;
+            die("Error creating thread");
         }
-        item->next = *prev;
-        *prev = item;
     }
+    if (e) {
+        job->sibling = e->jobs;
+        e->jobs = job;
+        ++e->running;
+    }
+    *gPoolTail = job;
+    gPoolTail = &job->queued;
+    ++gPoolPending;
+    pthread_cond_signal(&gPoolWork);
+    pthread_mutex_unlock(&gPoolMutex);
+    return job;
+}
+
+void pool_join(pool_job_t *job) {
+    pthread_mutex_lock(&gPoolMutex);
+    while (!job->done)
+        pthread_cond_wait(&gPoolDone, &gPoolMutex);
+    if (job->engine) {
+        pool_job_t **jp = &job->engine->jobs;
+        while (*jp != job)
+            jp = &(*jp)->sibling;
+        *jp = job->sibling;
+    }
+    pthread_mutex_unlock(&gPoolMutex);
+    free(job);
+    engine_check(); // it may have stopped because the engine is failing
+}
+
+size_t pool_share(size_t want) {
+    size_t cores = num_threads();
+    pthread_mutex_lock(&gPoolMutex);
+    size_t left = gPoolShared < cores ? cores - gPoolShared : 0;
+    size_t got = want < left ? want : left;
+    if (!got)
+        got = 1;
+    gPoolShared += got;
+    pthread_mutex_unlock(&gPoolMutex);
+    return got;
+}
+
+void pool_unshare(size_t count) {
+    pthread_mutex_lock(&gPoolMutex);
+    gPoolShared -= count;
+    pthread_mutex_unlock(&gPoolMutex);
+}
+
+// Once a job is done, its engine may be freed at any time
+static void *pool_thread(void *ignore) {
+    pthread_mutex_lock(&gPoolMutex);
+    while (true) {
+        while (!gPoolQueue) {
+            if (gPoolIdle >= POOL_IDLE_MAX) {
+                pthread_mutex_unlock(&gPoolMutex);
+                return NULL;
+            }
+            ++gPoolIdle;
+            pthread_cond_wait(&gPoolWork, &gPoolMutex);
+            --gPoolIdle;
+        }
+        pool_job_t *job = gPoolQueue;
+        if (!(gPoolQueue = job->queued))
+            gPoolTail = &gPoolQueue;
+        --gPoolPending;
+        pthread_mutex_unlock(&gPoolMutex);
+        
+        stats_job_start();
+        if (job->engine)
+            engine_enter(job->engine, job->fn, job->arg);
+        else
+            job->fn(job->arg);
+        trace_job_end();
+        
+        pthread_mutex_lock(&gPoolMutex);
+        job->done = true;
+        if (job->engine)
+            --job->engine->running;
+        pthread_cond_broadcast(&gPoolDone);
+    }
+}
+
+
+#pragma mark ENGINE
+
+struct engine_defer_t {
+    void (*fn)(void *);
+    void *arg;
+    engine_defer_t *next;
+};
+
+#define ENGINE_INIT { \
+    .range_end = -1, \
+    .map_input = true, \
+    .huge_pages = HUGE_PAGES_THP, \
+    .stream = LZMA_STREAM_INIT, \
+    .lock = PTHREAD_MUTEX_INITIALIZER, \
+}
+
+// The command's, and that of any thread not started by another engine
+static engine_t gMainEngine = ENGINE_INIT;
+_Thread_local engine_t *gEngine = &gMainEngine;
+
+static void engine_undo(engine_t *e);
+static void stream_undo(void *stream);
+
+engine_t *engine_new(void) {
+    engine_t *e = malloc(sizeof(engine_t));
+    if (!e)
+        return NULL;
+    *e = (engine_t)ENGINE_INIT;
+    e->recover = true;
+    pthread_mutex_init(&e->lock, NULL);
+    return e;
+}
+
+void engine_free(engine_t *e) {
+    pthread_mutex_destroy(&e->lock);
+    free(e);
+}
+
+// Run fn as a job of e. If anything in it dies, it ends here.
+static void engine_enter(engine_t *e, void (*fn)(void *), void *arg) {
+    engine_t *prev = gEngine;
+    jmp_buf *prev_unwind = gUnwind;
+    jmp_buf here;
+    gEngine = e;
+    gUnwind = &here;
+    if (!setjmp(here))
+        fn(arg);
+    gEngine = prev;
+    gUnwind = prev_unwind;
+}
+
+// Run an operation from this thread. If it dies, wait for every job it
+// started to give up, and undo what they left behind.
+bool engine_run(engine_t *e, void (*fn)(void *), void *arg) {
+    engine_enter(e, fn, arg);
+    if (!atomic_load(&e->aborted))
+        return true;
     
-    // Got the next item
-    item = gPLMergedItems;
-    gPLMergedItems = item->next;
-    ++gPLMergeSeq;
-    return item;
+    pthread_mutex_lock(&gPoolMutex);
+    while (e->running)
+        pthread_cond_wait(&gPoolDone, &gPoolMutex);
+    while (e->jobs) {
+        pool_job_t *job = e->jobs;
+        e->jobs = job->sibling;
+        free(job);
+    }
+    pthread_mutex_unlock(&gPoolMutex);
+    engine_undo(e);
+    return false;
+}
+
+// Nothing else runs in the engine now. Deferred things are undone newest
+// first.
+static void engine_undo(engine_t *e) {
+    engine_t *prev = gEngine;
+    gEngine = e;
+    if (e->start_q)
+        pipeline_free(); // its items may need the operation's state
+    while (e->defers) {
+        engine_defer_t *d = e->defers;
+        e->defers = d->next;
+        d->fn(d->arg);
+        free(d);
+    }
+    while (e->queues)
+        queue_free(e->queues);
+    free_file_index();
+    tar_data_read(0, NULL, 0);
+    free(e->fib);
+    e->fib = NULL;
+    if (e->index)
+        lzma_index_end(e->index, NULL);
+    e->index = NULL;
+    lzma_end(&e->stream);
+    gEngine = prev;
+}
+
+void engine_abort(engine_t *e, const char *why) {
+    engine_fail(e, why, false);
+}
+
+// Only the first failure is kept, the rest are likely just its echoes
+static void engine_fail(engine_t *e, const char *why, bool io) {
+    pthread_mutex_lock(&e->lock);
+    if (!atomic_load(&e->aborted)) {
+        snprintf(e->message, sizeof(e->message), "%s", why);
+        e->io_error = io;
+        atomic_store(&e->aborted, true);
+        for (queue_t *q = e->queues; q; q = q->next) {
+            pthread_mutex_lock(&q->mutex);
+            pthread_cond_broadcast(&q->pop_cond);
+            pthread_cond_broadcast(&q->push_cond);
+            pthread_mutex_unlock(&q->mutex);
+        }
+        if (e->wake)
+            e->wake(e->wake_arg);
+    }
+    pthread_mutex_unlock(&e->lock);
+}
+
+void engine_check(void) {
+    if (atomic_load(&gEngine->aborted))
+        engine_unwind();
+}
+
+static void engine_unwind(void) {
+    if (!gUnwind)
+        abort(); // only engines that can recover fail, in their own jobs
+    longjmp(*gUnwind, 1);
+}
+
+// The command can't fail without exiting, so it has nothing to undo
+void engine_defer(void (*fn)(void *), void *arg) {
+    engine_t *e = gEngine;
+    if (!e->recover)
+        return;
+    engine_defer_t *d = malloc(sizeof(engine_defer_t));
+    if (!d)
+        die("Can't allocate memory");
+    d->fn = fn;
+    d->arg = arg;
+    pthread_mutex_lock(&e->lock);
+    d->next = e->defers;
+    e->defers = d;
+    pthread_mutex_unlock(&e->lock);
+}
+
+void engine_release(void *arg) {
+    engine_t *e = gEngine;
+    if (!e->recover)
+        return;
+    pthread_mutex_lock(&e->lock);
+    for (engine_defer_t **dp = &e->defers; *dp; dp = &(*dp)->next) {
+        if ((*dp)->arg == arg) {
+            engine_defer_t *d = *dp;
+            *dp = d->next;
+            free(d);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&e->lock);
+}
+
+lzma_stream *stream_new(void) {
+    lzma_stream *stream = malloc(sizeof(lzma_stream));
+    if (!stream)
+        die("Can't allocate stream");
+    *stream = (lzma_stream)LZMA_STREAM_INIT;
+    engine_defer(&stream_undo, stream);
+    return stream;
+}
+
+void stream_free(lzma_stream *stream) {
+    engine_release(stream);
+    stream_undo(stream);
+}
+
+static void stream_undo(void *stream) {
+    lzma_end(stream);
+    free(stream);
+}
+
+
+#pragma mark STATS
+
+#define STATS_THREADS_MAX 1024
+
+typedef struct {
+    const char *role;
+    double cpu;
+} stats_thread_t;
+
+bool gStats = false;
+atomic_uint_fast64_t gStatsWait[STATS_QUEUES];
+size_t gStatsReorderMax = 0;
+size_t gStatsBlockSize = 0;
+
+static struct timespec gStatsStart;
+static atomic_uint_fast64_t gStatsBlocks, gStatsIn, gStatsOut, gStatsStored;
+static atomic_uint_fast64_t gStatsLevels[10];
+static stats_thread_t gStatsThreads[STATS_THREADS_MAX];
+static size_t gStatsThreadCount = 0;
+static pthread_mutex_t gStatsMutex = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local double gStatsCpuBase = 0; // when this thread's job began
+
+static double stats_cpu(void);
+static double stats_mbs(uint64_t bytes, double secs);
+
+void stats_start(void) {
+    gStats = true;
+    clock_gettime(CLOCK_MONOTONIC, &gStatsStart);
+}
+
+static uint64_t stats_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000000000ULL
+        + now.tv_nsec - start->tv_nsec;
+}
+
+static double stats_cpu(void) {
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+        return 0;
+    return ts.tv_sec + ts.tv_nsec / 1e9 - gStatsCpuBase;
+}
+
+// Pool threads run many jobs, each is counted on its own
+static void stats_job_start(void) {
+    gStatsCpuBase = 0;
+    if (gStats)
+        gStatsCpuBase = stats_cpu();
+}
+
+void stats_thread_end(const char *role) {
+    trace_role(role);
+    if (!gStats)
+        return;
+    double cpu = stats_cpu();
+    pthread_mutex_lock(&gStatsMutex);
+    if (gStatsThreadCount < STATS_THREADS_MAX)
+        gStatsThreads[gStatsThreadCount++] = (stats_thread_t){ role, cpu };
+    pthread_mutex_unlock(&gStatsMutex);
+}
+
+void stats_block(size_t in, size_t out) {
+    if (!gStats)
+        return;
+    atomic_fetch_add_explicit(&gStatsBlocks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&gStatsIn, in, memory_order_relaxed);
+    atomic_fetch_add_explicit(&gStatsOut, out, memory_order_relaxed);
+}
+
+void stats_stored(void) {
+    if (gStats)
+        atomic_fetch_add_explicit(&gStatsStored, 1, memory_order_relaxed);
+}
+
+void stats_level(int level) {
+    if (gStats && level >= 0 && level < 10)
+        atomic_fetch_add_explicit(&gStatsLevels[level], 1,
+            memory_order_relaxed);
+}
+
+static double stats_mbs(uint64_t bytes, double secs) {
+    return secs > 0 ? bytes / secs / (1024 * 1024) : 0;
+}
+
+// Bytes count block data, before and after each encoder or decoder
+void stats_report(void) {
+    if (!gStats)
+        return;
+    stats_thread_end("main"); // the writer, in most operations
+    double secs = stats_since(&gStatsStart) / 1e9;
+    uint64_t in = atomic_load(&gStatsIn), out = atomic_load(&gStatsOut);
+
+    fprintf(stderr, "{\n");
+    fprintf(stderr, "  \"seconds\": %.3f,\n", secs);
+    fprintf(stderr, "  \"blocks\": %"PRIuMAX",\n",
+        (uintmax_t)atomic_load(&gStatsBlocks));
+    fprintf(stderr, "  \"bytes_in\": %"PRIuMAX", \"bytes_out\": %"PRIuMAX",\n",
+        (uintmax_t)in, (uintmax_t)out);
+    fprintf(stderr, "  \"mb_s_in\": %.2f, \"mb_s_out\": %.2f,\n",
+        stats_mbs(in, secs), stats_mbs(out, secs));
+    if (gStatsBlockSize) {
+        fprintf(stderr, "  \"block_size\": %zu,\n", gStatsBlockSize);
+        fprintf(stderr, "  \"stored_blocks\": %"PRIuMAX",\n",
+            (uintmax_t)atomic_load(&gStatsStored));
+        fprintf(stderr, "  \"levels\": {");
+        const char *sep = "";
+        for (int l = 0; l < 10; ++l) {
+            uint64_t n = atomic_load(&gStatsLevels[l]);
+            if (n) {
+                fprintf(stderr, "%s\"%d\": %"PRIuMAX, sep, l, (uintmax_t)n);
+                sep = ", ";
+            }
+        }
+        fprintf(stderr, "},\n");
+    }
+    fprintf(stderr, "  \"wait_seconds\": { \"start_q\": %.3f, \"split_q\": %.3f, "
+        "\"merge_q\": %.3f },\n",
+        atomic_load(&gStatsWait[STATS_START_Q]) / 1e9,
+        atomic_load(&gStatsWait[STATS_SPLIT_Q]) / 1e9,
+        atomic_load(&gStatsWait[STATS_MERGE_Q]) / 1e9);
+    fprintf(stderr, "  \"reorder_max\": %zu,\n", gStatsReorderMax);
+
+    fprintf(stderr, "  \"threads\": [");
+    pthread_mutex_lock(&gStatsMutex);
+    for (size_t i = 0; i < gStatsThreadCount; ++i) {
+        stats_thread_t *t = &gStatsThreads[i];
+        fprintf(stderr, "%s\n    { \"role\": \"%s\", \"busy_seconds\": %.3f, "
+            "\"busy\": %.2f }", i ? "," : "", t->role, t->cpu,
+            secs > 0 ? t->cpu / secs : 0);
+    }
+    pthread_mutex_unlock(&gStatsMutex);
+    fprintf(stderr, "\n  ]\n}\n");
+}
+
+
+#pragma mark TRACE
+
+#define TRACE_BUFSIZE 4096 // events per thread, between flushes
+#define TRACE_INSTANT UINT64_MAX
+
+typedef struct {
+    const char *name;
+    uint64_t ts, dur; // nanoseconds since trace_start
+    size_t seq, in, out;
+} trace_event_t;
+
+typedef struct {
+    int tid;
+    const char *role;
+    size_t count;
+    trace_event_t events[TRACE_BUFSIZE];
+} trace_buf_t;
+
+FILE *gTraceFile = NULL;
+
+static struct timespec gTraceStart;
+static pthread_key_t gTraceKey;
+static atomic_int gTraceTids;
+static bool gTraceFirst = true;
+static pthread_mutex_t gTraceMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static trace_buf_t *trace_buf(void);
+static void trace_add(const char *name, uint64_t ts, uint64_t dur, size_t seq,
+    size_t in, size_t out);
+static void trace_flush(trace_buf_t *tb, bool last);
+static void trace_thread_end(void *data);
+
+void trace_start(const char *path) {
+    if (!(gTraceFile = fopen(path, "w")))
+        die("Can't open trace file %s: %s", path, strerror(errno));
+    if (pthread_key_create(&gTraceKey, &trace_thread_end))
+        die("Can't create trace key");
+    clock_gettime(CLOCK_MONOTONIC, &gTraceStart);
+    // The array form, so a trace cut short by die() still loads
+    fprintf(gTraceFile, "[\n");
+}
+
+uint64_t trace_now(void) {
+    if (!gTraceFile)
+        return 0;
+    return stats_since(&gTraceStart);
+}
+
+void trace_span(const char *name, uint64_t start, size_t seq, size_t in,
+        size_t out) {
+    if (gTraceFile)
+        trace_add(name, start, trace_now() - start, seq, in, out);
+}
+
+void trace_instant(const char *name, size_t seq) {
+    if (gTraceFile)
+        trace_add(name, trace_now(), TRACE_INSTANT, seq, 0, 0);
+}
+
+// Threads that have already exited flushed their own events
+void trace_finish(void) {
+    if (!gTraceFile)
+        return;
+    trace_buf_t *tb = trace_buf();
+    if (!tb->role)
+        tb->role = "main";
+    trace_flush(tb, true);
+    pthread_setspecific(gTraceKey, NULL);
+    free(tb);
+    pthread_mutex_lock(&gTraceMutex);
+    fprintf(gTraceFile, "\n]\n");
+    if (fclose(gTraceFile) != 0)
+        die("Error writing trace: %s", strerror(errno));
+    gTraceFile = NULL;
+    pthread_mutex_unlock(&gTraceMutex);
+}
+
+static trace_buf_t *trace_buf(void) {
+    trace_buf_t *tb = pthread_getspecific(gTraceKey);
+    if (!tb) {
+        if (!(tb = malloc(sizeof(trace_buf_t))))
+            die("Can't allocate trace buffer");
+        tb->tid = atomic_fetch_add(&gTraceTids, 1);
+        tb->role = NULL;
+        tb->count = 0;
+        pthread_setspecific(gTraceKey, tb);
+    }
+    return tb;
+}
+
+static void trace_add(const char *name, uint64_t ts, uint64_t dur, size_t seq,
+        size_t in, size_t out) {
+    trace_buf_t *tb = trace_buf();
+    if (tb->count == TRACE_BUFSIZE)
+        trace_flush(tb, false);
+    tb->events[tb->count++] = (trace_event_t){ name, ts, dur, seq, in, out };
+}
+
+void trace_role(const char *role) {
+    if (gTraceFile)
+        trace_buf()->role = role;
+}
+
+// The thread is named on its last flush, when its role is surely known
+static void trace_flush(trace_buf_t *tb, bool last) {
+    pthread_mutex_lock(&gTraceMutex);
+    FILE *f = gTraceFile;
+    if (f && last && tb->role) {
+        fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, "
+            "\"tid\": %d, \"args\": {\"name\": \"%s %d\"}}",
+            gTraceFirst ? "" : ",\n", tb->tid, tb->role, tb->tid);
+        gTraceFirst = false;
+    }
+    for (size_t i = 0; f && i < tb->count; ++i) {
+        trace_event_t *e = &tb->events[i];
+        fprintf(f, "%s{\"name\": \"%s\", \"pid\": 1, \"tid\": %d, "
+            "\"ts\": %.3f, ", gTraceFirst ? "" : ",\n", e->name, tb->tid,
+            e->ts / 1e3);
+        gTraceFirst = false;
+        if (e->dur == TRACE_INSTANT)
+            fprintf(f, "\"ph\": \"i\", \"s\": \"t\", ");
+        else
+            fprintf(f, "\"ph\": \"X\", \"dur\": %.3f, ", e->dur / 1e3);
+        fprintf(f, "\"args\": {\"seq\": %zd", (ssize_t)e->seq);
+        if (e->in || e->out)
+            fprintf(f, ", \"in\": %zu, \"out\": %zu", e->in, e->out);
+        fprintf(f, "}}");
+    }
+    pthread_mutex_unlock(&gTraceMutex);
+    tb->count = 0;
+}
+
+// Each job on a pool thread shows up as a thread of its own
+static void trace_job_end(void) {
+    if (!gTraceFile)
+        return;
+    trace_buf_t *tb = pthread_getspecific(gTraceKey);
+    if (!tb)
+        return;
+    trace_flush(tb, true);
+    pthread_setspecific(gTraceKey, NULL);
+    free(tb);
+}
+
+static void trace_thread_end(void *data) {
+    trace_flush((trace_buf_t*)data, true);
+    free(data);
 }
@@ -1,5 +1,196 @@
+#include "pixz.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <unistd.h>
 
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+#pragma mark FUNCTION DECLARATIONS
+
+// Read a limit from one cgroup directory, false if it has none
+typedef bool (*cgroup_read_t)(const char *dir, double *limit);
+
+static double cgroup_limit(const char *controller, const char *mount,
+    cgroup_read_t rd);
+static bool cgroup_path(const char *controller, char *path, size_t size);
+static bool cgroup_file(const char *dir, const char *name, char *buf,
+    size_t size);
+static bool cpu_max(const char *dir, double *cpus);
+static bool cpu_cfs(const char *dir, double *cpus);
+static bool memory_max(const char *dir, double *bytes);
+static size_t affinity_cpus(void);
+static void count_threads(void);
+
+
+#pragma mark LIMITS
+
+static pthread_once_t gThreadsOnce = PTHREAD_ONCE_INIT;
+static size_t gThreads;
+
+// Asked for from any thread, and more than once: only read /proc and cgroups
+// the first time
 size_t num_threads(void) {
-    return sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_once(&gThreadsOnce, count_threads);
+    return gThreads;
+}
+
+// Containers see all the host's CPUs, but may only be allowed a few of them,
+// or a share of their time
+static void count_threads(void) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+    size_t cpus = online > 0 ? online : 1;
+    size_t allowed = affinity_cpus();
+    if (allowed && allowed < cpus)
+        cpus = allowed;
+
+    double quota = cgroup_limit(NULL, CGROUP_ROOT, cpu_max);
+    double v1 = cgroup_limit("cpu", CGROUP_ROOT "/cpu", cpu_cfs);
+    if (v1 && (!quota || v1 < quota))
+        quota = v1;
+    if (quota && ceil(quota) < cpus)
+        cpus = ceil(quota);
+    gThreads = cpus;
+}
+
+uint64_t physical_memory(void) {
+    long pages = sysconf(_SC_PHYS_PAGES), size = sysconf(_SC_PAGESIZE);
+    if (pages <= 0 || size <= 0)
+        return 0;
+    uint64_t mem = (uint64_t)pages * size;
+
+    double limit = cgroup_limit(NULL, CGROUP_ROOT, memory_max);
+    double v1 = cgroup_limit("memory", CGROUP_ROOT "/memory", memory_max);
+    if (v1 && (!limit || v1 < limit))
+        limit = v1;
+    if (limit && limit < mem)
+        mem = limit;
+    return mem;
+}
+
+static size_t affinity_cpus(void) {
+#ifdef HAVE_SCHED_GETAFFINITY
+    // The kernel's mask may be bigger than a cpu_set_t
+    for (size_t n = CPU_SETSIZE; n <= 1024 * 1024; n *= 2) {
+        cpu_set_t *set = CPU_ALLOC(n);
+        if (!set)
+            return 0;
+        size_t bytes = CPU_ALLOC_SIZE(n);
+        int ok = sched_getaffinity(0, bytes, set);
+        size_t count = ok == 0 ? CPU_COUNT_S(bytes, set) : 0;
+        CPU_FREE(set);
+        if (ok == 0)
+            return count;
+        if (errno != EINVAL)
+            return 0;
+    }
+#endif
+    return 0;
+}
+
+
+#pragma mark CGROUPS
+
+// The tightest limit of our cgroup and its parents, zero if there's none.
+// A NULL controller means the unified cgroup v2 hierarchy.
+static double cgroup_limit(const char *controller, const char *mount,
+        cgroup_read_t rd) {
+    char dir[PATH_MAX];
+    size_t len = snprintf(dir, sizeof(dir), "%s", mount);
+    if (len >= sizeof(dir)
+            || !cgroup_path(controller, dir + len, sizeof(dir) - len))
+        return 0;
+
+    // Inside a container our path may not exist, then only the top is ours
+    double best = 0, limit;
+    while (true) {
+        if (rd(dir, &limit) && limit > 0 && (!best || limit < best))
+            best = limit;
+        char *slash = strrchr(dir + len, '/');
+        if (!slash)
+            break;
+        *slash = '\0';
+    }
+    return best;
+}
+
+// Lines of /proc/self/cgroup look like "4:cpu,cpuacct:/path", or "0::/path"
+static bool cgroup_path(const char *controller, char *path, size_t size) {
+    FILE *f = fopen("/proc/self/cgroup", "r");
+    if (!f)
+        return false;
+    char line[PATH_MAX + 256];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        char *list = strchr(line, ':'), *rel;
+        if (!list || !(rel = strchr(++list, ':')))
+            continue;
+        *rel++ = '\0';
+        if (!controller) {
+            found = (*list == '\0');
+        } else {
+            char *save;
+            for (char *c = strtok_r(list, ",", &save); c && !found;
+                    c = strtok_r(NULL, ",", &save))
+                found = (strcmp(c, controller) == 0);
+        }
+        if (found && strcmp(rel, "/") == 0)
+            *rel = '\0'; // the root, don't end up with a trailing slash
+        if (found && (size_t)snprintf(path, size, "%s", rel) >= size)
+            found = false;
+    }
+    fclose(f);
+    return found;
+}
+
+static bool cgroup_file(const char *dir, const char *name, char *buf,
+        size_t size) {
+    char path[PATH_MAX];
+    if ((size_t)snprintf(path, sizeof(path), "%s/%s", dir, name)
+            >= sizeof(path))
+        return false;
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return false;
+    bool ok = fgets(buf, size, f) != NULL;
+    fclose(f);
+    return ok;
+}
+
+// cgroup v2 cpu.max is "QUOTA PERIOD", or "max PERIOD" for no limit
+static bool cpu_max(const char *dir, double *cpus) {
+    char buf[64];
+    double quota, period;
+    if (!cgroup_file(dir, "cpu.max", buf, sizeof(buf))
+            || sscanf(buf, "%lf %lf", &quota, &period) != 2 || period <= 0)
+        return false;
+    *cpus = quota / period;
+    return true;
+}
+
+// cgroup v1 has a quota of -1 for no limit
+static bool cpu_cfs(const char *dir, double *cpus) {
+    char buf[64];
+    double quota, period;
+    if (!cgroup_file(dir, "cpu.cfs_quota_us", buf, sizeof(buf))
+            || sscanf(buf, "%lf", &quota) != 1 || quota <= 0)
+        return false;
+    if (!cgroup_file(dir, "cpu.cfs_period_us", buf, sizeof(buf))
+            || sscanf(buf, "%lf", &period) != 1 || period <= 0)
+        return false;
+    *cpus = quota / period;
+    return true;
+}
+
+// memory.max in v2, memory.limit_in_bytes in v1, with "max" for no limit
+static bool memory_max(const char *dir, double *bytes) {
+    char buf[64];
+    if (!cgroup_file(dir, "memory.max", buf, sizeof(buf))
+            && !cgroup_file(dir, "memory.limit_in_bytes", buf, sizeof(buf)))
+        return false;
+    return sscanf(buf, "%lf", bytes) == 1;
 }
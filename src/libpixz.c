@@ -0,0 +1,400 @@
+#include "pixz.h"
+#include "libpixz.h"
+
+#include <errno.h>
+#include <unistd.h>
+
+#pragma mark TYPES
+
+struct pixz_ctx {
+    pixz_action action;
+    uint32_t level;
+    bool tar;
+    engine_t *engine; // with the other settings, and the operation's state
+
+    int in, out;
+    pixz_read_fn rd;
+    pixz_write_fn wr;
+    void *opaque;
+
+    // With pixz_code, the engine runs as a job of the pool. Its reads and
+    // writes wait for pixz_code to copy straight between its buffers and the
+    // caller's.
+    bool started, done;
+    pixz_ret ret; // once done
+    pool_job_t *job;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond; // for either side
+    bool ended; // the engine is done
+    uint8_t *rd_buf; // a read waiting for input
+    size_t rd_size, rd_got;
+    const uint8_t *wr_buf; // a write waiting to be drained
+    size_t wr_size;
+};
+
+
+#pragma mark GLOBALS
+
+#define CODE_BUFSIZE (64 * 1024)
+
+
+#pragma mark FUNCTION DECLARATIONS
+
+static void ctx_operation(void *data);
+static FILE *ctx_file(pixz_ctx *ctx, int fd, const char *mode);
+static void file_undo(void *f);
+static pixz_ret ctx_error(pixz_ctx *ctx);
+static pixz_ret run_callbacks(pixz_ctx *ctx);
+
+static pixz_ret code_start(pixz_ctx *ctx);
+static void code_thread(void *data);
+static pixz_ret code_join(pixz_ctx *ctx);
+static ssize_t code_read(void *opaque, void *buf, size_t size);
+static ssize_t code_write(void *opaque, const void *buf, size_t size);
+static void code_wake(void *opaque);
+
+
+#pragma mark CONTEXTS
+
+pixz_ctx *pixz_new(pixz_action action) {
+    pixz_ctx *ctx = calloc(1, sizeof(pixz_ctx));
+    if (!ctx)
+        return NULL;
+    if (!(ctx->engine = engine_new())) {
+        free(ctx);
+        return NULL;
+    }
+    ctx->action = action;
+    ctx->level = LZMA_PRESET_DEFAULT;
+    ctx->tar = true;
+    ctx->in = ctx->out = -1;
+    pthread_mutex_init(&ctx->mutex, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+    return ctx;
+}
+
+void pixz_end(pixz_ctx *ctx) {
+    if (!ctx)
+        return;
+    if (ctx->started && !ctx->done) {
+        engine_abort(ctx->engine, "Cancelled");
+        code_join(ctx);
+    }
+    pthread_mutex_destroy(&ctx->mutex);
+    pthread_cond_destroy(&ctx->cond);
+    engine_free(ctx->engine);
+    free(ctx);
+}
+
+const char *pixz_message(const pixz_ctx *ctx) {
+    if (!ctx->done || !ctx->engine->message[0])
+        return NULL;
+    return ctx->engine->message;
+}
+
+void pixz_set_level(pixz_ctx *ctx, uint32_t preset) {
+    ctx->level = preset;
+}
+
+void pixz_set_threads(pixz_ctx *ctx, size_t threads) {
+    ctx->engine->process_max = threads;
+}
+
+void pixz_set_memlimit(pixz_ctx *ctx, uint64_t bytes) {
+    ctx->engine->mem_limit = bytes;
+}
+
+void pixz_set_tar(pixz_ctx *ctx, bool tar) {
+    ctx->tar = tar;
+}
+
+void pixz_set_range(pixz_ctx *ctx, uint64_t offset, uint64_t length) {
+    ctx->engine->range_start = offset;
+    ctx->engine->range_end = offset + length;
+}
+
+void pixz_set_fds(pixz_ctx *ctx, int in, int out) {
+    ctx->in = in;
+    ctx->out = out;
+}
+
+void pixz_set_callbacks(pixz_ctx *ctx, pixz_read_fn rd, pixz_write_fn wr,
+        void *opaque) {
+    ctx->rd = rd;
+    ctx->wr = wr;
+    ctx->opaque = opaque;
+}
+
+
+#pragma mark RUNNING
+
+pixz_ret pixz_run(pixz_ctx *ctx) {
+    if (ctx->started) {
+        errno = EINVAL;
+        return PIXZ_ERROR;
+    }
+    if (ctx->rd && ctx->wr)
+        return run_callbacks(ctx);
+    if (ctx->in == -1 || ctx->out == -1) {
+        errno = EINVAL;
+        return PIXZ_ERROR;
+    }
+    if (ctx->engine->range_end != -1 && (ctx->action != PIXZ_DECOMPRESS
+            || lseek(ctx->in, 0, SEEK_CUR) == -1)) {
+        errno = ctx->action != PIXZ_DECOMPRESS ? EINVAL : ESPIPE;
+        return PIXZ_ERROR;
+    }
+    ctx->started = ctx->done = true;
+    ctx->ret = engine_run(ctx->engine, &ctx_operation, ctx)
+        ? PIXZ_STREAM_END : ctx_error(ctx);
+    return ctx->ret;
+}
+
+// In the engine. Whatever files are left open at the end are ours to close.
+static void ctx_operation(void *data) {
+    pixz_ctx *ctx = (pixz_ctx*)data;
+    engine_t *e = gEngine;
+    e->in_file = ctx_file(ctx, ctx->in, "r");
+    e->out_file = ctx_file(ctx, ctx->out, "w");
+
+    switch (ctx->action) {
+        case PIXZ_COMPRESS: pixz_write(ctx->tar, ctx->level); break;
+        case PIXZ_DECOMPRESS: pixz_read(ctx->tar, 0, NULL); break;
+        case PIXZ_LIST: pixz_list(ctx->tar); break;
+        case PIXZ_TEST: pixz_test(ctx->tar);
+    }
+
+    if (e->in_file)
+        close_file(e->in_file);
+    if (e->out_file && close_file(e->out_file) != 0)
+        die("Error writing output: %s", strerror(errno));
+    e->in_file = e->out_file = NULL;
+}
+
+// Our own copy of a descriptor, or a stand-in that can't seek when the data
+// comes through the engine's hooks
+static FILE *ctx_file(pixz_ctx *ctx, int fd, const char *mode) {
+    FILE *f = NULL;
+    if (gEngine->in_read) {
+#if HAVE_FOPENCOOKIE
+        cookie_io_functions_t io = { .read = NULL };
+        if (*mode == 'r')
+            io.read = (cookie_read_function_t*)&code_read;
+        else
+            io.write = (cookie_write_function_t*)&code_write;
+        f = fopencookie(ctx, mode, io);
+#elif HAVE_FUNOPEN
+        f = *mode == 'r'
+            ? funopen(ctx, (int (*)(void*, char*, int))&code_read,
+                NULL, NULL, NULL)
+            : funopen(ctx, NULL, (int (*)(void*, const char*, int))&code_write,
+                NULL, NULL);
+#endif
+    } else {
+        int dfd = dup(fd);
+        if (dfd != -1 && !(f = fdopen(dfd, mode)))
+            close(dfd);
+    }
+    if (!f)
+        die("Can't open descriptors: %s", strerror(errno));
+    engine_defer(&file_undo, f);
+    return f;
+}
+
+static void file_undo(void *f) {
+    fclose((FILE*)f);
+}
+
+static pixz_ret ctx_error(pixz_ctx *ctx) {
+    return ctx->engine->io_error ? PIXZ_IO_ERROR : PIXZ_DATA_ERROR;
+}
+
+// Callbacks just shuttle between the caller and pixz_code, so they're only
+// ever called from the caller's thread
+static pixz_ret run_callbacks(pixz_ctx *ctx) {
+    if (ctx->action == PIXZ_LIST || ctx->action == PIXZ_TEST) {
+        errno = EINVAL;
+        return PIXZ_ERROR;
+    }
+
+    uint8_t *in = malloc(CODE_BUFSIZE), *out = malloc(CODE_BUFSIZE);
+    size_t in_pos = 0, in_size = 0;
+    bool finish = false;
+    pixz_ret ret = PIXZ_OK;
+    while (ret == PIXZ_OK) {
+        if (!finish && in_pos == in_size) {
+            ssize_t rd = ctx->rd(ctx->opaque, in, CODE_BUFSIZE);
+            if (rd == -1) {
+                ret = PIXZ_IO_ERROR;
+                break;
+            }
+            in_pos = 0;
+            in_size = rd;
+            finish = (rd == 0);
+        }
+
+        size_t out_pos = 0;
+        ret = pixz_code(ctx, in, &in_pos, in_size, out, &out_pos,
+            CODE_BUFSIZE, finish);
+        for (size_t done = 0; done < out_pos; ) {
+            ssize_t wr = ctx->wr(ctx->opaque, out + done, out_pos - done);
+            if (wr <= 0) {
+                ret = PIXZ_IO_ERROR;
+                break;
+            }
+            done += wr;
+        }
+    }
+    if (ctx->started && !ctx->done) { // a callback failed, give up
+        engine_abort(ctx->engine, "Error in a callback");
+        code_join(ctx);
+    }
+    free(in);
+    free(out);
+    return ret;
+}
+
+
+#pragma mark CODING
+
+pixz_ret pixz_code(pixz_ctx *ctx,
+        const uint8_t *in, size_t *in_pos, size_t in_size,
+        uint8_t *out, size_t *out_pos, size_t out_size, bool finish) {
+    if (ctx->done)
+        return ctx->ret;
+    if (!ctx->started && code_start(ctx) != PIXZ_OK)
+        return PIXZ_ERROR;
+
+    pthread_mutex_lock(&ctx->mutex);
+    while (true) {
+        bool progress = false;
+        if (ctx->rd_buf && (*in_pos < in_size || finish)) {
+            size_t size = in_size - *in_pos;
+            if (size > ctx->rd_size)
+                size = ctx->rd_size;
+            memcpy(ctx->rd_buf, in + *in_pos, size);
+            *in_pos += size;
+            ctx->rd_got = size; // zero for the end of the input
+            ctx->rd_buf = NULL;
+            progress = size;
+            pthread_cond_broadcast(&ctx->cond);
+        }
+        if (ctx->wr_buf && *out_pos < out_size) {
+            size_t size = out_size - *out_pos;
+            if (size > ctx->wr_size)
+                size = ctx->wr_size;
+            memcpy(out + *out_pos, ctx->wr_buf, size);
+            *out_pos += size;
+            ctx->wr_buf += size;
+            if (!(ctx->wr_size -= size)) {
+                ctx->wr_buf = NULL;
+                pthread_cond_broadcast(&ctx->cond);
+            }
+            progress = true;
+        }
+
+        if (ctx->ended) {
+            pthread_mutex_unlock(&ctx->mutex);
+            return code_join(ctx);
+        }
+        if (progress || *out_pos == out_size)
+            break;
+        if (!finish && *in_pos == in_size)
+            break; // the engine may be waiting for more input
+        pthread_cond_wait(&ctx->cond, &ctx->mutex);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+    return PIXZ_OK;
+}
+
+static pixz_ret code_start(pixz_ctx *ctx) {
+    if (ctx->action == PIXZ_LIST || ctx->action == PIXZ_TEST
+            || ctx->engine->range_end != -1) {
+        errno = EINVAL;
+        return PIXZ_ERROR;
+    }
+#if !HAVE_FOPENCOOKIE && !HAVE_FUNOPEN
+    errno = ENOSYS; // no way to make the engine's stand-in files
+    return PIXZ_ERROR;
+#endif
+
+    engine_t *e = ctx->engine;
+    e->in_read = &code_read;
+    e->out_write = &code_write;
+    e->io_opaque = ctx;
+    e->wake = &code_wake;
+    e->wake_arg = ctx;
+    if (!(ctx->job = pool_run(NULL, &code_thread, ctx)))
+        return PIXZ_ERROR;
+    ctx->started = true;
+    return PIXZ_OK;
+}
+
+static void code_thread(void *data) {
+    pixz_ctx *ctx = (pixz_ctx*)data;
+    bool ok = engine_run(ctx->engine, &ctx_operation, ctx);
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->ret = ok ? PIXZ_STREAM_END : ctx_error(ctx);
+    ctx->ended = true;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+static pixz_ret code_join(pixz_ctx *ctx) {
+    if (ctx->done)
+        return ctx->ret;
+    pool_join(ctx->job);
+    ctx->job = NULL;
+    ctx->done = true;
+    return ctx->ret;
+}
+
+// In the engine, like read(2): wait for pixz_code to fill some of buf
+static ssize_t code_read(void *opaque, void *buf, size_t size) {
+    pixz_ctx *ctx = (pixz_ctx*)opaque;
+    engine_t *e = ctx->engine;
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->rd_buf = buf;
+    ctx->rd_size = size;
+    pthread_cond_broadcast(&ctx->cond);
+    while (ctx->rd_buf && !atomic_load(&e->aborted))
+        pthread_cond_wait(&ctx->cond, &ctx->mutex);
+    bool ok = !ctx->rd_buf;
+    ctx->rd_buf = NULL;
+    pthread_mutex_unlock(&ctx->mutex);
+    if (!ok) {
+        errno = ECANCELED;
+        return -1;
+    }
+    return ctx->rd_got;
+}
+
+// Like write(2), but waits for pixz_code to take all of buf
+static ssize_t code_write(void *opaque, const void *buf, size_t size) {
+    pixz_ctx *ctx = (pixz_ctx*)opaque;
+    engine_t *e = ctx->engine;
+    if (!size)
+        return 0;
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->wr_buf = buf;
+    ctx->wr_size = size;
+    pthread_cond_broadcast(&ctx->cond);
+    while (ctx->wr_buf && !atomic_load(&e->aborted))
+        pthread_cond_wait(&ctx->cond, &ctx->mutex);
+    bool ok = !ctx->wr_buf;
+    ctx->wr_buf = NULL;
+    pthread_mutex_unlock(&ctx->mutex);
+    if (!ok) {
+        errno = EPIPE;
+        return -1;
+    }
+    return size;
+}
+
+// The engine is failing: give up waiting on pixz_code
+static void code_wake(void *opaque) {
+    pixz_ctx *ctx = (pixz_ctx*)opaque;
+    pthread_mutex_lock(&ctx->mutex);
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->mutex);
+}
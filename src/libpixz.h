@@ -0,0 +1,87 @@
+#ifndef LIBPIXZ_H
+#define LIBPIXZ_H
+
+// Run pixz in-process, in the style of liblzma's lzma_code().
+//
+// A context holds one operation and its settings. Give it file descriptors,
+// read and write callbacks, or feed it buffers with pixz_code(). Contexts are
+// independent, and may run at once from any threads: their workers come from
+// one pool shared by them all. Corrupt input and I/O errors end just that
+// operation, with PIXZ_DATA_ERROR or PIXZ_IO_ERROR. Nothing is printed, ask
+// pixz_message() why.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct pixz_ctx pixz_ctx;
+
+// Only these are exported from the library, the engine behind them is hidden
+#if defined(__GNUC__)
+#define PIXZ_API __attribute__((visibility("default")))
+#else
+#define PIXZ_API
+#endif
+
+typedef enum {
+    PIXZ_COMPRESS,
+    PIXZ_DECOMPRESS,
+    PIXZ_LIST,      // seekable input only, not with pixz_code()
+    PIXZ_TEST       // like --test, seekable input only, not with pixz_code()
+} pixz_action;
+
+typedef enum {
+    PIXZ_OK,
+    PIXZ_STREAM_END,
+    PIXZ_ERROR,     // the context can't do what was asked, see errno
+    PIXZ_DATA_ERROR, // the input is corrupt, or not what the action expects
+    PIXZ_IO_ERROR   // reading or writing failed, in the engine or a callback
+} pixz_ret;
+
+// Like read(2) and write(2): -1 for an error, and zero from a read at the end
+typedef ssize_t (*pixz_read_fn)(void *opaque, void *buf, size_t size);
+typedef ssize_t (*pixz_write_fn)(void *opaque, const void *buf, size_t size);
+
+PIXZ_API pixz_ctx *pixz_new(pixz_action action); // NULL if out of memory
+PIXZ_API void pixz_end(pixz_ctx *ctx); // cancels a pixz_code() operation
+
+// Why the operation failed, once it has. NULL if it didn't, or isn't done.
+PIXZ_API const char *pixz_message(const pixz_ctx *ctx);
+
+// Settings, before the operation starts. The defaults match the command. The
+// level may have LZMA_PRESET_EXTREME, zero threads is for every core, a zero
+// memory limit is no limit, and no tar is like -t.
+PIXZ_API void pixz_set_level(pixz_ctx *ctx, uint32_t preset);
+PIXZ_API void pixz_set_threads(pixz_ctx *ctx, size_t threads);
+PIXZ_API void pixz_set_memlimit(pixz_ctx *ctx, uint64_t bytes);
+PIXZ_API void pixz_set_tar(pixz_ctx *ctx, bool tar);
+
+// Decompress only length bytes, from offset into the uncompressed data. Only
+// the blocks covering them are decoded. Needs a seekable input descriptor.
+PIXZ_API void pixz_set_range(pixz_ctx *ctx, uint64_t offset, uint64_t length);
+
+// Run the whole operation. The descriptors aren't closed, and seekable input
+// is decompressed in parallel, like with the command.
+PIXZ_API void pixz_set_fds(pixz_ctx *ctx, int in, int out);
+PIXZ_API void pixz_set_callbacks(pixz_ctx *ctx, pixz_read_fn rd,
+    pixz_write_fn wr, void *opaque);
+PIXZ_API pixz_ret pixz_run(pixz_ctx *ctx); // PIXZ_STREAM_END once it's done
+
+// Or push input and pull output, a piece at a time. Consumes what it can of
+// in[*in_pos..in_size), and fills what it can of out[*out_pos..out_size).
+// Waits only when input is pending, or once finishing. After finish is given,
+// keep calling with it until PIXZ_STREAM_END, when all output has been pulled.
+PIXZ_API pixz_ret pixz_code(pixz_ctx *ctx,
+    const uint8_t *in, size_t *in_pos, size_t in_size,
+    uint8_t *out, size_t *out_pos, size_t out_size, bool finish);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
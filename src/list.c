@@ -3,23 +3,25 @@
 #pragma mark FUNCTION DEFINITIONS
 
 void pixz_list(bool tar) {
+    engine_t *e = gEngine;
     if (!decode_index())
 		die("Can't list non-seekable input");
 	
     lzma_index_iter iter;
-    lzma_index_iter_init(&iter, gIndex);
+    lzma_index_iter_init(&iter, e->index);
 
     if (tar && read_file_index()) {
-        dump_file_index(stdout, false);
+        dump_file_index(e->out_file, false);
         free_file_index();
     } else {
         while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
-            printf("%9"PRIuMAX" / %9"PRIuMAX"\n",
+            fprintf(e->out_file, "%9"PRIuMAX" / %9"PRIuMAX"\n",
                 (uintmax_t)iter.block.unpadded_size,
                 (uintmax_t)iter.block.uncompressed_size);
         }
     }
     
-    lzma_index_end(gIndex, NULL);
-    lzma_end(&gStream);
+    lzma_index_end(e->index, NULL);
+    e->index = NULL;
+    lzma_end(&e->stream);
 }
@@ -0,0 +1,678 @@
+#define FUSE_USE_VERSION 31
+
+#include "pixz.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse.h>
+#include <stddef.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <archive_entry.h>
+
+#pragma mark TYPES
+
+// A tar member, or a directory only implied by the paths of others
+typedef struct node_t node_t;
+struct node_t {
+    char *path; // no leading or trailing slashes, empty for the root
+    const char *base;
+    node_t *parent, *child, *last_child, *sibling;
+    off_t start, end; // headers and all, or start is -1 if implied
+
+    // From the tar header, once it's needed
+    bool loading, loaded;
+    int err;
+    struct stat st;
+    off_t data; // where the contents of a regular file start
+    char *link;
+};
+
+// A decoded block, referenced while anyone is copying out of it
+typedef struct cache_t cache_t;
+struct cache_t {
+    lzma_vli number;
+    off_t ustart;
+    size_t usize;
+    uint8_t *data;
+    bool ready, failed;
+    size_t refs;
+    cache_t *prev, *next; // most recently used first
+};
+
+// Where libarchive is reading a header from
+typedef struct {
+    off_t pos, end;
+    cache_t *c;
+} header_src_t;
+
+typedef struct {
+    node_t *node;
+    off_t next; // where a sequential read would continue
+    off_t prefetched;
+} handle_t;
+
+
+#pragma mark GLOBALS
+
+#define CACHE_DEFAULT (256 * 1024 * 1024)
+#define PREFETCH_QUEUE 64
+
+static node_t **gNodeTable = NULL;
+static size_t gNodeMask = 0, gNodeCount = 0;
+static node_t *gRoot = NULL;
+static struct stat gArchiveStat;
+// Only guards loading, one thread reads a node's header while others wait
+static pthread_mutex_t gNodeMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gNodeCond = PTHREAD_COND_INITIALIZER;
+
+static int gArchiveFD = -1;
+static cache_t **gCacheSlots = NULL;
+static cache_t *gCacheHead = NULL, *gCacheTail = NULL;
+static uint64_t gCacheSize = 0, gCacheLimit = CACHE_DEFAULT;
+static pthread_mutex_t gCacheMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gCacheCond = PTHREAD_COND_INITIALIZER;
+
+// Sequential readers get the next block decoded while they copy this one
+static queue_t *gPrefetchQ = NULL;
+static pthread_t gPrefetchThread;
+
+
+#pragma mark FUNCTION DECLARATIONS
+
+static void usage(const char *msg);
+static int mount_opt(void *data, const char *arg, int key,
+    struct fuse_args *args);
+static void mount_index(const char *archive);
+
+static const char *path_trim(const char *path, size_t *len);
+static uint64_t path_hash(const char *path, size_t len);
+static node_t *node_find(const char *path, size_t len);
+static node_t *node_add(const char *path, size_t len);
+static int node_load(node_t *n);
+static off_t node_data(node_t *n);
+
+static cache_t *cache_get(off_t pos);
+static void cache_release(cache_t *c);
+static void cache_evict(void);
+static bool cache_read(off_t pos, uint8_t *buf, size_t size);
+static void *prefetch_thread(void *ignore);
+
+static ssize_t header_read(struct archive *ar, void *ref, const void **bufp);
+
+static void *mount_init(struct fuse_conn_info *conn, struct fuse_config *cfg);
+static void mount_destroy(void *data);
+static int mount_getattr(const char *path, struct stat *st,
+    struct fuse_file_info *fi);
+static int mount_readlink(const char *path, char *buf, size_t size);
+static int mount_open(const char *path, struct fuse_file_info *fi);
+static int mount_read(const char *path, char *buf, size_t size, off_t off,
+    struct fuse_file_info *fi);
+static int mount_release(const char *path, struct fuse_file_info *fi);
+static int mount_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+    off_t off, struct fuse_file_info *fi, enum fuse_readdir_flags flags);
+
+static const struct fuse_operations gOperations = {
+    .init = mount_init,
+    .destroy = mount_destroy,
+    .getattr = mount_getattr,
+    .readlink = mount_readlink,
+    .open = mount_open,
+    .read = mount_read,
+    .release = mount_release,
+    .readdir = mount_readdir,
+};
+
+
+#pragma mark MAIN
+
+typedef struct {
+    const char *archive;
+    const char *cache;
+} mount_opts_t;
+
+enum { KEY_HELP };
+
+static const struct fuse_opt gOpts[] = {
+    { "--cache=%s", offsetof(mount_opts_t, cache), 0 },
+    FUSE_OPT_KEY("-h", KEY_HELP),
+    FUSE_OPT_KEY("--help", KEY_HELP),
+    FUSE_OPT_END
+};
+
+int main(int argc, char **argv) {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    mount_opts_t opts = { NULL, NULL };
+    if (fuse_opt_parse(&args, &opts, gOpts, mount_opt) == -1)
+        usage(NULL);
+    if (!opts.archive)
+        usage("Need an archive to mount");
+    if (opts.cache && (!parse_size(opts.cache, &gCacheLimit)))
+        usage("Need a size or percentage of RAM argument to --cache");
+
+    // Everything is read up front, so mistakes show before we detach
+    mount_index(opts.archive);
+    int ret = fuse_main(args.argc, args.argv, &gOperations, NULL);
+    fuse_opt_free_args(&args);
+    return ret;
+}
+
+static void usage(const char *msg) {
+    if (msg)
+        fprintf(stderr, "%s\n\n", msg);
+    fprintf(stderr,
+"pixz-mount: Mount a pixz tarball read-only\n"
+"\n"
+"  pixz-mount [OPTIONS] input.tpxz mountpoint\n"
+"  fusermount -u mountpoint        # Unmount\n"
+"\n"
+"  --cache=SIZE       Keep up to SIZE bytes of decoded blocks (default 256M)\n"
+"  -f                 Stay in the foreground\n"
+"  -o OPT[,OPT...]    Other FUSE mount options\n"
+"\n"
+"pixz %s\n"
+"https://github.com/vasi/pixz\n",
+        PACKAGE_VERSION);
+    exit(2);
+}
+
+// The first argument that isn't an option is the archive, the rest are FUSE's
+static int mount_opt(void *data, const char *arg, int key,
+        struct fuse_args *args) {
+    mount_opts_t *opts = (mount_opts_t*)data;
+    if (key == KEY_HELP)
+        usage(NULL);
+    if (key == FUSE_OPT_KEY_NONOPT && !opts->archive) {
+        opts->archive = arg;
+        return 0;
+    }
+    return 1;
+}
+
+static void mount_index(const char *archive) {
+    engine_t *e = gEngine;
+    if (!(e->in_file = fopen(archive, "r")))
+        die("can not open input file: %s: %s", archive, strerror(errno));
+    gArchiveFD = fileno(e->in_file);
+    if (fstat(gArchiveFD, &gArchiveStat) != 0)
+        die("can not stat input file: %s: %s", archive, strerror(errno));
+    if (!decode_index())
+        die("Can't read the archive's index");
+    if (!read_file_index())
+        die("Not a tarball with a file index, can't mount it");
+    gCacheSlots = calloc(lzma_index_block_count(e->index), sizeof(cache_t*));
+
+    size_t count = 1;
+    for (file_index_t *f = e->file_index; f; f = f->next)
+        ++count;
+    for (gNodeMask = 1; gNodeMask < count * 2; gNodeMask *= 2)
+        ;
+    gNodeTable = calloc(gNodeMask--, sizeof(node_t*));
+    gRoot = node_add("", 0);
+
+    // A later member with the same path replaces an earlier one, like tar x
+    for (file_index_t *f = e->file_index; f && f->next; f = f->next) {
+        if (!f->name)
+            continue;
+        size_t len;
+        const char *path = path_trim(f->name, &len);
+        if (!len)
+            continue;
+
+        node_t *n = node_add(path, len);
+        n->start = f->offset;
+        n->end = f->next->offset;
+    }
+}
+
+
+#pragma mark NODES
+
+// Tar paths may look like "./dir/" or "/file", ours look like "dir"
+static const char *path_trim(const char *path, size_t *len) {
+    while (*path == '/' || (path[0] == '.' && path[1] == '/'))
+        path += (*path == '/') ? 1 : 2;
+    *len = strlen(path);
+    while (*len && path[*len - 1] == '/')
+        --*len;
+    if (*len == 1 && path[0] == '.')
+        *len = 0;
+    return path;
+}
+
+static uint64_t path_hash(const char *path, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ULL; // FNV-1a
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ (uint8_t)path[i]) * 0x100000001b3ULL;
+    return h;
+}
+
+static node_t *node_find(const char *path, size_t len) {
+    for (size_t slot = path_hash(path, len) & gNodeMask; gNodeTable[slot];
+            slot = (slot + 1) & gNodeMask) {
+        node_t *n = gNodeTable[slot];
+        if (strncmp(n->path, path, len) == 0 && n->path[len] == '\0')
+            return n;
+    }
+    return NULL;
+}
+
+// With its parent directories, if they're not there yet
+static node_t *node_add(const char *path, size_t len) {
+    node_t *n = node_find(path, len);
+    if (n)
+        return n;
+
+    n = calloc(1, sizeof(node_t));
+    n->path = malloc(len + 1);
+    memcpy(n->path, path, len);
+    n->path[len] = '\0';
+    n->start = -1;
+
+    size_t slot = path_hash(path, len) & gNodeMask;
+    while (gNodeTable[slot])
+        slot = (slot + 1) & gNodeMask;
+    gNodeTable[slot] = n;
+
+    // Implied directories weren't counted up front, so grow if need be
+    if (++gNodeCount * 2 > gNodeMask) {
+        node_t **old = gNodeTable;
+        size_t oldmask = gNodeMask;
+        gNodeMask = gNodeMask * 2 + 1;
+        gNodeTable = calloc(gNodeMask + 1, sizeof(node_t*));
+        for (size_t i = 0; i <= oldmask; ++i) {
+            if (!old[i])
+                continue;
+            size_t s = path_hash(old[i]->path, strlen(old[i]->path))
+                & gNodeMask;
+            while (gNodeTable[s])
+                s = (s + 1) & gNodeMask;
+            gNodeTable[s] = old[i];
+        }
+        free(old);
+    }
+
+    n->base = n->path;
+    if (len) {
+        size_t plen = len;
+        while (plen && path[plen - 1] != '/')
+            --plen;
+        n->base = n->path + plen;
+        while (plen && path[plen - 1] == '/')
+            --plen;
+        n->parent = node_add(path, plen);
+        if (n->parent->last_child)
+            n->parent->last_child->sibling = n;
+        else
+            n->parent->child = n;
+        n->parent->last_child = n;
+    }
+    return n;
+}
+
+// Read the member's tar header, the first time it's asked about. Decoding
+// happens outside the lock, so other nodes can be looked at meanwhile.
+static int node_load(node_t *n) {
+    pthread_mutex_lock(&gNodeMutex);
+    while (n->loading)
+        pthread_cond_wait(&gNodeCond, &gNodeMutex);
+    if (n->loaded) {
+        pthread_mutex_unlock(&gNodeMutex);
+        return n->err;
+    }
+    n->loading = true;
+    pthread_mutex_unlock(&gNodeMutex);
+
+    if (n->start == -1) { // implied, like the root
+        n->st.st_mode = S_IFDIR | 0555;
+        n->st.st_uid = gArchiveStat.st_uid;
+        n->st.st_gid = gArchiveStat.st_gid;
+        n->st.st_mtime = gArchiveStat.st_mtime;
+    } else {
+        struct archive *ar = archive_read_new();
+        archive_read_support_format_tar(ar);
+        header_src_t hr = { n->start, n->end, NULL };
+        archive_read_open(ar, &hr, NULL, header_read, NULL);
+
+        struct archive_entry *entry;
+        int aerr = archive_read_next_header(ar, &entry);
+        if (aerr != ARCHIVE_OK && aerr != ARCHIVE_WARN) {
+            n->err = -EIO;
+        } else {
+            n->st = *archive_entry_stat(entry);
+            n->st.st_mode &= ~0222; // read-only
+            if (archive_entry_symlink(entry))
+                n->link = strdup(archive_entry_symlink(entry));
+
+            // Hard links share their target's contents
+            const char *hard = archive_entry_hardlink(entry);
+            node_t *target = NULL;
+            if (hard) {
+                size_t len;
+                const char *tpath = path_trim(hard, &len);
+                target = node_find(tpath, len);
+            }
+            if (hard && target && target != n && target->start != -1
+                    && target->start < n->start) {
+                n->err = node_load(target);
+                n->st = target->st;
+                n->data = target->data;
+            } else if (hard) {
+                n->err = -EIO;
+            } else if (S_ISREG(n->st.st_mode)) {
+#if ARCHIVE_VERSION_NUMBER >= 3000000
+                if (archive_entry_sparse_reset(entry))
+                    n->err = -EIO; // holes would need a map of the data
+#endif
+                if (!n->err && (n->data = node_data(n)) == -1)
+                    n->err = -EIO;
+            }
+        }
+        if (hr.c)
+            cache_release(hr.c);
+        finish_reading(ar);
+    }
+    n->st.st_nlink = S_ISDIR(n->st.st_mode) ? 2 : 1;
+    n->st.st_blocks = (n->st.st_size + 511) / 512;
+
+    pthread_mutex_lock(&gNodeMutex);
+    n->loading = false;
+    n->loaded = true;
+    pthread_cond_broadcast(&gNodeCond);
+    pthread_mutex_unlock(&gNodeMutex);
+    return n->err;
+}
+
+// Skip the headers before the one that describes the member itself
+static off_t node_data(node_t *n) {
+    uint8_t h[512];
+    for (off_t pos = n->start; pos + (off_t)sizeof(h) <= n->end; ) {
+        if (!cache_read(pos, h, sizeof(h)))
+            return -1;
+        pos += sizeof(h);
+        char type = h[156];
+        if (type != 'x' && type != 'g' && type != 'L' && type != 'K')
+            return (pos + n->st.st_size <= n->end) ? pos : -1;
+        pos += (tar_number(h + 124, 12) + sizeof(h) - 1) / sizeof(h)
+            * sizeof(h);
+    }
+    return -1;
+}
+
+// libarchive reads the headers straight out of the cache
+static ssize_t header_read(struct archive *ar, void *ref, const void **bufp) {
+    header_src_t *hr = (header_src_t*)ref;
+    if (hr->c)
+        cache_release(hr->c);
+    hr->c = NULL;
+    if (hr->pos >= hr->end)
+        return 0;
+
+    if (!(hr->c = cache_get(hr->pos))) {
+        archive_set_error(ar, EIO, "Error decoding block");
+        return -1;
+    }
+    size_t skip = hr->pos - hr->c->ustart, size = hr->c->usize - skip;
+    if ((off_t)size > hr->end - hr->pos)
+        size = hr->end - hr->pos;
+    *bufp = hr->c->data + skip;
+    hr->pos += size;
+    return size;
+}
+
+
+#pragma mark CACHE
+
+// The block holding pos, decoded. Only one thread decodes any block, the
+// others wait for it.
+static cache_t *cache_get(off_t pos) {
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, gEngine->index);
+    if (pos < 0 || lzma_index_iter_locate(&iter, pos))
+        return NULL;
+
+    pthread_mutex_lock(&gCacheMutex);
+    lzma_vli number = iter.block.number_in_file - 1;
+    cache_t *c = gCacheSlots[number];
+    if (c) {
+        ++c->refs;
+        while (!c->ready && !c->failed)
+            pthread_cond_wait(&gCacheCond, &gCacheMutex);
+    } else {
+        c = calloc(1, sizeof(cache_t));
+        c->number = number;
+        c->ustart = iter.block.uncompressed_file_offset;
+        c->usize = iter.block.uncompressed_size;
+        c->refs = 1;
+        gCacheSlots[number] = c;
+        pthread_mutex_unlock(&gCacheMutex);
+
+        uint8_t *data = malloc(c->usize ? c->usize : 1);
+        bool ok = data && decode_block(gArchiveFD, &iter, data);
+
+        pthread_mutex_lock(&gCacheMutex);
+        if (ok) {
+            c->data = data;
+            c->ready = true;
+            gCacheSize += c->usize;
+        } else {
+            free(data);
+            c->failed = true;
+        }
+        pthread_cond_broadcast(&gCacheCond);
+    }
+
+    // Most recently used goes first
+    if (c->ready && c != gCacheHead) {
+        if (c->prev)
+            c->prev->next = c->next;
+        if (c->next)
+            c->next->prev = c->prev;
+        if (gCacheTail == c)
+            gCacheTail = c->prev;
+        c->prev = NULL;
+        c->next = gCacheHead;
+        if (gCacheHead)
+            gCacheHead->prev = c;
+        gCacheHead = c;
+        if (!gCacheTail)
+            gCacheTail = c;
+    }
+    if (c->failed) {
+        --c->refs; // damaged blocks stay that way, keep the failure around
+        c = NULL;
+    }
+    cache_evict();
+    pthread_mutex_unlock(&gCacheMutex);
+    return c;
+}
+
+static void cache_release(cache_t *c) {
+    pthread_mutex_lock(&gCacheMutex);
+    --c->refs;
+    cache_evict();
+    pthread_mutex_unlock(&gCacheMutex);
+}
+
+// Drop the least recently used blocks nobody's reading, while over the limit
+static void cache_evict(void) {
+    cache_t *c = gCacheTail;
+    while (gCacheSize > gCacheLimit && c) {
+        cache_t *prev = c->prev;
+        if (!c->refs) {
+            if (c->prev)
+                c->prev->next = c->next;
+            else
+                gCacheHead = c->next;
+            if (c->next)
+                c->next->prev = c->prev;
+            else
+                gCacheTail = c->prev;
+            gCacheSlots[c->number] = NULL;
+            gCacheSize -= c->usize;
+            free(c->data);
+            free(c);
+        }
+        c = prev;
+    }
+}
+
+static bool cache_read(off_t pos, uint8_t *buf, size_t size) {
+    while (size) {
+        cache_t *c = cache_get(pos);
+        if (!c)
+            return false;
+        size_t skip = pos - c->ustart, n = c->usize - skip;
+        if (n > size)
+            n = size;
+        memcpy(buf, c->data + skip, n);
+        cache_release(c);
+        buf += n;
+        pos += n;
+        size -= n;
+    }
+    return true;
+}
+
+static void *prefetch_thread(void *ignore) {
+    void *data;
+    while (queue_pop(gPrefetchQ, &data) != PIPELINE_STOP) {
+        cache_t *c = cache_get((off_t)(uintptr_t)data);
+        if (c)
+            cache_release(c);
+    }
+    return NULL;
+}
+
+
+#pragma mark OPERATIONS
+
+// Threads don't survive FUSE going into the background, so start them here
+static void *mount_init(struct fuse_conn_info *conn, struct fuse_config *cfg) {
+    cfg->kernel_cache = 1; // the archive never changes under us
+    gPrefetchQ = queue_new(PREFETCH_QUEUE, NULL);
+    if (pthread_create(&gPrefetchThread, NULL, &prefetch_thread, NULL))
+        die("Error creating prefetch thread");
+    return NULL;
+}
+
+static void mount_destroy(void *data) {
+    queue_push(gPrefetchQ, PIPELINE_STOP, NULL);
+    pthread_join(gPrefetchThread, NULL);
+    queue_free(gPrefetchQ);
+}
+
+static node_t *mount_lookup(const char *path) {
+    while (*path == '/')
+        ++path;
+    return node_find(path, strlen(path));
+}
+
+static int mount_getattr(const char *path, struct stat *st,
+        struct fuse_file_info *fi) {
+    node_t *n = mount_lookup(path);
+    if (!n)
+        return -ENOENT;
+    int err = node_load(n);
+    if (err && !S_ISREG(n->st.st_mode))
+        return err; // files can still be listed, just not read
+    *st = n->st;
+    if (n->child)
+        st->st_mode = (st->st_mode & ~S_IFMT) | S_IFDIR;
+    return 0;
+}
+
+static int mount_readlink(const char *path, char *buf, size_t size) {
+    node_t *n = mount_lookup(path);
+    if (!n)
+        return -ENOENT;
+    int err = node_load(n);
+    if (err)
+        return err;
+    if (!n->link)
+        return -EINVAL;
+    strncpy(buf, n->link, size);
+    if (size)
+        buf[size - 1] = '\0';
+    return 0;
+}
+
+static int mount_open(const char *path, struct fuse_file_info *fi) {
+    node_t *n = mount_lookup(path);
+    if (!n)
+        return -ENOENT;
+    if ((fi->flags & O_ACCMODE) != O_RDONLY)
+        return -EROFS;
+    int err = node_load(n);
+    if (err)
+        return err;
+    if (!S_ISREG(n->st.st_mode))
+        return -EISDIR;
+
+    handle_t *h = calloc(1, sizeof(handle_t));
+    h->node = n;
+    h->prefetched = -1;
+    fi->fh = (uintptr_t)h;
+    fi->keep_cache = 1;
+    return 0;
+}
+
+static int mount_read(const char *path, char *buf, size_t size, off_t off,
+        struct fuse_file_info *fi) {
+    handle_t *h = (handle_t*)(uintptr_t)fi->fh;
+    node_t *n = h->node;
+    if (off >= n->st.st_size)
+        return 0;
+    if ((off_t)size > n->st.st_size - off)
+        size = n->st.st_size - off;
+
+    off_t pos = n->data + off, end = pos + size;
+    bool sequential = (off == h->next);
+    while (pos < end) {
+        cache_t *c = cache_get(pos);
+        if (!c)
+            return -EIO;
+        size_t skip = pos - c->ustart, len = c->usize - skip;
+        if ((off_t)len > end - pos)
+            len = end - pos;
+        memcpy(buf, c->data + skip, len);
+
+        // Get the next block of the file started, if it's being read through
+        off_t next = c->ustart + c->usize;
+        cache_release(c);
+        if (sequential && next < n->data + n->st.st_size
+                && next != h->prefetched
+                && queue_length(gPrefetchQ) < PREFETCH_QUEUE / 2) {
+            h->prefetched = next;
+            queue_push(gPrefetchQ, PIPELINE_ITEM, (void*)(uintptr_t)next);
+        }
+        buf += len;
+        pos += len;
+    }
+    h->next = off + size;
+    return size;
+}
+
+static int mount_release(const char *path, struct fuse_file_info *fi) {
+    free((handle_t*)(uintptr_t)fi->fh);
+    return 0;
+}
+
+static int mount_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+        off_t off, struct fuse_file_info *fi, enum fuse_readdir_flags flags) {
+    node_t *n = mount_lookup(path);
+    if (!n)
+        return -ENOENT;
+    if (!n->child && n != gRoot) {
+        node_load(n);
+        if (!S_ISDIR(n->st.st_mode))
+            return -ENOTDIR;
+    }
+
+    filler(buf, ".", NULL, 0, 0);
+    filler(buf, "..", NULL, 0, 0);
+    for (node_t *c = n->child; c; c = c->sibling)
+        filler(buf, c->base, NULL, 0, 0);
+    return 0;
+}
@@ -3,14 +3,55 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <getopt.h>
+#include <limits.h>
 
 typedef enum {
     OP_WRITE,
     OP_READ,
     OP_EXTRACT,
-    OP_LIST
+    OP_LIST,
+    OP_TEST
 } pixz_op_t;
 
+enum {
+    OPT_HUGE_PAGES = 256,
+    OPT_NO_MMAP,
+    OPT_ENTRY_ALIGN,
+    OPT_STORE_ENTROPY,
+    OPT_BATCH,
+    OPT_FLUSH_IDLE,
+    OPT_FLUSH_SIZE,
+    OPT_TARGET_RATE,
+    OPT_INDEX_FORMAT,
+    OPT_APPEND,
+    OPT_RANGE,
+    OPT_TEST,
+    OPT_STATS,
+    OPT_TRACE,
+};
+
+static const struct option long_opts[] = {
+    { "memlimit", required_argument, NULL, 'M' },
+    { "huge-pages", required_argument, NULL, OPT_HUGE_PAGES },
+    { "no-mmap", no_argument, NULL, OPT_NO_MMAP },
+    { "entry-align", required_argument, NULL, OPT_ENTRY_ALIGN },
+    { "store-entropy", required_argument, NULL, OPT_STORE_ENTROPY },
+    { "batch", optional_argument, NULL, OPT_BATCH },
+    { "flush-idle", required_argument, NULL, OPT_FLUSH_IDLE },
+    { "flush-size", required_argument, NULL, OPT_FLUSH_SIZE },
+    { "target-rate", required_argument, NULL, OPT_TARGET_RATE },
+    { "index-format", required_argument, NULL, OPT_INDEX_FORMAT },
+    { "append", no_argument, NULL, OPT_APPEND },
+    { "range", required_argument, NULL, OPT_RANGE },
+    { "test", no_argument, NULL, OPT_TEST },
+    { "stats", no_argument, NULL, OPT_STATS },
+    { "trace", required_argument, NULL, OPT_TRACE },
+    { NULL, 0, NULL, 0 }
+};
+
+static void run_batch(pixz_op_t op, bool tar, uint32_t level, bool keep_input,
+    const char *manifest, int argc, char **argv);
+static size_t read_manifest(const char *path, char ***ipaths, char ***opaths);
 static bool strsuf(char *big, char *small);
 static char *subsuf(char *in, char *suf1, char *suf2);
 static char *auto_output(pixz_op_t op, char *in);
@@ -25,6 +66,8 @@ static void usage(const char *msg) {
 "Basic usage:\n"
 "  pixz input output.pxz           # Compress a file in parallel\n"
 "  pixz -d input.pxz output        # Decompress\n"
+"  pixz -d --range 1G:4K < in.xz   # Decompress just 4 KiB, 1 GiB in\n"
+"  pixz --test input.pxz           # Check integrity on all cores, no output\n"
 "\n"
 "Tarballs:\n"
 "  pixz input.tar output.tpxz      # Compress and index a tarball\n"
@@ -37,15 +80,31 @@ static void usage(const char *msg) {
 "  pixz < input > output.pxz       # Same as `pixz input output.pxz`\n"
 "  pixz -i input -o output.pxz     # Ditto\n"
 "  pixz [-d] input                 # Automatically choose output filename\n"
+"  pixz [-d] --batch input...      # Many files at once, each named by default\n"
+"  pixz [-d] --batch=list          # Ditto, with lines of `input<TAB>output`\n"
+"  pixz --append more.tar out.tpxz # Add a tarball's files to an archive\n"
 "\n"
 "Other flags:\n"
 "  -0, -1 ... -9      Set compression level, from fastest to strongest\n"
 "  -p NUM             Use a maximum of NUM CPU-intensive threads\n"
+"  -M SIZE            Limit memory use to SIZE bytes (suffixes K, M, G, or %%)\n"
 "  -t                 Don't assume input is in tar format\n"
 "  -k                 Keep original input (do not remove it)\n"
 "  -c                 ignored\n"
 "  -h                 Print this help\n"
 "\n"
+"Tuning:\n"
+"  --huge-pages=MODE  Back block buffers with huge pages: none, thp, hugetlb\n"
+"  --no-mmap          Read seekable input instead of mapping it\n"
+"  --entry-align=FRAC End blocks at a tar entry within FRAC of a block\n"
+"  --store-entropy=BITS  Store blocks of at least BITS/byte uncompressed\n"
+"  --flush-idle=MS    Compress what's been read after MS idle milliseconds\n"
+"  --flush-size=SIZE  Compress what's been read every SIZE bytes\n"
+"  --target-rate=MIBS Lower the level per block to compress MIBS MiB/s\n"
+"  --index-format=N   Write file index version 1 (default), or 2 for big tarballs\n"
+"  --stats            Print where the time went as JSON on stderr, at the end\n"
+"  --trace=FILE       Write a Chrome trace of each block's steps to FILE\n"
+"\n"
 "pixz %s\n"
 "(C) 2009-2020 Dave Vasilevsky <dave@vasilevsky.ca>\n"
 "https://github.com/vasi/pixz\n"
@@ -55,10 +114,14 @@ static void usage(const char *msg) {
 }
 
 int main(int argc, char **argv) {    
+    engine_t *e = gEngine;
     uint32_t level = LZMA_PRESET_DEFAULT;
     bool tar = true;
     bool keep_input = false;
     bool extreme = false;
+    bool batch = false;
+    const char *manifest = NULL;
+    bool append = false;
     pixz_op_t op = OP_WRITE;
     char *ipath = NULL, *opath = NULL;
     
@@ -66,7 +129,8 @@ int main(int argc, char **argv) {
 	char *optend;
 	long optint;
     double optdbl;
-    while ((ch = getopt(argc, argv, "dcxli:o:tkvhp:0123456789f:q:e")) != -1) {
+    while ((ch = getopt_long(argc, argv, "dcxli:o:tkvhp:0123456789f:q:eM:",
+            long_opts, NULL)) != -1) {
         switch (ch) {
             case 'c': break;
             case 'd': op = OP_READ; break;
@@ -82,20 +146,90 @@ int main(int argc, char **argv) {
                 optdbl = strtod(optarg, &optend);
                 if (*optend || optdbl <= 0)
                     usage("Need a positive floating-point argument to -f");
-                gBlockFraction = optdbl;
+                e->block_fraction = optdbl;
                 break;
 			case 'p':
 				optint = strtol(optarg, &optend, 10);
 				if (optint < 0 || *optend)
 					usage("Need a non-negative integer argument to -p");
-				gPipelineProcessMax = optint;
+				e->process_max = optint;
 				break;
             case 'q':
     			optint = strtol(optarg, &optend, 10);
     			if (optint <= 0 || *optend)
     				usage("Need a positive integer argument to -q");
-    			gPipelineQSize = optint;
+    			e->qsize = optint;
     			break;
+            case 'M':
+                if (!parse_size(optarg, &e->mem_limit))
+                    usage("Need a size or percentage of RAM argument to -M");
+                break;
+            case OPT_HUGE_PAGES:
+                if (strcmp(optarg, "none") == 0)
+                    e->huge_pages = HUGE_PAGES_NONE;
+                else if (strcmp(optarg, "thp") == 0)
+                    e->huge_pages = HUGE_PAGES_THP;
+                else if (strcmp(optarg, "hugetlb") == 0)
+                    e->huge_pages = HUGE_PAGES_HUGETLB;
+                else
+                    usage("Need none, thp or hugetlb as argument to --huge-pages");
+                break;
+            case OPT_NO_MMAP: e->map_input = false; break;
+            case OPT_BATCH: batch = true; manifest = optarg; break;
+            case OPT_APPEND: append = true; break;
+            case OPT_TEST: op = OP_TEST; break;
+            case OPT_STATS: stats_start(); break;
+            case OPT_TRACE: trace_start(optarg); break;
+            case OPT_RANGE: {
+                uint64_t start, size;
+                char *colon = strchr(optarg, ':');
+                if (!colon)
+                    usage("Need OFFSET:LENGTH as argument to --range");
+                *colon = '\0';
+                if (!parse_size(optarg, &start) || !parse_size(colon + 1, &size)
+                        || start > INT64_MAX || size > INT64_MAX - start)
+                    usage("Need OFFSET:LENGTH as argument to --range");
+                e->range_start = start;
+                e->range_end = start + size;
+                break;
+            }
+            case OPT_FLUSH_IDLE:
+                optint = strtol(optarg, &optend, 10);
+                if (optint <= 0 || optint > INT_MAX || *optend)
+                    usage("Need a positive number of milliseconds for --flush-idle");
+                e->flush_idle = optint;
+                break;
+            case OPT_TARGET_RATE:
+                optdbl = strtod(optarg, &optend);
+                if (*optend || optdbl <= 0)
+                    usage("Need a positive rate in MiB/s for --target-rate");
+                e->target_rate = optdbl;
+                break;
+            case OPT_INDEX_FORMAT:
+                optint = strtol(optarg, &optend, 10);
+                if ((optint != 1 && optint != 2) || *optend)
+                    usage("Need 1 or 2 as argument to --index-format");
+                e->index_format = optint;
+                break;
+            case OPT_FLUSH_SIZE: {
+                uint64_t size;
+                if (!parse_size(optarg, &size) || size == 0 || size > SIZE_MAX)
+                    usage("Need a positive size for --flush-size");
+                e->flush_size = size;
+                break;
+            }
+            case OPT_ENTRY_ALIGN:
+                optdbl = strtod(optarg, &optend);
+                if (*optend || optdbl < 0 || optdbl >= 1)
+                    usage("Need a fraction between 0 and 1 as argument to --entry-align");
+                e->entry_align = optdbl;
+                break;
+            case OPT_STORE_ENTROPY:
+                optdbl = strtod(optarg, &optend);
+                if (*optend || optdbl < 0 || optdbl > 8)
+                    usage("Need a number of bits from 0 to 8 as argument to --store-entropy");
+                e->store_entropy = optdbl;
+                break;
             default:
                 if (ch >= '0' && ch <= '9') {
                     level = ch - '0';
@@ -106,12 +240,51 @@ int main(int argc, char **argv) {
     }
     argc -= optind;
     argv += optind;
+    
+    if (extreme)
+        level |= LZMA_PRESET_EXTREME;
+    if (batch) {
+        if (op != OP_WRITE && op != OP_READ)
+            usage("Batch mode only compresses or decompresses");
+        if (append || e->range_end >= 0)
+            usage("Batch mode works on whole files");
+        if (ipath || opath || (manifest ? argc != 0 : argc == 0))
+            usage("Batch mode takes its inputs as arguments, or from a list");
+        run_batch(op, tar, level, keep_input, manifest, argc, argv);
+        stats_report();
+        trace_finish();
+        return 0;
+    }
+    if (append) {
+        if (op != OP_WRITE || !tar)
+            usage("Can only append a tarball to an archive");
+        // The archive comes last, as with any output
+        if (argc > 2 || argc + !!ipath + !!opath > 2)
+            usage("Too many arguments");
+        if (argc >= 1 && !opath)
+            opath = argv[--argc];
+        if (argc >= 1)
+            ipath = argv[0];
+        if (!opath)
+            usage("Need an archive to append to");
+        
+        e->in_file = stdin;
+        if (ipath && !(e->in_file = fopen(ipath, "r")))
+            die("can not open input file: %s: %s", ipath, strerror(errno));
+        pixz_append(level, opath); // the input is never removed
+        stats_report();
+        trace_finish();
+        return 0;
+    }
+        
+    if (e->range_end >= 0 && op != OP_READ)
+        usage("Can only decompress a range");
         
-    gInFile = stdin;
-    gOutFile = stdout;
+    e->in_file = stdin;
+    e->out_file = stdout;
     bool iremove = false;    
     if (op != OP_EXTRACT && argc >= 1) {
-        if (argc > 2 || (op == OP_LIST && argc == 2))
+        if (argc > 2 || ((op == OP_LIST || op == OP_TEST) && argc == 2))
             usage("Too many arguments");
         if (ipath)
             usage("Multiple input files specified");
@@ -121,59 +294,124 @@ int main(int argc, char **argv) {
             if (opath)
                 usage("Multiple output files specified");
             opath = argv[1];
-        } else if (op != OP_LIST) {
-            iremove = true;
+        } else if (op != OP_LIST && op != OP_TEST) {
+            iremove = (e->range_end < 0); // a range is only part of it
             opath = auto_output(op, argv[0]);
 			if (!opath)
 				usage("Unknown suffix");
         }
     }
 
-    if (ipath && !(gInFile = fopen(ipath, "r")))
+    if (ipath && !(e->in_file = fopen(ipath, "r")))
       die("can not open input file: %s: %s", ipath, strerror(errno));
 
-    if (opath) {
-      if (gInFile == stdin) {
-        // can't read permissions of original file, because we read from stdin,
-        // using umask permissions
-        if (!(gOutFile = fopen(opath, "w")))
-          die("can not open output file: %s: %s", opath, strerror(errno));
-
-      } else {
-        // read permissions of original file,
-        // use them to create / open output file
-        struct stat input_stat;
-        int output_fd;
-
-        stat(ipath, &input_stat);
-
-        if ((output_fd = open(opath, O_CREAT | O_WRONLY, input_stat.st_mode)) == -1)
-          die("can not open output file: %s: %s", opath, strerror(errno));
-
-        if (!(gOutFile = fdopen(output_fd, "w")))
-          die("can not open output file: %s: %s", opath, strerror(errno));
-      }
-    }
+    if (opath)
+        e->out_file = open_output(e->in_file == stdin ? NULL : ipath, opath);
 
     switch (op) {
         case OP_WRITE:
-			if (isatty(fileno(gOutFile)) == 1)
+			if (isatty(fileno(e->out_file)) == 1)
 				usage("Refusing to output to a TTY");
-			if (extreme)
-				level |= LZMA_PRESET_EXTREME;
 			pixz_write(tar, level);
 			break;
         case OP_READ: pixz_read(tar, 0, NULL); break;
         case OP_EXTRACT: pixz_read(tar, argc, argv); break;
-        case OP_LIST: pixz_list(tar);
+        case OP_LIST: pixz_list(tar); break;
+        case OP_TEST: pixz_test(tar);
     }
     
     if (iremove && !keep_input)
         unlink(ipath);
     
+    stats_report();
+    trace_finish();
     return 0;
 }
 
+// Inputs with an output named automatically are removed, as with one input
+static void run_batch(pixz_op_t op, bool tar, uint32_t level, bool keep_input,
+        const char *manifest, int argc, char **argv) {
+    char **ipaths, **opaths;
+    size_t count;
+    if (manifest) {
+        count = read_manifest(manifest, &ipaths, &opaths);
+    } else {
+        count = argc;
+        ipaths = malloc(count * sizeof(char*));
+        opaths = calloc(count, sizeof(char*));
+        for (size_t i = 0; i < count; ++i)
+            ipaths[i] = strdup(argv[i]);
+    }
+    
+    bool *iremove = calloc(count, sizeof(bool));
+    for (size_t i = 0; i < count; ++i) {
+        if (!opaths[i]) {
+            if (!(opaths[i] = auto_output(op, ipaths[i])))
+                usage("Unknown suffix");
+            iremove[i] = !keep_input;
+        }
+    }
+    
+    if (op == OP_WRITE)
+        pixz_write_batch(tar, level, count, ipaths, opaths);
+    else
+        pixz_read_batch(tar, count, ipaths, opaths);
+    
+    for (size_t i = 0; i < count; ++i) {
+        if (iremove[i])
+            unlink(ipaths[i]);
+        free(ipaths[i]);
+        free(opaths[i]);
+    }
+    free(iremove);
+    free(ipaths);
+    free(opaths);
+}
+
+// One job per line: an input, and optionally a tab and its output. Tabs and
+// newlines are rare in file names, unlike spaces.
+static size_t read_manifest(const char *path, char ***ipaths, char ***opaths) {
+    FILE *in = stdin;
+    if (strcmp(path, "-") != 0 && !(in = fopen(path, "r")))
+        die("can not open batch list: %s: %s", path, strerror(errno));
+    
+    size_t count = 0, cap = 16;
+    *ipaths = malloc(cap * sizeof(char*));
+    *opaths = malloc(cap * sizeof(char*));
+    char *line = NULL;
+    size_t linecap = 0;
+    ssize_t len;
+    while ((len = getline(&line, &linecap, in)) != -1) {
+        if (len > 0 && line[len - 1] == '\n')
+            line[--len] = '\0';
+        if (len == 0)
+            continue;
+        
+        char *tab = strchr(line, '\t');
+        if (tab)
+            *tab++ = '\0';
+        if (!*line || (tab && (!*tab || strchr(tab, '\t'))))
+            die("Bad line in batch list: %s", path);
+        
+        if (count == cap) {
+            cap *= 2;
+            *ipaths = realloc(*ipaths, cap * sizeof(char*));
+            *opaths = realloc(*opaths, cap * sizeof(char*));
+        }
+        (*ipaths)[count] = strdup(line);
+        (*opaths)[count] = tab ? strdup(tab) : NULL;
+        ++count;
+    }
+    if (ferror(in))
+        die("Error reading batch list: %s: %s", path, strerror(errno));
+    free(line);
+    if (in != stdin)
+        fclose(in);
+    if (count == 0)
+        usage("Batch list is empty");
+    return count;
+}
+
 #define SUF(_op, _s1, _s2) ({ \
     if (op == OP_##_op) { \
         char *r = subsuf(in, _s1, _s2); \
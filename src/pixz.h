@@ -13,14 +13,19 @@
 #include <sys/types.h>
 
 #include <pthread.h>
+#include <stdatomic.h>
 
 
 #pragma mark DEFINES
 
 #define PIXZ_INDEX_MAGIC 0xDBAE14D62E324CA6LL
+// Version 2 file index: chunks of entries sorted by name, then a directory
+#define PIXZ_INDEX_V2_MAGIC 0x57A3F0C4D91E62B8LL
+#define PIXZ_CHUNK_MAGIC 0x2C8E51B7A4F6039DLL
+#define INDEX_CHUNK_ENTRIES 1024
 
 #define CHECK LZMA_CHECK_CRC32
-#define MEMLIMIT (64ULL * 1024 * 1024 * 1024) // crazy high
+#define MEMLIMIT (64ULL * 1024 * 1024 * 1024) // crazy high, just for indices
 
 #define CHUNKSIZE 4096
 
@@ -45,29 +50,53 @@
 	#define finish_reading(a) archive_read_finish(a)
 #endif
 
+struct archive *tar_reader(void); // no decompression, freed if the engine dies
+void tar_reader_free(struct archive *ar);
+
 #pragma mark OPERATIONS
 
 void pixz_list(bool tar);
 void pixz_write(bool tar, uint32_t level);
+void pixz_write_batch(bool tar, uint32_t level, size_t count,
+    char **ipaths, char **opaths);
+void pixz_append(uint32_t level, const char *apath);
 void pixz_read(bool verify, size_t nspecs, char **specs);
+void pixz_read_batch(bool verify, size_t count, char **ipaths, char **opaths);
+void pixz_test(bool tar);
 
 
 #pragma mark UTILS
 
-extern FILE *gInFile, *gOutFile;
-extern lzma_stream gStream;
-
-extern lzma_index *gIndex;
-
-
 void die(const char *fmt, ...);
-char *xstrdup(const char *s);
+void warn(const char *fmt, ...); // on stderr, for the command only
+bool write_output(const void *buf, size_t size);
+ssize_t read_input(void *buf, size_t size); // like read(2)
+int close_file(FILE *f); // fclose, and forget it's open
+FILE *open_output(const char *ipath, const char *opath); // ipath may be NULL
+bool parse_size(const char *arg, uint64_t *size); // with a suffix, or % of RAM
+uint64_t tar_number(const uint8_t *field, size_t size);
 
 uint64_t xle64dec(const uint8_t *d);
 void xle64enc(uint8_t *d, uint64_t n);
+#define VARINT_MAX 10
+size_t xvarint_enc(uint8_t *d, uint64_t n); // returns bytes used
+uint64_t xvarint_dec(const uint8_t **d, const uint8_t *end);
 size_t num_threads(void);
+uint64_t physical_memory(void);
+
 
-extern double gBlockFraction;
+#pragma mark BUFFERS
+
+typedef enum {
+    HUGE_PAGES_NONE,    // plain malloc
+    HUGE_PAGES_THP,     // madvise transparent huge pages
+    HUGE_PAGES_HUGETLB  // explicit hugetlbfs pages, falling back to THP
+} huge_pages_t;
+
+// Large, long-lived block buffers. Sizes must be passed back in when freeing.
+void *buffer_alloc(size_t size);
+void *buffer_grow(void *buf, size_t oldsize, size_t newsize);
+void buffer_free(void *buf, size_t size);
 
 
 #pragma mark INDEX
@@ -79,50 +108,79 @@ struct file_index_t {
     file_index_t *next;
 };
 
-extern file_index_t *gFileIndex, *gLastFile;
+// Entries, their names and anything else that lives as long as the index are
+// carved out of a few large chunks, and freed all at once
+typedef struct file_arena_t file_arena_t;
+
+void *file_arena_alloc(size_t size);
+void file_arena_free(file_arena_t *arena);
+file_index_t *file_index_append(off_t offset, const char *name); // may be NULL
 
 bool is_multi_header(const char *name);
 bool decode_index(void); // true on success
+bool decode_block(int fd, const lzma_index_iter *iter, uint8_t *out);
 
+// Both return where the first file index starts, or zero if some stream has
+// none. With specs, a version 2 index only loads the files near them: the list
+// is then in archive order but has gaps, each one marked by an entry with a
+// NULL name. Each stream's entries end in one too.
 lzma_vli read_file_index(void);
+lzma_vli read_file_index_specs(size_t count, char **specs);
+
+// Each stream of a tarball has its own file index, from offset on
+typedef struct {
+    lzma_vli offset; // compressed, of the index's first block
+    lzma_vli start, index_start; // uncompressed, of its tar data and index
+} file_index_stream_t;
+bool file_index_block(const lzma_index_iter *iter); // part of a file index?
+off_t tar_data_end(off_t pos, off_t end); // before the zeros, from an entry
 void dump_file_index(FILE *out, bool verbose);
-void free_file_index(void);
+void free_file_index(void); // and its arena
 
 
 #pragma mark QUEUE
 
-typedef struct queue_item_t queue_item_t;
-struct queue_item_t {
+// Bounded MPMC queue: a ring of slots, each stamped with the ticket of the
+// push or pop it is waiting for. Threads only sleep when the ring is empty (or
+// full), and are only woken when someone is actually asleep.
+typedef struct {
+    atomic_size_t seq;
     int type;
     void *data;
-    queue_item_t *next;
-};
+} queue_slot_t;
 
 typedef void (*queue_free_t)(int type, void *p);
 
-typedef struct {
-    queue_item_t *first;
-    queue_item_t *last;
+#define QUEUE_CACHELINE 64
+
+typedef struct queue_t queue_t;
+struct queue_t {
+    queue_slot_t *slots;
+    size_t mask;
+    queue_free_t freer;
+    atomic_uint_fast64_t *wait; // where to add time asleep in pop, or NULL
+    
+    _Alignas(QUEUE_CACHELINE) atomic_size_t head; // next ticket to pop
+    _Alignas(QUEUE_CACHELINE) atomic_size_t tail; // next ticket to push
     
+    _Alignas(QUEUE_CACHELINE) atomic_size_t pop_waiters, push_waiters;
     pthread_mutex_t mutex;
-    pthread_cond_t pop_cond;
+    pthread_cond_t pop_cond, push_cond;
     
-    queue_free_t freer;
-} queue_t;
+    struct engine_t *engine; // whose abort wakes us
+    queue_t *next; // in its engine's list
+};
 
 
-queue_t *queue_new(queue_free_t freer);
+queue_t *queue_new(size_t capacity, queue_free_t freer);
 void queue_free(queue_t *q);
 void queue_push(queue_t *q, int type, void *data);
 int queue_pop(queue_t *q, void **datap);
+size_t queue_length(queue_t *q); // approximate, for heuristics
 
 
 #pragma mark PIPELINE
 
-extern size_t gPipelineQSize;
-extern size_t gPipelineProcessMax;
-extern queue_t *gPipelineStartQ, *gPipelineSplitQ, *gPipelineMergeQ;
-
 typedef enum {
     PIPELINE_ITEM,
     PIPELINE_STOP
@@ -131,9 +189,8 @@ typedef enum {
 typedef struct pipeline_item_t pipeline_item_t;
 struct pipeline_item_t {
     size_t seq;
-    pipeline_item_t *next;
-    
     void *data;
+    pipeline_item_t *all; // every item the pipeline owns, for freeing
 };
 
 typedef void* (*pipeline_data_create_t)(void);
@@ -141,6 +198,11 @@ typedef void (*pipeline_data_free_t)(void*);
 typedef void (*pipeline_split_t)(void);
 typedef void (*pipeline_process_t)(size_t);
 
+size_t pipeline_threads(void);
+size_t pipeline_qsize(size_t threads);
+bool pipeline_fit(uint64_t fixed_mem, uint64_t thread_mem, uint64_t item_mem,
+    size_t min_threads);
+
 void pipeline_create(
     pipeline_data_create_t create,
     pipeline_data_free_t destroy,
@@ -149,6 +211,158 @@ void pipeline_create(
 void pipeline_stop(void);
 void pipeline_destroy(void);
 
+pipeline_item_t *pipeline_item_new(void *data); // freed with the pipeline
+void pipeline_claim(pipeline_item_t *item); // assign a seq, from any thread
+size_t pipeline_reserve(size_t count); // first of count seqs, set by the caller
 void pipeline_dispatch(pipeline_item_t *item, queue_t *q);
 void pipeline_split(pipeline_item_t *item);
 pipeline_item_t *pipeline_merged();
+
+
+#pragma mark POOL
+
+// Threads are kept around once started, and shared by every engine. A job
+// runs in its engine, or in none when that's NULL. Only CPU-bound workers are
+// rationed: between them, engines running at once get one per core.
+typedef struct pool_job_t pool_job_t;
+
+pool_job_t *pool_run(struct engine_t *e, void (*fn)(void *), void *arg);
+void pool_join(pool_job_t *job);
+size_t pool_share(size_t want); // workers we may have, at least one
+void pool_unshare(size_t count);
+
+
+#pragma mark ENGINE
+
+// Everything an operation works with. The command has one engine, and each
+// library context another. Every thread finds its own through gEngine, which
+// jobs it starts inherit.
+typedef struct engine_defer_t engine_defer_t;
+typedef struct engine_t engine_t;
+struct engine_t {
+    // Settings, before the operation starts
+    uint64_t mem_limit; // zero for no limit
+    size_t process_max, qsize; // zero to choose automatically
+    off_t range_start, range_end; // end is -1 to decode everything
+    bool map_input;
+    huge_pages_t huge_pages;
+    double block_fraction; // zero to size blocks automatically
+    double entry_align;
+    double store_entropy; // zero to always compress
+    double target_rate; // MiB/s of input, zero for a fixed level
+    int flush_idle; // milliseconds, zero to wait for full blocks
+    size_t flush_size; // zero for full blocks
+    int index_format; // file index version to write, zero for the default
+    
+    // Input and output. With read and write functions, the files are just
+    // stand-ins that can't seek, and the data bypasses stdio.
+    FILE *in_file, *out_file;
+    ssize_t (*in_read)(void *opaque, void *buf, size_t size);
+    ssize_t (*out_write)(void *opaque, const void *buf, size_t size);
+    void *io_opaque;
+    lzma_stream stream;
+    
+    // The archive's index, and the file index within it
+    lzma_index *index;
+    file_index_t *file_index, *last_file;
+    file_arena_t *file_arena;
+    int file_index_version; // of the index last read
+    file_index_stream_t *file_index_streams; // one per stream, once read
+    uint8_t *fib, fib_input[CHUNKSIZE]; // decoded and raw file index data
+    size_t fib_size, fib_pos, fib_moved;
+    lzma_ret fib_err;
+    uint8_t *tar_data; // the block tar_data_end last read
+    off_t tar_data_start;
+    size_t tar_data_len;
+    
+    // The pipeline, once created
+    queue_t *start_q, *split_q, *merge_q;
+    size_t item_count; // items in the pool
+    pipeline_item_t *items; // all of them, by their all links
+    pipeline_data_free_t pl_freer;
+    pipeline_split_t pl_split;
+    pipeline_process_t pl_process;
+    size_t pl_process_count, pl_shared;
+    pool_job_t **pl_process_jobs, *pl_split_job;
+    atomic_size_t pl_split_seq;
+    ssize_t pl_merge_seq;
+    // Reorder window for pipeline_merged, see there
+    pipeline_item_t **pl_merged;
+    size_t pl_window, pl_parked;
+    
+    // Each operation's own state
+    struct read_state_t *read;
+    struct write_state_t *write;
+    struct test_state_t *test;
+    
+    // Failing. When recover is set, die() records why and wakes every thread
+    // of the engine, and each unwinds to where its job started. Whatever's
+    // deferred is undone once they all have.
+    bool recover;
+    pthread_mutex_t lock;
+    atomic_bool aborted;
+    bool io_error;
+    char message[256];
+    queue_t *queues;
+    void (*wake)(void *arg); // for waits outside our queues
+    void *wake_arg;
+    pool_job_t *jobs; // not yet joined
+    size_t running;
+    engine_defer_t *defers;
+};
+
+extern _Thread_local engine_t *gEngine;
+
+engine_t *engine_new(void);
+void engine_free(engine_t *e);
+bool engine_run(engine_t *e, void (*fn)(void *), void *arg); // false if it died
+void engine_abort(engine_t *e, const char *why);
+void engine_check(void); // unwind now if the engine is failing
+
+// Undo this if the engine dies, unless it's been released first
+void engine_defer(void (*fn)(void *), void *arg);
+void engine_release(void *arg); // forget about it, without undoing it
+lzma_stream *stream_new(void); // freed if the engine dies
+void stream_free(lzma_stream *stream);
+
+
+#pragma mark STATS
+
+// Stats and traces are process-wide, and only the command turns them on.
+// With --stats, where the time went: a JSON summary on stderr at the end
+extern bool gStats;
+
+typedef enum {
+    STATS_START_Q,
+    STATS_SPLIT_Q,
+    STATS_MERGE_Q,
+    STATS_QUEUES
+} stats_queue_t;
+
+extern atomic_uint_fast64_t gStatsWait[STATS_QUEUES]; // nanoseconds
+extern size_t gStatsReorderMax;
+extern size_t gStatsBlockSize; // uncompressed, when compressing
+
+void stats_start(void);
+void stats_thread_end(const char *role); // this thread's CPU time and role
+void stats_block(size_t in, size_t out);
+void stats_stored(void); // a block stored as-is, not compressed
+void stats_level(int level);
+void stats_report(void);
+
+
+#pragma mark TRACE
+
+// With --trace, one Chrome trace event for each step a block takes. Events
+// are kept per thread, and only flushed to the file when a buffer fills.
+extern FILE *gTraceFile;
+
+#define TRACE_NO_SEQ SIZE_MAX // not yet given its place in the pipeline
+
+void trace_start(const char *path);
+uint64_t trace_now(void); // a span's start, zero when not tracing
+void trace_span(const char *name, uint64_t start, size_t seq, size_t in,
+    size_t out);
+void trace_instant(const char *name, size_t seq);
+void trace_role(const char *role); // name this thread in the trace
+void trace_finish(void); // flush this thread's events, and close the file
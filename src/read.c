@@ -1,5 +1,11 @@
 #include "pixz.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <archive.h>
 #include <archive_entry.h>
 
@@ -14,11 +20,19 @@ struct wanted_t {
     off_t size;
 };
 
-static wanted_t *gWantedFiles = NULL;
-
-static bool spec_match(char *spec, char *name);
+// Specs are hashed, so each name is matched in one pass, however many specs
+// there are: a spec matches a name it equals, or a directory it's a prefix of
+typedef struct {
+    char *spec;
+    size_t len;
+    uint64_t hash;
+    size_t first; // the first spec identical to this one
+} spec_t;
+
+static uint64_t spec_hash_add(uint64_t h, char c);
+static void spec_table(size_t count, char **specs);
+static ssize_t spec_find(uint64_t hash, const char *name, size_t len);
 static void wanted_files(size_t count, char **specs);
-static void wanted_free(wanted_t *w);
 
 
 #pragma mark DECLARE PIPELINE
@@ -27,29 +41,59 @@ typedef enum { BLOCK_SIZED, BLOCK_UNSIZED, BLOCK_CONTINUATION } block_type;
 
 typedef struct {
     uint8_t *input, *output;
+    uint8_t *inmap; // input within the mapped file, instead of input
+    off_t inoffset; // where the decoder should pread input from, or -1
+    bool stream_pool; // belongs to the streaming decoder, not the pipeline
 	size_t incap, outcap;
     size_t insize, outsize;
+    size_t outneed; // decode only this much when extracting, or 0 for all
     off_t uoffset; // uncompressed offset
 	lzma_check check;
 	
 	block_type btype;
+	bool first; // the first block of a stream, read without an index
 } io_block_t;
 
+static void size_blocks(void);
+static uint64_t decoder_memusage(void);
+static void fit_memory(void);
 static void *block_create(void);
 static void block_free(void *data);
 static void read_thread(void);
 static void read_thread_noindex(void);
 static void decode_thread(size_t thnum);
 
+static bool positioned_output(void);
+static void write_positioned(io_block_t *ib);
 
-#pragma mark DECLARE ARCHIVE
+static size_t range_clip(io_block_t *ib, size_t *skip);
+
+static void map_input(void);
+static void pread_block(io_block_t *ib);
+
+// Blocks too big to split are decoded by a thread of their own, straight
+// from the input file, so the reader can carry on with the blocks after them.
+// Its chunks have reserved seqs, and come from a small pool of its own so
+// that the pipeline's items can't all be tied up waiting behind them.
+#define STREAM_POOL 4 // chunk being decoded, one parked, two held by libarchive
 
-static pipeline_item_t *gArItem = NULL, *gArLastItem = NULL;
-static off_t gArLastOffset;
-static size_t gArLastSize;
-static wanted_t *gArWanted = NULL;
-static bool gArNextItem = false;
-static bool gExplicitFiles = false;
+typedef struct {
+    off_t boffset;
+    size_t bsize;
+    off_t uoffset;
+    size_t usize, need;
+    lzma_check check;
+    size_t seq;
+} stream_job_t;
+
+static void stream_start(void);
+static void stream_job_free(int type, void *p);
+static void stream_thread(void *ignore);
+static void stream_block(lzma_stream *stream, uint8_t *buf, stream_job_t *job);
+static void block_release(pipeline_item_t *pi);
+
+
+#pragma mark DECLARE ARCHIVE
 
 static int tar_ok(struct archive *ar, void *ref);
 static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp);
@@ -62,8 +106,10 @@ static void tar_write_last(void);
 #define STREAMSIZE (1024 * 1024)
 #define MAXSPLITSIZE ((64 * 1024 * 1024) * 2) // xz -9 blocksize * 2
 
-static pipeline_item_t *gRbufPI = NULL;
-static io_block_t *gRbuf = NULL;
+// Input without an index is read in big gulps into one buffer. Headers and
+// streamed data are parsed in place, and block bodies read straight into
+// their io_block_t, so leftovers only move when they reach the end.
+#define RBUFSIZE (1024 * 1024)
 
 static void block_capacity(io_block_t *ib, size_t incap, size_t outcap);
 
@@ -71,52 +117,115 @@ typedef enum {
 	RBUF_ERR, RBUF_EOF, RBUF_PART, RBUF_FULL
 } rbuf_read_status;
 
+static void rbuf_reset(void);
+static uint8_t *rbuf_data(void);
 static rbuf_read_status rbuf_read(size_t bytes);
 static bool rbuf_cycle(lzma_stream *stream, bool start, size_t skip);
 static void rbuf_consume(size_t bytes);
-static void rbuf_dispatch(void);
+static void rbuf_take(uint8_t *dst, size_t size);
 
 static bool read_header(lzma_check *check);
-static bool read_block(bool force_stream, lzma_check check, off_t uoffset);
-static void read_streaming(lzma_block *block, block_type sized, off_t uoffset);
+static bool read_block(bool force_stream, lzma_check check, off_t uoffset,
+    size_t need);
+static void read_streaming(lzma_block *block, block_type sized, off_t uoffset,
+    size_t need);
 static void read_index(void);
 static void read_footer(void);
 
 
 #pragma mark DECLARE UTILS
 
-static lzma_vli gFileIndexOffset = 0;
-
 static bool taste_tar(io_block_t *ib);
 static bool taste_file_index(io_block_t *ib);
 
 
+#pragma mark DECLARE STATE
+
+// One read's state, in its engine
+struct read_state_t {
+    wanted_t *wanted;
+    spec_t *specs;
+    size_t *spec_table, spec_mask; // indices plus one, or 0
+    
+    size_t block_in_cap, block_out_cap;
+    
+    // Output to a regular file can be written out of order, at each block's
+    // offset
+    bool positioned;
+    off_t positioned_base;
+    
+    // Seekable input can be mapped, so decoders read blocks in place
+    uint8_t *in_map;
+    size_t in_map_size;
+    // Otherwise decoders pread their own blocks, so many reads are in flight
+    bool pread_input;
+    
+    bool stream_decode; // indexed direct input, budgeted for
+    queue_t *stream_job_q, *stream_pool_q;
+    pool_job_t *stream_job;
+    
+    pipeline_item_t *ar_item, *ar_last_item;
+    off_t ar_last_offset;
+    size_t ar_last_size;
+    wanted_t *ar_wanted;
+    bool ar_next_item;
+    bool explicit_files;
+    
+    // Bigger blocks are decoded as a stream, can shrink to fit the memory
+    // limit
+    size_t max_split_size;
+    
+    uint8_t *rbuf; // unconsumed input is at rbuf + rbuf_pos
+    size_t rbuf_cap, rbuf_pos, rbuf_fill;
+    bool new_stream; // the next block read starts a stream
+    
+    lzma_vli file_index_offset;
+};
+
+#define gRead (gEngine->read)
+
+static void read_state_new(void);
+static void read_state_free(void *state);
+
+
 #pragma mark MAIN
 
 void pixz_read(bool verify, size_t nspecs, char **specs) {
+    read_state_new();
+    if (gEngine->range_end >= 0)
+        verify = false; // a range is just bytes, not a tarball
     if (decode_index()) {
 	    if (verify)
-	        gFileIndexOffset = read_file_index();
+	        gRead->file_index_offset = read_file_index_specs(nspecs, specs);
 	    wanted_files(nspecs, specs);
-		gExplicitFiles = nspecs;
+		gRead->explicit_files = nspecs;
+		map_input();
+		size_blocks();
+		// Tarballs of several streams are joined without the zeros ending
+		// all but the last, so only the files' own data may go out
+		if (gRead->file_index_offset
+		        && lzma_index_stream_count(gEngine->index) > 1)
+		    gRead->explicit_files = true;
     }
+    if (gEngine->range_end >= 0 && !gEngine->index)
+        die("Can only read a range of seekable input");
+    fit_memory();
+    gRead->positioned = positioned_output();
 
 #if DEBUG
-    for (wanted_t *w = gWantedFiles; w; w = w->next)
+    for (wanted_t *w = gRead->wanted; w; w = w->next)
         debug("want: %s", w->name);
 #endif
     
     pipeline_create(block_create, block_free,
-		gIndex ? read_thread : read_thread_noindex, decode_thread);
-    if (verify && gFileIndexOffset) {
-        gArWanted = gWantedFiles;
-        wanted_t *w = gWantedFiles, *wlast = NULL;
+		gEngine->index ? read_thread : read_thread_noindex, decode_thread);
+    if (verify && gRead->file_index_offset) {
+        gRead->ar_wanted = gRead->wanted;
+        wanted_t *w = gRead->wanted, *wlast = NULL;
         bool lastmulti = false;
         off_t lastoff = 0;
         
-        struct archive *ar = archive_read_new();
-        prevent_compression(ar);
-        archive_read_support_format_tar(ar);
+        struct archive *ar = tar_reader();
         archive_read_open(ar, NULL, tar_ok, tar_read, tar_ok);
         struct archive_entry *entry;
         while (true) {
@@ -124,8 +233,8 @@ void pixz_read(bool verify, size_t nspecs, char **specs) {
             if (aerr == ARCHIVE_EOF) {
                 break;
             } else if (aerr != ARCHIVE_OK && aerr != ARCHIVE_WARN) {
-                fprintf(stderr, "%s\n", archive_error_string(ar));
-                die("Error reading archive entry");
+                die("Error reading archive entry: %s",
+                    archive_error_string(ar));
             }
             
             off_t off = archive_read_header_position(ar);
@@ -150,25 +259,41 @@ void pixz_read(bool verify, size_t nspecs, char **specs) {
             wlast = w;
             w = w->next;
         }
-		finish_reading(ar);
+		tar_reader_free(ar);
         if (w && w->name)
             die("File %s missing in archive", w->name);
         tar_write_last(); // write whatever's left
     }
-	if (!gExplicitFiles) {
+    if (gRead->positioned) {
+        // Decoders write what they can, only streamed blocks come here
+        pipeline_item_t *pi;
+        while (queue_pop(gEngine->merge_q, (void**)&pi) != PIPELINE_STOP) {
+            uint64_t start = trace_now();
+            write_positioned((io_block_t*)(pi->data));
+            trace_span("write", start, pi->seq, 0,
+                ((io_block_t*)(pi->data))->outsize);
+            block_release(pi);
+        }
+    } else if (!gRead->explicit_files) {
 		/* Heuristics for detecting pixz file index:
 		 *    - Input must be streaming (otherwise read_thread does this) 
 		 *    - Data must look tar-like
 		 *    - Must have all sized blocks, followed by unsized file index */
-		bool start = !gIndex && verify,
+		bool start = !gEngine->index && verify,
 			 tar = false, all_sized = true, skipping = false;
 		
 		pipeline_item_t *pi;
         while ((pi = pipeline_merged())) {
             io_block_t *ib = (io_block_t*)(pi->data);
-			if (skipping && ib->btype != BLOCK_CONTINUATION) {
-				fprintf(stderr,
-					"Warning: File index heuristic failed, use -t flag.\n");
+			// Concatenated tarballs each end in a file index of their own
+			if (ib->first) {
+				skipping = false;
+				all_sized = true;
+			}
+			// A chunked index starts a new unsized block for each part
+			if (skipping && ib->btype != BLOCK_CONTINUATION
+					&& !(ib->btype == BLOCK_UNSIZED && taste_file_index(ib))) {
+				warn("Warning: File index heuristic failed, use -t flag.");
 				skipping = false;
 			}
 			if (!skipping && tar && !start && all_sized
@@ -181,109 +306,413 @@ void pixz_read(bool verify, size_t nspecs, char **specs) {
 			if (ib->btype == BLOCK_UNSIZED)
 				all_sized = false;
 			
+			size_t skip, size = range_clip(ib, &skip);
 			if (!skipping) {
-				if (fwrite(ib->output, ib->outsize, 1, gOutFile) != 1)
+				uint64_t start = trace_now();
+				if (!write_output(ib->output + skip, size))
 					die("Can't write block");
+				trace_span("write", start, pi->seq, 0, size);
 			}
-            queue_push(gPipelineStartQ, PIPELINE_ITEM, pi);
+            block_release(pi);
         }
     }
     
     pipeline_destroy();
-    wanted_free(gWantedFiles);
+    if (gRead->stream_pool_q)
+        queue_free(gRead->stream_pool_q);
+    free_file_index(); // and the wanted files with it
+    if (gEngine->index)
+        lzma_index_end(gEngine->index, NULL);
+    gEngine->index = NULL;
+    engine_release(gRead);
+    read_state_free(gRead);
+}
+
+static void read_state_new(void) {
+    struct read_state_t *r = calloc(1, sizeof(struct read_state_t));
+    if (!r)
+        die("Can't allocate memory");
+    r->max_split_size = MAXSPLITSIZE;
+    engine_defer(&read_state_free, r);
+    gRead = r;
+}
+
+// The pipeline's items, the stream pool's among them, go with the pipeline
+static void read_state_free(void *state) {
+    struct read_state_t *r = state;
+    if (r->in_map)
+        munmap(r->in_map, r->in_map_size);
+    free(r->specs);
+    free(r->spec_table);
+    free(r->rbuf);
+    free(r);
+    gRead = NULL;
+}
+
+// Each input has its own index and mapping, so it gets a pipeline of its own.
+// The settings go back to what was asked for, since fitting one file's
+// memory mustn't shrink the next.
+void pixz_read_batch(bool verify, size_t count, char **ipaths, char **opaths) {
+    engine_t *e = gEngine;
+    size_t threads = e->process_max, qsize = e->qsize;
+    for (size_t i = 0; i < count; ++i) {
+        if (!(e->in_file = fopen(ipaths[i], "r")))
+            die("can not open input file: %s: %s", ipaths[i], strerror(errno));
+        e->out_file = open_output(ipaths[i], opaths[i]);
+        debug("batch: %s -> %s", ipaths[i], opaths[i]);
+        
+        pixz_read(verify, 0, NULL);
+        if (fclose(e->out_file) != 0)
+            die("Error writing %s: %s", opaths[i], strerror(errno));
+        fclose(e->in_file);
+        e->process_max = threads;
+        e->qsize = qsize;
+    }
+    e->in_file = e->out_file = NULL;
+}
+
+
+#pragma mark OUTPUT
+
+// Without a tar pass, indexed input to a seekable file needs no ordering
+static bool positioned_output(void) {
+    engine_t *e = gEngine;
+    struct read_state_t *r = gRead;
+    if (!e->index || r->file_index_offset)
+        return false;
+    
+    int fd = fileno(e->out_file);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return false;
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1 || (flags & O_APPEND))
+        return false;
+    if ((r->positioned_base = lseek(fd, 0, SEEK_CUR)) == -1)
+        return false;
+    
+    // Pre-size the file, so blocks land in place and nothing stale follows.
+    // Blocks use pwrite, so move the offset past them for whoever writes next.
+    off_t size = lzma_index_uncompressed_size(e->index);
+    if (e->range_end >= 0) {
+        if (e->range_end < size)
+            size = e->range_end;
+        size = size > e->range_start ? size - e->range_start : 0;
+    }
+#ifdef HAVE_FALLOCATE
+    if (size)
+        fallocate(fd, 0, r->positioned_base, size); // just a hint, ok to fail
+#endif
+    if (ftruncate(fd, r->positioned_base + size) != 0)
+        return false;
+    if (lseek(fd, r->positioned_base + size, SEEK_SET) == -1)
+        die("Can't seek in output: %s", strerror(errno));
+    return true;
+}
+
+static void write_positioned(io_block_t *ib) {
+    int fd = fileno(gEngine->out_file);
+    size_t skip, size = range_clip(ib, &skip);
+    off_t pos = gRead->positioned_base + ib->uoffset + skip
+        - gEngine->range_start;
+    size_t written = 0;
+    while (written < size) {
+        ssize_t wr = pwrite(fd, ib->output + skip + written, size - written,
+            pos + written);
+        if (wr == -1 && errno == EINTR)
+            continue;
+        if (wr <= 0)
+            die("Can't write block: %s", strerror(errno));
+        written += wr;
+    }
+}
+
+// The part of a block's output that's in the range
+static size_t range_clip(io_block_t *ib, size_t *skip) {
+    engine_t *e = gEngine;
+    *skip = 0;
+    if (e->range_end < 0)
+        return ib->outsize;
+    
+    off_t start = ib->uoffset, end = ib->uoffset + ib->outsize;
+    if (start < e->range_start)
+        start = e->range_start;
+    if (end > e->range_end)
+        end = e->range_end;
+    if (end <= start)
+        return 0;
+    *skip = start - ib->uoffset;
+    return end - start;
 }
 
 
 #pragma mark BLOCKS
 
+static void map_input(void) {
+    engine_t *e = gEngine;
+    struct read_state_t *r = gRead;
+    struct stat st;
+    if (fstat(fileno(e->in_file), &st) != 0 || !S_ISREG(st.st_mode))
+        return;
+    
+    void *map = MAP_FAILED;
+    if (e->map_input && st.st_size > 0 && (uint64_t)st.st_size <= SIZE_MAX)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED,
+            fileno(e->in_file), 0);
+    if (map == MAP_FAILED) {
+        r->pread_input = true;
+#ifdef POSIX_FADV_RANDOM
+        if (r->explicit_files)
+            posix_fadvise(fileno(e->in_file), 0, 0, POSIX_FADV_RANDOM);
+#endif
+        return;
+    }
+    r->in_map = map;
+    r->in_map_size = st.st_size;
+#ifdef MADV_SEQUENTIAL
+    // Extraction jumps around, so don't read ahead past what we ask for
+    madvise(r->in_map, r->in_map_size,
+        r->explicit_files ? MADV_RANDOM : MADV_SEQUENTIAL);
+#endif
+}
+
+// With an index, find the biggest block up front so buffers never regrow
+static void size_blocks(void) {
+    struct read_state_t *r = gRead;
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, gEngine->index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        if (iter.block.uncompressed_size > r->max_split_size)
+            continue; // streamed instead
+        if (!r->in_map && iter.block.total_size > r->block_in_cap)
+            r->block_in_cap = iter.block.total_size;
+        if (iter.block.uncompressed_size > r->block_out_cap)
+            r->block_out_cap = iter.block.uncompressed_size;
+    }
+}
+
+// Peek at the first block's filters, or assume the worst without an index
+static uint64_t decoder_memusage(void) {
+    engine_t *e = gEngine;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_options_lzma opts;
+    if (!e->index) {
+        if (lzma_lzma_preset(&opts, 9))
+            die("Error setting lzma options");
+        filters[0] = (lzma_filter){ .id = LZMA_FILTER_LZMA2,
+            .options = &opts };
+        filters[1] = (lzma_filter){ .id = LZMA_VLI_UNKNOWN, .options = NULL };
+        return lzma_raw_decoder_memusage(filters);
+    }
+    
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, e->index);
+    if (lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK))
+        return 0; // no blocks at all
+    lzma_block block = { .filters = filters, .version = 0,
+        .check = iter.stream.flags->check };
+    
+    uint8_t hdrbuf[LZMA_BLOCK_HEADER_SIZE_MAX];
+    if (fseeko(e->in_file, iter.block.compressed_file_offset, SEEK_SET) == -1
+            || fread(hdrbuf, 1, 1, e->in_file) != 1)
+        die("Error reading block header");
+    block.header_size = lzma_block_header_size_decode(hdrbuf[0]);
+    if (fread(hdrbuf + 1, block.header_size - 1, 1, e->in_file) != 1)
+        die("Error reading block header");
+    if (lzma_block_header_decode(&block, NULL, hdrbuf) != LZMA_OK)
+        die("Error decoding block header");
+    
+    uint64_t usage = lzma_raw_decoder_memusage(filters);
+    for (lzma_filter *f = filters; f->id != LZMA_VLI_UNKNOWN; ++f)
+        free(f->options);
+    return usage;
+}
+
+// Use fewer threads, a shorter queue, and finally stream more of the blocks,
+// until we fit in the memory limit. The streaming decoder is one more
+// decoder, with its pool of chunks.
+static void fit_memory(void) {
+    engine_t *e = gEngine;
+    struct read_state_t *r = gRead;
+    r->stream_decode = e->index && (r->in_map || r->pread_input);
+    if (!e->mem_limit)
+        return;
+    
+    uint64_t decoder = decoder_memusage();
+    if (decoder == UINT64_MAX)
+        die("Error estimating decoder memory usage");
+    uint64_t streamer = 0;
+    if (r->stream_decode)
+        streamer = decoder + (STREAM_POOL + (r->in_map ? 0 : 1)) * STREAMSIZE;
+    while (true) {
+        uint64_t item = e->index ? r->block_in_cap + r->block_out_cap
+            : 2 * (uint64_t)r->max_split_size;
+        if (item < STREAMSIZE)
+            item = STREAMSIZE;
+        if (pipeline_fit(streamer, decoder, item, 1))
+            return;
+        
+        if (r->max_split_size <= STREAMSIZE) {
+            warn("Warning: can't fit in memory limit, using minimum settings");
+            e->process_max = 1;
+            e->qsize = 3; // streaming reader and tar verifier hold one each
+            return;
+        }
+        r->max_split_size /= 2;
+        if (e->index) {
+            r->block_in_cap = r->block_out_cap = 0;
+            size_blocks();
+        }
+    }
+}
+
 static void *block_create(void) {
     io_block_t *ib = malloc(sizeof(io_block_t));
 	ib->incap = ib->outcap = 0;
-	ib->input = ib->output = NULL;
+	ib->input = ib->output = ib->inmap = NULL;
+	ib->inoffset = -1;
+	ib->outneed = 0;
+	ib->stream_pool = false;
+	block_capacity(ib, gRead->block_in_cap, gRead->block_out_cap);
     return ib;
 }
 
 static void block_free(void* data) {
     io_block_t *ib = (io_block_t*)data;
-    free(ib->input);
-    free(ib->output);
+    buffer_free(ib->input, ib->incap);
+    buffer_free(ib->output, ib->outcap);
     free(ib);
 }
 
 
 #pragma mark SETUP
 
-static void wanted_free(wanted_t *w) {
-    for (wanted_t *w = gWantedFiles; w; ) {
-        wanted_t *tmp = w->next;
-        free(w);
-        w = tmp;
-    }
+#define SPEC_HASH_INIT 14695981039346656037ULL // FNV-1a
+
+static uint64_t spec_hash_add(uint64_t h, char c) {
+    return (h ^ (uint8_t)c) * 1099511628211ULL;
 }
 
+static void spec_table(size_t count, char **specs) {
+    struct read_state_t *r = gRead;
+    r->specs = malloc(count * sizeof(spec_t));
+    for (r->spec_mask = 1; r->spec_mask < count * 2; r->spec_mask <<= 1) ;
+    r->spec_table = calloc(r->spec_mask--, sizeof(size_t));
+    
+    for (size_t i = 0; i < count; ++i) {
+        spec_t *sp = &r->specs[i];
+        sp->spec = specs[i];
+        sp->len = strlen(specs[i]);
+        sp->hash = SPEC_HASH_INIT;
+        for (char *c = specs[i]; *c; ++c)
+            sp->hash = spec_hash_add(sp->hash, *c);
+        
+        ssize_t dup = spec_find(sp->hash, sp->spec, sp->len);
+        sp->first = (dup == -1) ? i : dup;
+        if (dup != -1)
+            continue;
+        
+        size_t slot = sp->hash & r->spec_mask;
+        while (r->spec_table[slot])
+            slot = (slot + 1) & r->spec_mask;
+        r->spec_table[slot] = i + 1;
+    }
+}
 
-static bool spec_match(char *spec, char *name) {
-    bool match = true;
-    for (; *spec; ++spec, ++name) {
-        if (!*name || *spec != *name) { // spec must be equal or prefix
-            match = false;
-            break;
-        }
+// Find the spec equal to the first len chars of name, or -1
+static ssize_t spec_find(uint64_t hash, const char *name, size_t len) {
+    struct read_state_t *r = gRead;
+    for (size_t slot = hash & r->spec_mask; r->spec_table[slot];
+            slot = (slot + 1) & r->spec_mask) {
+        spec_t *sp = &r->specs[r->spec_table[slot] - 1];
+        if (sp->hash == hash && sp->len == len
+                && memcmp(sp->spec, name, len) == 0)
+            return sp - r->specs;
     }
-    // If spec's a prefix of the file name, it must be a dir name
-    return match && (!*name || *name == '/');
+    return -1;
 }
 
 static void wanted_files(size_t count, char **specs) {
-    if (!gFileIndexOffset) {
+    engine_t *e = gEngine;
+    struct read_state_t *r = gRead;
+    if (!r->file_index_offset) {
         if (count)
             die("Can't filter non-tarball");
-        gWantedFiles = NULL;
+        r->wanted = NULL;
         return;
     }
     
     // Remove trailing slashes from specs
     for (char **spec = specs; spec < specs + count; ++spec) {
-        char *c = *spec;
-        while (*c++) ; // forward to end
+        char *c = *spec + strlen(*spec);
         while (--c >= *spec && *c == '/')
             *c = '\0';
     }
+    spec_table(count, specs);
     
-    bool matched[count];  // for each spec, does it match?
-    memset(matched, 0, sizeof(matched));
+    bool *matched = calloc(count ? count : 1, sizeof(bool));
     wanted_t *last = NULL;
+    size_t streams = lzma_index_stream_count(e->index), stream = 0;
     
     // Check each file in order, to see if we want it
-    for (file_index_t *f = gFileIndex; f->name; f = f->next) {
+    for (file_index_t *f = e->file_index; f; f = f->next) {
+        if (!f->name)
+            continue; // the end of a run, or of the archive
         bool match = !count;
-        for (char **spec = specs; spec < specs + count; ++spec) {
-            if (spec_match(*spec, f->name)) {
-                match = true;
-                matched[spec - specs] = true;
-                break;
+        if (count) {
+            // Try the name, and each directory it's in
+            uint64_t h = SPEC_HASH_INIT;
+            for (char *c = f->name; ; ++c) {
+                if (!*c || *c == '/') {
+                    ssize_t i = spec_find(h, f->name, c - f->name);
+                    if (i != -1) {
+                        match = true;
+                        matched[i] = true;
+                    }
+                }
+                if (!*c)
+                    break;
+                h = spec_hash_add(h, *c);
             }
         }
         
         if (match) {
-            wanted_t *w = malloc(sizeof(wanted_t));
+            // Only the last stream's tarball keeps its end-of-archive zeros
+            off_t end = f->next->offset;
+            while (stream + 1 < streams
+                    && (off_t)e->file_index_streams[stream].index_start
+                        <= f->offset)
+                ++stream;
+            if (stream + 1 < streams
+                    && (off_t)e->file_index_streams[stream].index_start == end)
+                end = tar_data_end(f->offset, end);
+            
+            wanted_t *w = file_arena_alloc(sizeof(wanted_t));
             *w = (wanted_t){ .name = f->name, .start = f->offset,
-                .end = f->next->offset, .next = NULL };
+                .end = end, .next = NULL };
             w->size = w->end - w->start;
             if (last) {
                 last->next = w;
             } else {
-                gWantedFiles = w;
+                r->wanted = w;
             }
             last = w;
         }
     }
     
     // Make sure each spec matched
-    for (size_t i = 0; i < count; ++i) {
-        if (!matched[i])
-            die("\"%s\" not found in archive", *(specs + i));
+    ssize_t missing = -1;
+    for (size_t i = 0; i < count && missing == -1; ++i) {
+        if (!matched[r->specs[i].first])
+            missing = i;
     }
+    free(matched);
+    free(r->specs);
+    free(r->spec_table);
+    r->specs = NULL;
+    r->spec_table = NULL;
+    if (missing != -1)
+        die("\"%s\" not found in archive", specs[missing]);
 }
 
 
@@ -291,58 +720,89 @@ static void wanted_files(size_t count, char **specs) {
 
 static void block_capacity(io_block_t *ib, size_t incap, size_t outcap) {
 	if (incap > ib->incap) {
+		ib->input = buffer_grow(ib->input, ib->incap, incap);
 		ib->incap = incap;
-		ib->input = realloc(ib->input, incap);
 	}
-	if (outcap > ib->outcap) {
+	if (outcap > ib->outcap) { // old output needn't survive
+		buffer_free(ib->output, ib->outcap);
+		ib->output = buffer_alloc(outcap);
 		ib->outcap = outcap;
-		ib->output = malloc(outcap);
 	}
 }
 
-// Ensure at least this many bytes available
-// Return 1 on success, zero on EOF, -1 on error
+// Start reading from the descriptor where the stream is, dropping anything
+// buffered. The stdio buffer is synced and emptied, so later seeks stay right.
+static void rbuf_reset(void) {
+	fflush(gEngine->in_file);
+	gRead->rbuf_pos = gRead->rbuf_fill = 0;
+}
+
+static uint8_t *rbuf_data(void) {
+	return gRead->rbuf + gRead->rbuf_pos;
+}
+
+// Ensure at least this many bytes available, reading as much as fits
 static rbuf_read_status rbuf_read(size_t bytes) {
-	if (!gRbufPI) {
-        queue_pop(gPipelineStartQ, (void**)&gRbufPI);
-		gRbuf = (io_block_t*)(gRbufPI->data);
-		gRbuf->insize = gRbuf->outsize = 0;
-	}
-	
-	if (gRbuf->insize >= bytes)
+    struct read_state_t *r = gRead;
+	if (r->rbuf_fill >= bytes)
 		return RBUF_FULL;
+	if (bytes > r->rbuf_cap) {
+		size_t cap = bytes > RBUFSIZE ? bytes : RBUFSIZE;
+		if (!(r->rbuf = realloc(r->rbuf, cap)))
+			die("Can't allocate read buffer");
+		r->rbuf_cap = cap;
+	}
+	if (r->rbuf_pos + bytes > r->rbuf_cap) { // only the leftovers move
+		memmove(r->rbuf, rbuf_data(), r->rbuf_fill);
+		r->rbuf_pos = 0;
+	}
 	
-	block_capacity(gRbuf, bytes, 0);
-	size_t r = fread(gRbuf->input + gRbuf->insize, 1, bytes - gRbuf->insize,
-		gInFile);
-	gRbuf->insize += r;
-	
-	if (r)
-		return (gRbuf->insize == bytes) ? RBUF_FULL : RBUF_PART;
-	return feof(gInFile) ? RBUF_EOF : RBUF_ERR;
+	while (r->rbuf_fill < bytes) {
+		ssize_t rd = read_input(rbuf_data() + r->rbuf_fill,
+			r->rbuf_cap - r->rbuf_pos - r->rbuf_fill);
+		if (rd == -1 && errno == EINTR)
+			continue;
+		if (rd == -1)
+			return RBUF_ERR;
+		if (rd == 0)
+			return r->rbuf_fill ? RBUF_PART : RBUF_EOF;
+		r->rbuf_fill += rd;
+	}
+	return RBUF_FULL;
 }
 
 static bool rbuf_cycle(lzma_stream *stream, bool start, size_t skip) {
 	if (!start) {
-		rbuf_consume(gRbuf->insize);
-		if (rbuf_read(CHUNKSIZE) < RBUF_PART)
+		rbuf_consume(gRead->rbuf_fill);
+		if (rbuf_read(1) < RBUF_PART)
 			return false;
 	}
-	stream->next_in = gRbuf->input + skip;
-	stream->avail_in = gRbuf->insize - skip;
+	stream->next_in = rbuf_data() + skip;
+	stream->avail_in = gRead->rbuf_fill - skip;
 	return true;
 }
 
 static void rbuf_consume(size_t bytes) {
-	if (bytes < gRbuf->insize)
-		memmove(gRbuf->input, gRbuf->input + bytes, gRbuf->insize - bytes);
-	gRbuf->insize -= bytes;
+    struct read_state_t *r = gRead;
+	r->rbuf_pos += bytes;
+	r->rbuf_fill -= bytes;
+	if (!r->rbuf_fill)
+		r->rbuf_pos = 0;
 }
 
-static void rbuf_dispatch(void) {
-	pipeline_split(gRbufPI);
-	gRbufPI = NULL;
-	gRbuf = NULL;
+// Copy out what's buffered of a block, and read the rest right into place
+static void rbuf_take(uint8_t *dst, size_t size) {
+	size_t have = gRead->rbuf_fill < size ? gRead->rbuf_fill : size;
+	memcpy(dst, rbuf_data(), have);
+	rbuf_consume(have);
+	while (have < size) {
+		ssize_t rd = read_input(dst + have, size - have);
+		if (rd == -1 && errno == EINTR)
+			continue;
+		if (rd <= 0)
+			die("Error reading block contents");
+		have += rd;
+	}
 }
 
 
@@ -353,7 +813,7 @@ static bool read_header(lzma_check *check) {
 		return false;
 	else if (st != RBUF_FULL)
 		die("Error reading stream header");
-	lzma_ret err = lzma_stream_header_decode(&stream_flags, gRbuf->input);
+	lzma_ret err = lzma_stream_header_decode(&stream_flags, rbuf_data());
 	if (err == LZMA_FORMAT_ERROR)
 		die("Not an XZ file");
 	else if (err != LZMA_OK)
@@ -363,109 +823,137 @@ static bool read_header(lzma_check *check) {
 	return true;
 }
 
-static bool read_block(bool force_stream, lzma_check check, off_t uoffset) {
+// If need is non-zero, stop streaming after that many bytes
+static bool read_block(bool force_stream, lzma_check check, off_t uoffset,
+        size_t need) {
     lzma_filter filters[LZMA_FILTERS_MAX + 1];
     lzma_block block = { .filters = filters, .check = check, .version = 0 };
 	
 	if (rbuf_read(1) != RBUF_FULL)
 		die("Error reading block header size");
-	if (gRbuf->input[0] == 0)
+	if (rbuf_data()[0] == 0)
 		return false;
 	
-	block.header_size = lzma_block_header_size_decode(gRbuf->input[0]);
+	block.header_size = lzma_block_header_size_decode(rbuf_data()[0]);
 	if (block.header_size > LZMA_BLOCK_HEADER_SIZE_MAX)
 		die("Block header size too large");
 	if (rbuf_read(block.header_size) != RBUF_FULL)
 		die("Error reading block header");
-	if (lzma_block_header_decode(&block, NULL, gRbuf->input) != LZMA_OK)
+	if (lzma_block_header_decode(&block, NULL, rbuf_data()) != LZMA_OK)
 		die("Error decoding block header");
 		
 	size_t comp = block.compressed_size, outsize = block.uncompressed_size;
 	bool sized = (comp != LZMA_VLI_UNKNOWN && outsize != LZMA_VLI_UNKNOWN);
-    if (force_stream || !sized || outsize > MAXSPLITSIZE) {
-		read_streaming(&block, sized ? BLOCK_SIZED : BLOCK_UNSIZED, uoffset);
+    if (force_stream || !sized || outsize > gRead->max_split_size) {
+		read_streaming(&block, sized ? BLOCK_SIZED : BLOCK_UNSIZED, uoffset,
+			need);
 	} else {
-		block_capacity(gRbuf, 0, outsize);
-		gRbuf->outsize = outsize;
-		gRbuf->check = check;
-		gRbuf->btype = BLOCK_SIZED;
+        for (lzma_filter *f = filters; f->id != LZMA_VLI_UNKNOWN; ++f)
+            free(f->options);
+		pipeline_item_t *pi;
+		queue_pop(gEngine->start_q, (void**)&pi);
+		io_block_t *ib = (io_block_t*)(pi->data);
+		size_t total = lzma_block_total_size(&block);
+		block_capacity(ib, total, outsize);
+		ib->insize = total;
+		ib->outsize = outsize;
+		ib->outneed = 0;
+		ib->inmap = NULL;
+		ib->inoffset = -1;
+		ib->check = check;
+		ib->btype = BLOCK_SIZED;
+		ib->first = gRead->new_stream;
+		gRead->new_stream = false;
 		
-		if (rbuf_read(lzma_block_total_size(&block)) != RBUF_FULL)
-			die("Error reading block contents");
-		rbuf_dispatch();
+		rbuf_take(ib->input, total); // header and all
+		pipeline_split(pi);
 	}
 	return true;
 }
 
-static void read_streaming(lzma_block *block, block_type sized, off_t uoffset) {
-    lzma_stream stream = LZMA_STREAM_INIT;
-    if (lzma_block_decoder(&stream, block) != LZMA_OK)
+static void read_streaming(lzma_block *block, block_type sized, off_t uoffset,
+        size_t need) {
+    lzma_stream *stream = stream_new();
+    if (lzma_block_decoder(stream, block) != LZMA_OK)
 		die("Error initializing streaming block decode");
-	rbuf_cycle(&stream, true, block->header_size);
-	stream.avail_out = 0;
+	for (lzma_filter *f = block->filters; f->id != LZMA_VLI_UNKNOWN; ++f)
+		free(f->options);
+	rbuf_cycle(stream, true, block->header_size);
+	stream->avail_out = 0;
 	
 	bool first = true;
     pipeline_item_t *pi = NULL;
     io_block_t *ib = NULL;
+    size_t left = need ? need : SIZE_MAX;
     
 	lzma_ret err = LZMA_OK;
 	while (err != LZMA_STREAM_END) {
 		if (err != LZMA_OK)
 			die("Error decoding streaming block");
 		
-		if (stream.avail_out == 0) {
+		if (stream->avail_out == 0) {
 			if (ib) {
-				ib->outsize = ib->outcap;
+				ib->outsize = stream->next_out - ib->output;
                 ib->uoffset = uoffset;
                 uoffset += ib->outsize;
-				pipeline_dispatch(pi, gPipelineMergeQ);
+                left -= ib->outsize;
+				pipeline_dispatch(pi, gEngine->merge_q);
 				first = false;
+				ib = NULL;
 			}
-			queue_pop(gPipelineStartQ, (void**)&pi);
+			if (!left)
+				break; // got all we need, the rest is never read
+			queue_pop(gEngine->start_q, (void**)&pi);
 			ib = (io_block_t*)pi->data;
 			ib->btype = (first ? sized : BLOCK_CONTINUATION);
+			ib->first = gRead->new_stream;
+			gRead->new_stream = false;
 			block_capacity(ib, 0, STREAMSIZE);
-			stream.next_out = ib->output;
-			stream.avail_out = ib->outcap;
+			stream->next_out = ib->output;
+			stream->avail_out = left < ib->outcap ? left : ib->outcap;
 		}
-		if (stream.avail_in == 0 && !rbuf_cycle(&stream, false, 0))
+		if (stream->avail_in == 0 && !rbuf_cycle(stream, false, 0))
 			die("Error reading streaming block");
 		
-		err = lzma_code(&stream, LZMA_RUN);
+		err = lzma_code(stream, LZMA_RUN);
 	}
 	
-	if (ib && stream.avail_out != ib->outcap) {
-		ib->outsize = ib->outcap - stream.avail_out;
-		pipeline_dispatch(pi, gPipelineMergeQ);
+	if (ib && stream->next_out != ib->output) {
+		ib->outsize = stream->next_out - ib->output;
+		ib->uoffset = uoffset;
+		pipeline_dispatch(pi, gEngine->merge_q);
+	} else if (ib) {
+		block_release(pi);
 	}
-	rbuf_consume(gRbuf->insize - stream.avail_in);
-	lzma_end(&stream);
+	rbuf_consume(gRead->rbuf_fill - stream->avail_in);
+	stream_free(stream);
 }
 
 static void read_index(void) {
-    lzma_stream stream = LZMA_STREAM_INIT;
+    lzma_stream *stream = stream_new();
 	lzma_index *index;
-	if (lzma_index_decoder(&stream, &index, MEMLIMIT) != LZMA_OK)
+	if (lzma_index_decoder(stream, &index, MEMLIMIT) != LZMA_OK)
 		die("Error initializing index decoder");
-	rbuf_cycle(&stream, true, 0);
+	rbuf_cycle(stream, true, 0);
 	
 	lzma_ret err = LZMA_OK;
 	while (err != LZMA_STREAM_END) {
 		if (err != LZMA_OK)
 			die("Error decoding index");
-		if (stream.avail_in == 0 && !rbuf_cycle(&stream, false, 0))
+		if (stream->avail_in == 0 && !rbuf_cycle(stream, false, 0))
 			die("Error reading index");
-		err = lzma_code(&stream, LZMA_RUN);
+		err = lzma_code(stream, LZMA_RUN);
 	}
-	rbuf_consume(gRbuf->insize - stream.avail_in);
-	lzma_end(&stream);
+	rbuf_consume(gRead->rbuf_fill - stream->avail_in);
+	stream_free(stream);
+	lzma_index_end(index, NULL);
 }
 
 static void read_footer(void) {
 	lzma_stream_flags stream_flags;
 	if (rbuf_read(LZMA_STREAM_HEADER_SIZE) != RBUF_FULL)
 		die("Error reading stream footer");
-	if (lzma_stream_footer_decode(&stream_flags, gRbuf->input) != LZMA_OK)
+	if (lzma_stream_footer_decode(&stream_flags, rbuf_data()) != LZMA_OK)
 		die("Error decoding XZ footer");
 	rbuf_consume(LZMA_STREAM_HEADER_SIZE);
 	
@@ -476,90 +964,327 @@ static void read_footer(void) {
 			return;
 		if (st != RBUF_FULL)
 			die("Footer must be multiple of four bytes");
-		if (memcmp(zeros, gRbuf->input, 4) != 0)
+		if (memcmp(zeros, rbuf_data(), 4) != 0)
 			return;
 		rbuf_consume(4);
 	}
 }
 
 static void read_thread_noindex(void) {
+	rbuf_reset();
 	bool empty = true;
 	lzma_check check = LZMA_CHECK_NONE;
 	while (read_header(&check)) {
 		empty = false;
-		while (read_block(false, check, 0))
+		gRead->new_stream = true;
+		while (read_block(false, check, 0, 0))
 			; // pass
 		read_index();
 		read_footer();
 	}
 	if (empty)
 		die("Empty input");
+	stats_thread_end("read");
 	pipeline_stop();
 }
 
 static void read_thread(void) {
-    off_t offset = ftello(gInFile);
-    wanted_t *w = gWantedFiles;
+    engine_t *e = gEngine;
+    struct read_state_t *r = gRead;
+    off_t offset = ftello(e->in_file);
+    wanted_t *w = r->wanted;
+    
+    if (r->stream_decode)
+        stream_start();
     
     lzma_index_iter iter;
-    lzma_index_iter_init(&iter, gIndex);
+    lzma_index_iter_init(&iter, e->index);
     while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
-        // Don't decode the file-index
+        // Don't decode the file-index, which is all the blocks from there on
         off_t boffset = iter.block.compressed_file_offset;
         size_t bsize = iter.block.total_size;
-        if (gFileIndexOffset && boffset == gFileIndexOffset)
+        if (r->file_index_offset && file_index_block(&iter))
             continue;
         
-        // Do we need this block?
-        if (gWantedFiles && gExplicitFiles) {
-            off_t uend = iter.block.uncompressed_file_offset +
-                iter.block.uncompressed_size;
+        // Do we need this block, and how much of it?
+        size_t need = iter.block.uncompressed_size;
+        if (e->range_end >= 0) {
+            off_t ustart = iter.block.uncompressed_file_offset;
+            if (ustart >= e->range_end)
+                break; // blocks come in order, the rest are past it
+            if (ustart + (off_t)need <= e->range_start)
+                continue;
+            if (e->range_end - ustart < (off_t)need)
+                need = e->range_end - ustart;
+        }
+        if (r->wanted && r->explicit_files) {
+            off_t ustart = iter.block.uncompressed_file_offset,
+                uend = ustart + iter.block.uncompressed_size, last = ustart;
+            for ( ; w && w->end <= ustart; w = w->next) ;
             if (!w || w->start >= uend) {
                 debug("read: skip %llu", iter.block.number_in_file);
                 continue;
             }
-            for ( ; w && w->end < uend; w = w->next) ;
+            for ( ; w && w->end < uend; w = w->next)
+                last = w->end;
+            // Nothing wanted after the last file ending here
+            if (!w || w->start >= uend)
+                need = last - ustart;
         }
         debug("read: want %llu", iter.block.number_in_file);
         
         // Seek if needed, and get the data
-        if (offset != boffset) {
-            fseeko(gInFile, boffset, SEEK_SET);
+        bool stream = iter.block.uncompressed_size > r->max_split_size;
+        bool direct = r->in_map || r->pread_input;
+        if (offset != boffset && (stream ? !r->stream_job_q : !direct)) {
+            fseeko(e->in_file, boffset, SEEK_SET);
             offset = boffset;
         }
 		
-		if (iter.block.uncompressed_size > MAXSPLITSIZE) { // must stream
-			if (gRbuf)
-				rbuf_consume(gRbuf->insize); // clear
+		if (stream && r->stream_job_q) {
+            stream_job_t *job = malloc(sizeof(stream_job_t));
+            job->boffset = boffset;
+            job->bsize = bsize;
+            job->uoffset = iter.block.uncompressed_file_offset;
+            job->usize = iter.block.uncompressed_size;
+            job->need = need;
+            job->check = iter.stream.flags->check;
+            job->seq = pipeline_reserve((need + STREAMSIZE - 1) / STREAMSIZE);
+            queue_push(r->stream_job_q, PIPELINE_ITEM, job);
+        } else if (stream) { // must stream
+			rbuf_reset(); // the descriptor is at boffset
 			read_block(true, iter.stream.flags->check,
-                iter.block.uncompressed_file_offset);
+                iter.block.uncompressed_file_offset, need);
+            offset = -1; // the read buffer leaves us somewhere past it
 		} else {
             // Get a block to work with
             pipeline_item_t *pi;
-            queue_pop(gPipelineStartQ, (void**)&pi);
+            queue_pop(e->start_q, (void**)&pi);
             io_block_t *ib = (io_block_t*)(pi->data);
-            block_capacity(ib, bsize,
-                iter.block.uncompressed_size);
-            
-	        ib->insize = fread(ib->input, 1, bsize, gInFile);
-	        if (ib->insize < bsize)
-	            die("Error reading block contents");
-	        offset += bsize;
+            uint64_t start = trace_now();
+            ib->inoffset = -1;
+            if (r->in_map) {
+                if (boffset + bsize > r->in_map_size)
+                    die("Error reading block contents");
+                block_capacity(ib, 0, iter.block.uncompressed_size);
+                ib->inmap = r->in_map + boffset;
+                ib->insize = bsize;
+#ifdef MADV_WILLNEED
+                // Start paging it in before a decoder gets to it
+                uintptr_t page = sysconf(_SC_PAGESIZE), start =
+                    (uintptr_t)ib->inmap & ~(page - 1);
+                madvise((void*)start, (uintptr_t)ib->inmap + bsize - start,
+                    MADV_WILLNEED);
+#endif
+            } else if (r->pread_input) {
+                block_capacity(ib, bsize, iter.block.uncompressed_size);
+                ib->inmap = NULL;
+                ib->inoffset = boffset;
+                ib->insize = bsize;
+#ifdef POSIX_FADV_WILLNEED
+                // Queue the read now, the decoder's pread picks it up later
+                posix_fadvise(fileno(e->in_file), boffset, bsize,
+                    POSIX_FADV_WILLNEED);
+#endif
+            } else {
+                block_capacity(ib, bsize,
+                    iter.block.uncompressed_size);
+                ib->inmap = NULL;
+	            ib->insize = fread(ib->input, 1, bsize, e->in_file);
+	            if (ib->insize < bsize)
+	                die("Error reading block contents");
+	            offset += bsize;
+            }
 	        ib->uoffset = iter.block.uncompressed_file_offset;
+	        ib->outneed = need < iter.block.uncompressed_size ? need : 0;
 			ib->check = iter.stream.flags->check;
 			ib->btype = BLOCK_SIZED; // Indexed blocks always sized
+			ib->first = false;
 			
+            // Once split a decoder owns it, its seq follows in "queued"
+            trace_span("read", start, TRACE_NO_SEQ, ib->insize, 0);
 	        pipeline_split(pi);
 		}
     }
     
+    if (r->stream_job_q) {
+        queue_push(r->stream_job_q, PIPELINE_STOP, NULL);
+        pool_join(r->stream_job);
+        queue_free(r->stream_job_q);
+        r->stream_job_q = NULL;
+    }
+    stats_thread_end("read");
     pipeline_stop();
 }
 
+#pragma mark STREAMING DECODE
+
+static void stream_start(void) {
+    struct read_state_t *r = gRead;
+    r->stream_job_q = queue_new(gEngine->item_count, stream_job_free);
+    r->stream_pool_q = queue_new(STREAM_POOL, NULL);
+    for (size_t i = 0; i < STREAM_POOL; ++i) {
+        io_block_t *ib = block_create();
+        pipeline_item_t *pi = pipeline_item_new(ib);
+        ib->stream_pool = true;
+        block_capacity(ib, 0, STREAMSIZE);
+        queue_push(r->stream_pool_q, PIPELINE_ITEM, pi);
+    }
+    r->stream_job = pool_run(gEngine, &stream_thread, NULL);
+}
+
+static void stream_job_free(int type, void *p) {
+    free(p);
+}
+
+static void block_release(pipeline_item_t *pi) {
+    io_block_t *ib = (io_block_t*)(pi->data);
+    queue_push(ib->stream_pool ? gRead->stream_pool_q : gEngine->start_q,
+        PIPELINE_ITEM, pi);
+}
+
+static void stream_thread(void *ignore) {
+    lzma_stream *stream = stream_new();
+    uint8_t *buf = NULL; // for pread
+    if (!gRead->in_map) {
+        if (!(buf = malloc(STREAMSIZE)))
+            die("Can't allocate stream buffer");
+        engine_defer(&free, buf);
+    }
+    stream_job_t *job;
+    while (queue_pop(gRead->stream_job_q, (void**)&job) != PIPELINE_STOP) {
+        stream_block(stream, buf, job);
+        stats_block(job->bsize, job->need);
+        free(job);
+    }
+    engine_release(buf);
+    free(buf);
+    stream_free(stream);
+    stats_thread_end("stream");
+}
+
+// Fill in more input, from the mapping or with pread
+static void stream_input(lzma_stream *stream, uint8_t *buf, off_t *pos,
+        off_t end) {
+    size_t size = end - *pos;
+    if (gRead->in_map) {
+        stream->next_in = gRead->in_map + *pos;
+    } else {
+        if (size > STREAMSIZE)
+            size = STREAMSIZE;
+        ssize_t rd;
+        while ((rd = pread(fileno(gEngine->in_file), buf, size, *pos)) == -1
+                && errno == EINTR)
+            ;
+        if (rd <= 0)
+            die("Error reading block contents");
+        size = rd;
+        stream->next_in = buf;
+    }
+    stream->avail_in = size;
+    *pos += size;
+}
+
+static void stream_block(lzma_stream *stream, uint8_t *buf, stream_job_t *job) {
+    struct read_state_t *r = gRead;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block = { .filters = filters, .check = job->check,
+        .version = 0 };
+    
+    off_t pos = job->boffset, end = job->boffset + job->bsize;
+    uint8_t hdr[LZMA_BLOCK_HEADER_SIZE_MAX];
+    size_t hsize = job->bsize < sizeof(hdr) ? job->bsize : sizeof(hdr);
+    if (r->in_map) {
+        memcpy(hdr, r->in_map + pos, hsize);
+    } else if (pread(fileno(gEngine->in_file), hdr, hsize, pos)
+            != (ssize_t)hsize) {
+        die("Error reading block header");
+    }
+    block.header_size = lzma_block_header_size_decode(hdr[0]);
+    if (block.header_size > hsize
+            || lzma_block_header_decode(&block, NULL, hdr) != LZMA_OK)
+        die("Error decoding block header");
+    if (lzma_block_decoder(stream, &block) != LZMA_OK)
+        die("Error initializing streaming block decode");
+    for (lzma_filter *f = filters; f->id != LZMA_VLI_UNKNOWN; ++f)
+        free(f->options);
+    pos += block.header_size;
+    stream->avail_in = 0;
+    
+    // Exactly as many chunks as we reserved seqs for
+    size_t seq = job->seq, done = 0;
+    lzma_ret err = LZMA_OK;
+    while (done < job->need) {
+        pipeline_item_t *pi;
+        queue_pop(r->stream_pool_q, (void**)&pi);
+        io_block_t *ib = (io_block_t*)(pi->data);
+        uint64_t start = trace_now();
+        
+        size_t want = job->need - done;
+        if (want > STREAMSIZE)
+            want = STREAMSIZE;
+        stream->next_out = ib->output;
+        stream->avail_out = want;
+        while (stream->avail_out && err == LZMA_OK) {
+            if (stream->avail_in == 0 && pos < end)
+                stream_input(stream, buf, &pos, end);
+            err = lzma_code(stream, LZMA_RUN);
+        }
+        if (stream->avail_out || (err != LZMA_OK && err != LZMA_STREAM_END))
+            die("Error decoding streaming block");
+        
+        ib->outsize = want;
+        ib->uoffset = job->uoffset + done;
+        ib->btype = done ? BLOCK_CONTINUATION : BLOCK_SIZED;
+        ib->first = false;
+        done += want;
+        if (r->positioned) {
+            trace_span("decode", start, TRACE_NO_SEQ, 0, want);
+            start = trace_now();
+            write_positioned(ib);
+            trace_span("write", start, TRACE_NO_SEQ, 0, want);
+            queue_push(r->stream_pool_q, PIPELINE_ITEM, pi);
+        } else {
+            pi->seq = seq++;
+            trace_span("decode", start, pi->seq, 0, want);
+            queue_push(gEngine->merge_q, PIPELINE_ITEM, pi);
+        }
+    }
+    
+    // Make sure that was really the end, unless we stopped early
+    uint8_t extra;
+    while (err == LZMA_OK && job->need == job->usize) {
+        stream->next_out = &extra;
+        stream->avail_out = 1;
+        if (stream->avail_in == 0 && pos < end)
+            stream_input(stream, buf, &pos, end);
+        err = lzma_code(stream, LZMA_RUN);
+        if (stream->avail_out == 0)
+            die("Error decoding streaming block");
+    }
+    if (err != LZMA_STREAM_END && job->need == job->usize)
+        die("Error decoding streaming block");
+}
+
+
 #pragma mark DECODE
 
+static void pread_block(io_block_t *ib) {
+    size_t done = 0;
+    while (done < ib->insize) {
+        ssize_t rd = pread(fileno(gEngine->in_file), ib->input + done,
+            ib->insize - done, ib->inoffset + done);
+        if (rd == -1 && errno == EINTR)
+            continue;
+        if (rd <= 0)
+            die("Error reading block contents");
+        done += rd;
+    }
+}
+
 static void decode_thread(size_t thnum) {
-    lzma_stream stream = LZMA_STREAM_INIT;
+    engine_t *e = gEngine;
+    lzma_stream *stream = stream_new();
     lzma_filter filters[LZMA_FILTERS_MAX + 1];
     lzma_block block = { .filters = filters, .check = LZMA_CHECK_NONE,
 		.version = 0 };
@@ -567,32 +1292,52 @@ static void decode_thread(size_t thnum) {
     pipeline_item_t *pi;
     io_block_t *ib;
     
-    while (PIPELINE_STOP != queue_pop(gPipelineSplitQ, (void**)&pi)) {
+    while (PIPELINE_STOP != queue_pop(e->split_q, (void**)&pi)) {
         ib = (io_block_t*)(pi->data);
+        uint64_t start = trace_now();
+        if (ib->inoffset != -1)
+            pread_block(ib);
+        uint8_t *input = ib->inmap ? ib->inmap : ib->input;
         
-        block.header_size = lzma_block_header_size_decode(*(ib->input));
+        block.header_size = lzma_block_header_size_decode(*input);
         block.check = ib->check;
-		if (lzma_block_header_decode(&block, NULL, ib->input) != LZMA_OK)
+		if (lzma_block_header_decode(&block, NULL, input) != LZMA_OK)
             die("Error decoding block header");
-        if (lzma_block_decoder(&stream, &block) != LZMA_OK)
+        if (lzma_block_decoder(stream, &block) != LZMA_OK)
             die("Error initializing block decode");
+        for (lzma_filter *f = filters; f->id != LZMA_VLI_UNKNOWN; ++f)
+            free(f->options);
         
-        stream.avail_in = ib->insize - block.header_size;
-        stream.next_in = ib->input + block.header_size;
-        stream.avail_out = ib->outcap;
-        stream.next_out = ib->output;
+        stream->avail_in = ib->insize - block.header_size;
+        stream->next_in = input + block.header_size;
+        stream->avail_out = ib->outneed ? ib->outneed : ib->outcap;
+        stream->next_out = ib->output;
         
+        // Extracting may not need the whole block, then we stop early and
+        // never reach the check at its end
         lzma_ret err = LZMA_OK;
         while (err != LZMA_STREAM_END) {
             if (err != LZMA_OK)
                 die("Error decoding block");
-            err = lzma_code(&stream, LZMA_FINISH);
+            if (ib->outneed && stream->avail_out == 0)
+                break;
+            err = lzma_code(stream, LZMA_FINISH);
         }
         
-        ib->outsize = stream.next_out - ib->output;
-        queue_push(gPipelineMergeQ, PIPELINE_ITEM, pi);
+        ib->outsize = stream->next_out - ib->output;
+        stats_block(ib->insize, ib->outsize);
+        trace_span("decode", start, pi->seq, ib->insize, ib->outsize);
+        if (gRead->positioned) { // straight to its place, recycle the buffers
+            start = trace_now();
+            write_positioned(ib);
+            trace_span("write", start, pi->seq, 0, ib->outsize);
+            queue_push(e->start_q, PIPELINE_ITEM, pi);
+        } else {
+            queue_push(e->merge_q, PIPELINE_ITEM, pi);
+        }
     }
-    lzma_end(&stream);
+    stream_free(stream);
+    stats_thread_end("decode");
 }
 
 
@@ -603,30 +1348,44 @@ static int tar_ok(struct archive *ar, void *ref) {
 }
 
 static bool tar_next_block(void) {
-    if (gArItem && !gArNextItem && gArWanted && gExplicitFiles) {
-        io_block_t *ib = (io_block_t*)(gArItem->data);
-        if (gArWanted->start < ib->uoffset + ib->outsize)
+    struct read_state_t *r = gRead;
+    if (r->ar_item && !r->ar_next_item && r->ar_wanted && r->explicit_files) {
+        io_block_t *ib = (io_block_t*)(r->ar_item->data);
+        if (r->ar_wanted->start < ib->uoffset + ib->outsize)
             return true; // No need
     }
     
-    if (gArLastItem)
-        queue_push(gPipelineStartQ, PIPELINE_ITEM, gArLastItem);
-    gArLastItem = gArItem;
-    gArItem = pipeline_merged();
-    gArNextItem = false;
-    return gArItem;
+    if (r->ar_last_item)
+        block_release(r->ar_last_item);
+    r->ar_last_item = r->ar_item;
+    r->ar_item = pipeline_merged();
+    r->ar_next_item = false;
+    
+    // Chunks of a streamed block can lie wholly before the next wanted file
+    while (r->ar_item && r->ar_wanted && r->explicit_files) {
+        io_block_t *ib = (io_block_t*)(r->ar_item->data);
+        if (r->ar_wanted->start < ib->uoffset + ib->outsize)
+            break;
+        block_release(r->ar_item);
+        r->ar_item = pipeline_merged();
+    }
+    return r->ar_item;
 }
 
 static void tar_write_last(void) {
-    if (gArItem) {
-        io_block_t *ib = (io_block_t*)(gArItem->data);
-        if (fwrite(ib->output + gArLastOffset, gArLastSize, 1, gOutFile) != 1)
+    struct read_state_t *r = gRead;
+    if (r->ar_item) {
+        io_block_t *ib = (io_block_t*)(r->ar_item->data);
+        uint64_t start = trace_now();
+        if (!write_output(ib->output + r->ar_last_offset, r->ar_last_size))
 			die("Can't write previous block");
-        gArLastSize = 0;
+        trace_span("write", start, r->ar_item->seq, 0, r->ar_last_size);
+        r->ar_last_size = 0;
     }
 }
 
 static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp) {
+    struct read_state_t *r = gRead;
     // If we got here, the last bit of archive is ok to write
     tar_write_last();
         
@@ -636,20 +1395,20 @@ static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp) {
     
     off_t off;
     off_t size;
-    io_block_t *ib = (io_block_t*)(gArItem->data);
-    if (gWantedFiles && gExplicitFiles) {
-        debug("tar want: %s", gArWanted->name);
-        off = gArWanted->start - ib->uoffset;
-        size = gArWanted->size;
+    io_block_t *ib = (io_block_t*)(r->ar_item->data);
+    if (r->wanted && r->explicit_files) {
+        debug("tar want: %s", r->ar_wanted->name);
+        off = r->ar_wanted->start - ib->uoffset;
+        size = r->ar_wanted->size;
         if (off < 0) {
             size += off;
             off = 0;
         }
         if (off + size > ib->outsize) {
             size = ib->outsize - off;
-            gArNextItem = true; // force the end of this block
+            r->ar_next_item = true; // force the end of this block
         } else {
-            gArWanted = gArWanted->next;
+            r->ar_wanted = r->ar_wanted->next;
         }
     } else {
         off = 0;
@@ -657,8 +1416,8 @@ static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp) {
     }
     debug("tar off = %llu, size = %zu", (unsigned long long)off, size);
     
-    gArLastOffset = off;
-    gArLastSize = size;
+    r->ar_last_offset = off;
+    r->ar_last_size = size;
     if (bufp)
         *bufp = ib->output + off;
     return size;
@@ -668,16 +1427,18 @@ static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp) {
 #pragma mark UTILS
 
 static bool taste_tar(io_block_t *ib) {
-    struct archive *ar = archive_read_new();
-    prevent_compression(ar);
-    archive_read_support_format_tar(ar);
+    struct archive *ar = tar_reader();
     archive_read_open_memory(ar, ib->output, ib->outsize);
     struct archive_entry *entry;
     bool ok = (archive_read_next_header(ar, &entry) == ARCHIVE_OK);
-	finish_reading(ar);
+	tar_reader_free(ar);
 	return ok;
 }
 
 static bool taste_file_index(io_block_t *ib) {
-	return xle64dec(ib->output) == PIXZ_INDEX_MAGIC;
+	if (ib->outsize < sizeof(uint64_t))
+		return false;
+	uint64_t magic = xle64dec(ib->output);
+	return magic == PIXZ_INDEX_MAGIC || magic == PIXZ_INDEX_V2_MAGIC
+		|| magic == PIXZ_CHUNK_MAGIC;
 }
@@ -0,0 +1,416 @@
+#include "pixz.h"
+
+#include <errno.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#pragma mark TYPES
+
+typedef struct {
+    lzma_vli number;
+    off_t boffset, uoffset;
+    lzma_vli bsize, usize, unpadded;
+    lzma_check check;
+} test_block_t;
+
+// A tar header that spans blocks. Each decoder copies in the part it has, and
+// whoever completes it checks it.
+typedef struct {
+    off_t offset;
+    uint8_t data[512];
+    atomic_size_t filled;
+} split_header_t;
+
+
+#pragma mark STATE
+
+#define TEST_CHUNK (1024 * 1024)
+#define TAR_HEADER 512
+
+// One test's state, in its engine
+struct test_state_t {
+    // Where tar headers start, according to the file index, in archive order
+    off_t *headers;
+    size_t header_count;
+    split_header_t *splits;
+    size_t split_count;
+};
+
+#define gTest (gEngine->test)
+
+
+#pragma mark FUNCTION DECLARATIONS
+
+static void test_streams(void);
+static void test_file_index(void);
+static void find_split_headers(void);
+static void test_state_free(void *state);
+
+static void *test_create(void);
+static void test_free(void *data);
+static void test_read(void);
+static void test_decode(size_t thnum);
+static void test_block(lzma_stream *stream, test_block_t *tb,
+    uint8_t *in, uint8_t *out);
+static size_t test_headers(test_block_t *tb, size_t *cursor, off_t wstart,
+    const uint8_t *buf, size_t size, bool final);
+static void test_split_piece(test_block_t *tb, off_t header, off_t start,
+    const uint8_t *buf, size_t size);
+static bool tar_header_ok(const uint8_t *h);
+static void test_pread(off_t offset, uint8_t *buf, size_t size);
+
+
+#pragma mark MAIN
+
+void pixz_test(bool tar) {
+    if (!(gTest = calloc(1, sizeof(struct test_state_t))))
+        die("Can't allocate memory");
+    engine_defer(&test_state_free, gTest);
+    if (!decode_index())
+        die("Can only test seekable input");
+    test_streams();
+    if (tar && read_file_index()) {
+        test_file_index();
+        free_file_index();
+    }
+
+    // Nothing gets merged, decoders hand their items straight back
+    pipeline_create(test_create, test_free, test_read, test_decode);
+    pipeline_item_t *pi;
+    while (queue_pop(gEngine->merge_q, (void**)&pi) != PIPELINE_STOP)
+        ;
+    pipeline_destroy();
+
+    engine_release(gTest);
+    test_state_free(gTest);
+    lzma_index_end(gEngine->index, NULL);
+    gEngine->index = NULL;
+}
+
+static void test_state_free(void *state) {
+    struct test_state_t *t = state;
+    free(t->headers);
+    free(t->splits);
+    free(t);
+    gTest = NULL;
+}
+
+
+#pragma mark STRUCTURE
+
+// Headers must match footers, and each stream must fill the space up to
+// the next one, with its index just where the footer says
+static void test_streams(void) {
+    engine_t *e = gEngine;
+    uint8_t buf[LZMA_STREAM_HEADER_SIZE];
+    lzma_stream_flags flags;
+    off_t next = 0;
+
+    // The blocks take up everything between the header and the index
+    lzma_vli *blocks = calloc(lzma_index_stream_count(e->index),
+        sizeof(lzma_vli));
+    engine_defer(&free, blocks);
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, e->index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK))
+        blocks[iter.stream.number - 1] += iter.block.total_size;
+
+    lzma_index_iter_rewind(&iter);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_STREAM)) {
+        lzma_vli n = iter.stream.number;
+        off_t start = iter.stream.compressed_offset,
+            end = start + iter.stream.compressed_size;
+        if (start != next)
+            die("Stream %"PRIuMAX" isn't where the last one ends",
+                (uintmax_t)n);
+
+        test_pread(start, buf, sizeof(buf));
+        if (lzma_stream_header_decode(&flags, buf) != LZMA_OK)
+            die("Stream %"PRIuMAX" has a bad header", (uintmax_t)n);
+        if (lzma_stream_flags_compare(&flags, iter.stream.flags) != LZMA_OK)
+            die("Stream %"PRIuMAX" header and footer flags differ",
+                (uintmax_t)n);
+
+        test_pread(end - LZMA_STREAM_HEADER_SIZE, buf, sizeof(buf));
+        if (lzma_stream_footer_decode(&flags, buf) != LZMA_OK
+                || lzma_stream_flags_compare(&flags, iter.stream.flags)
+                    != LZMA_OK)
+            die("Stream %"PRIuMAX" has a bad footer", (uintmax_t)n);
+
+        if (start + 2 * LZMA_STREAM_HEADER_SIZE + blocks[n - 1]
+                + flags.backward_size != (lzma_vli)end)
+            die("Stream %"PRIuMAX" backward size doesn't match its index",
+                (uintmax_t)n);
+        if (iter.stream.padding % 4)
+            die("Stream %"PRIuMAX" padding is misaligned", (uintmax_t)n);
+        next = end + iter.stream.padding;
+    }
+    engine_release(blocks);
+    free(blocks);
+
+    struct stat st;
+    if (fstat(fileno(e->in_file), &st) == 0 && S_ISREG(st.st_mode)
+            && st.st_size != next)
+        die("Streams don't take up the whole file");
+}
+
+// Entries must be in order, before their stream's index, and aligned like tar
+// headers from where the stream starts
+static void test_file_index(void) {
+    engine_t *e = gEngine;
+    struct test_state_t *t = gTest;
+    size_t streams = lzma_index_stream_count(e->index), n = 0;
+    size_t cap = 0;
+    off_t last = -1;
+    for (file_index_t *f = e->file_index; f; f = f->next) {
+        while (n + 1 < streams
+                && (lzma_vli)f->offset >= e->file_index_streams[n + 1].start)
+            ++n;
+        file_index_stream_t *fs = &e->file_index_streams[n];
+        if ((lzma_vli)f->offset > fs->index_start)
+            die("File index entry past the end of the archive: %s",
+                f->name ? f->name : "(end)");
+        if (!f->name)
+            continue;
+        if (f->offset <= last || (f->offset - fs->start) % TAR_HEADER
+                || (lzma_vli)f->offset + TAR_HEADER > fs->index_start)
+            die("File index has a bad offset for %s", f->name);
+        last = f->offset;
+
+        if (t->header_count == cap) {
+            cap = cap ? cap * 2 : 1024;
+            t->headers = realloc(t->headers, cap * sizeof(off_t));
+        }
+        t->headers[t->header_count++] = f->offset;
+    }
+    find_split_headers();
+}
+
+static void find_split_headers(void) {
+    struct test_state_t *t = gTest;
+    size_t h = 0, cap = 0;
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, gEngine->index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        off_t edge = iter.block.uncompressed_file_offset;
+        while (h < t->header_count && t->headers[h] + TAR_HEADER <= edge)
+            ++h;
+        for (size_t i = h; i < t->header_count && t->headers[i] < edge; ++i) {
+            if (t->split_count == cap) {
+                cap = cap ? cap * 2 : 64;
+                t->splits = realloc(t->splits, cap * sizeof(split_header_t));
+            }
+            split_header_t *s = &t->splits[t->split_count++];
+            s->offset = t->headers[i];
+            atomic_init(&s->filled, 0);
+        }
+    }
+}
+
+
+#pragma mark BLOCKS
+
+static void *test_create(void) {
+    return malloc(sizeof(test_block_t));
+}
+
+static void test_free(void *data) {
+    free(data);
+}
+
+static void test_read(void) {
+    lzma_index_iter iter;
+    lzma_index_iter_init(&iter, gEngine->index);
+    while (!lzma_index_iter_next(&iter, LZMA_INDEX_ITER_BLOCK)) {
+        pipeline_item_t *pi;
+        queue_pop(gEngine->start_q, (void**)&pi);
+        test_block_t *tb = (test_block_t*)(pi->data);
+        tb->number = iter.block.number_in_file;
+        tb->boffset = iter.block.compressed_file_offset;
+        tb->uoffset = iter.block.uncompressed_file_offset;
+        tb->bsize = iter.block.total_size;
+        tb->usize = iter.block.uncompressed_size;
+        tb->unpadded = iter.block.unpadded_size;
+        tb->check = iter.stream.flags->check;
+        pipeline_split(pi);
+    }
+    stats_thread_end("read");
+    pipeline_stop();
+}
+
+static void test_decode(size_t thnum) {
+    lzma_stream *stream = stream_new();
+    uint8_t *in = malloc(TEST_CHUNK), *out = malloc(TEST_CHUNK + TAR_HEADER);
+    engine_defer(&free, in);
+    engine_defer(&free, out);
+    if (!in || !out)
+        die("Can't allocate memory");
+    pipeline_item_t *pi;
+    while (queue_pop(gEngine->split_q, (void**)&pi) != PIPELINE_STOP) {
+        test_block_t *tb = (test_block_t*)(pi->data);
+        uint64_t start = trace_now();
+        test_block(stream, tb, in, out);
+        trace_span("decode", start, pi->seq, tb->bsize, tb->usize);
+        queue_push(gEngine->start_q, PIPELINE_ITEM, pi);
+    }
+    stream_free(stream);
+    engine_release(in);
+    engine_release(out);
+    free(in);
+    free(out);
+    stats_thread_end("decode");
+}
+
+// Decode a block a window at a time, keeping just enough to see whole headers
+static void test_block(lzma_stream *stream, test_block_t *tb,
+        uint8_t *in, uint8_t *out) {
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    lzma_block block = { .version = 0, .filters = filters,
+        .check = tb->check };
+    uintmax_t n = tb->number;
+
+    off_t pos = tb->boffset, end = tb->boffset + tb->bsize;
+    size_t size = tb->bsize < TEST_CHUNK ? tb->bsize : TEST_CHUNK;
+    test_pread(pos, in, size);
+    block.header_size = lzma_block_header_size_decode(in[0]);
+    if (in[0] == 0 || block.header_size > size
+            || lzma_block_header_decode(&block, NULL, in) != LZMA_OK)
+        die("Block %ju has a bad header", n);
+    if (lzma_block_compressed_size(&block, tb->unpadded) != LZMA_OK
+            || (block.uncompressed_size != LZMA_VLI_UNKNOWN
+                && block.uncompressed_size != tb->usize))
+        die("Block %ju header and index sizes differ", n);
+    lzma_ret err = lzma_block_decoder(stream, &block);
+    for (lzma_filter *f = filters; f->id != LZMA_VLI_UNKNOWN; ++f)
+        free(f->options);
+    if (err != LZMA_OK)
+        die("Block %ju can't be decoded", n);
+
+    stream->next_in = in + block.header_size;
+    stream->avail_in = size - block.header_size;
+    pos += size;
+
+    size_t cursor = 0, keep = 0;
+    off_t wstart = tb->uoffset;
+    lzma_vli total = 0;
+    while (err == LZMA_OK) {
+        stream->next_out = out + keep;
+        stream->avail_out = TEST_CHUNK;
+        while (stream->avail_out && err == LZMA_OK) {
+            if (stream->avail_in == 0 && pos < end) {
+                size = end - pos < TEST_CHUNK ? end - pos : TEST_CHUNK;
+                test_pread(pos, in, size);
+                stream->next_in = in;
+                stream->avail_in = size;
+                pos += size;
+            }
+            err = lzma_code(stream, pos < end ? LZMA_RUN : LZMA_FINISH);
+        }
+        if (err == LZMA_DATA_ERROR)
+            die("Block %ju is corrupt", n);
+        if (err == LZMA_BUF_ERROR)
+            die("Block %ju is truncated", n);
+        if (err != LZMA_OK && err != LZMA_STREAM_END)
+            die("Block %ju fails its check", n);
+
+        size_t have = stream->next_out - out;
+        total += have - keep;
+        if (total > tb->usize)
+            die("Block %ju is bigger than the index says", n);
+        if (gTest->header_count) {
+            keep = test_headers(tb, &cursor, wstart, out, have,
+                err == LZMA_STREAM_END);
+            memmove(out, out + have - keep, keep);
+            wstart += have - keep;
+        }
+    }
+
+    if (total != tb->usize || lzma_block_unpadded_size(&block) != tb->unpadded
+            || stream->avail_in || pos != end)
+        die("Block %ju and the index differ in size", n);
+    stats_block(tb->bsize, tb->usize);
+}
+
+// Check the headers we can see, and say how much to keep for the next window
+static size_t test_headers(test_block_t *tb, size_t *cursor, off_t wstart,
+        const uint8_t *buf, size_t size, bool final) {
+    off_t ustart = tb->uoffset, wend = wstart + size;
+    size_t i = *cursor;
+    if (wstart == ustart) { // first in the block, find where to start
+        size_t lo = 0, hi = gTest->header_count;
+        while (lo < hi) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (gTest->headers[mid] + TAR_HEADER <= ustart)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        i = lo;
+    }
+
+    size_t keep = 0;
+    for ( ; i < gTest->header_count && gTest->headers[i] < wend; ++i) {
+        off_t h = gTest->headers[i], start = h > wstart ? h : wstart,
+            hend = h + TAR_HEADER;
+        if (hend > wend && !final) {
+            keep = wend - start;
+            break;
+        }
+        if (h >= ustart && hend <= wend) {
+            if (!tar_header_ok(buf + (h - wstart)))
+                die("Bad tar header at offset %jd", (intmax_t)h);
+        } else {
+            size_t len = (hend < wend ? hend : wend) - start;
+            test_split_piece(tb, h, start, buf + (start - wstart), len);
+        }
+    }
+    *cursor = i;
+    return keep;
+}
+
+static void test_split_piece(test_block_t *tb, off_t header, off_t start,
+        const uint8_t *buf, size_t size) {
+    size_t lo = 0, hi = gTest->split_count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (gTest->splits[mid].offset < header)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo == gTest->split_count || gTest->splits[lo].offset != header)
+        die("Bad tar header at offset %jd", (intmax_t)header);
+
+    split_header_t *s = &gTest->splits[lo];
+    memcpy(s->data + (start - header), buf, size);
+    if (atomic_fetch_add(&s->filled, size) + size == TAR_HEADER
+            && !tar_header_ok(s->data))
+        die("Bad tar header at offset %jd", (intmax_t)header);
+}
+
+// The checksum covers the header with its own field as spaces
+static bool tar_header_ok(const uint8_t *h) {
+    uint64_t sum = 0;
+    int64_t ssum = 0;
+    for (size_t i = 0; i < TAR_HEADER; ++i) {
+        uint8_t c = (i >= 148 && i < 156) ? ' ' : h[i];
+        sum += c;
+        ssum += (int8_t)c;
+    }
+    uint64_t want = tar_number(h + 148, 8);
+    return h[0] && (want == sum || want == (uint64_t)ssum);
+}
+
+static void test_pread(off_t offset, uint8_t *buf, size_t size) {
+    size_t done = 0;
+    while (done < size) {
+        ssize_t rd = pread(fileno(gEngine->in_file), buf + done, size - done,
+            offset + done);
+        if (rd == -1 && errno == EINTR)
+            continue;
+        if (rd <= 0)
+            die("Error reading input");
+        done += rd;
+    }
+}
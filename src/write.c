@@ -1,74 +1,166 @@
 #include "pixz.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include <archive.h>
 #include <archive_entry.h>
 
 
 #pragma mark TYPES
 
+// One input to compress into one output. Paths are opened when needed, so
+// a big batch doesn't run out of descriptors.
+typedef struct write_job_t write_job_t;
+struct write_job_t {
+    write_job_t *next;
+    const char *ipath, *opath;
+    FILE *in, *out;
+    
+    // Filled in by the reader once it's done with the input
+    bool tar;
+    file_index_t *files;
+    file_arena_t *arena;
+    
+    // When appending, a new stream goes after the archive's last one
+    bool append;
+    uint8_t head[512]; // first header of the input, read early to check it
+    size_t head_size;
+};
+
 typedef struct io_block_t io_block_t;
 struct io_block_t {
     lzma_block block;
     uint8_t *input, *output;
     size_t insize, outsize;
+    write_job_t *job;
 };
 
 
-#pragma mark GLOBALS
+#pragma mark STATE
 
 #define LZMA_CHUNK_MAX (1 << 16)
 
-double gBlockFraction = 2.0;
+#define BLOCK_FRACTION_DEFAULT 2.0
+#define AUTO_BLOCKS_PER_THREAD 4
+#define AUTO_BLOCK_SIZE_MIN (1024 * 1024) // smaller hurts the ratio too much
 
-static bool gTar = true;
+// With a target rate, each block is encoded at the current level, anywhere
+// from 0 to the one asked for. All levels share the dictionary size, so
+// memory use and decoding don't change.
+#define LEVEL_COUNT 10
 
-static size_t gBlockInSize = 0, gBlockOutSize = 0;
+// One write's state, in its engine
+struct write_state_t {
+    bool tar, tar_wanted;
+    
+    // Jobs share one pipeline, so blocks of consecutive files overlap
+    write_job_t *jobs;
+    write_job_t *read_job;
+    
+    size_t block_in_size, block_out_size;
+    
+    // Room past block_in_size, for the start of an entry carried over from
+    // the previous block so that block can end on an entry boundary
+    size_t block_slack;
+    
+    off_t multi_header_start;
+    bool multi_header;
+    off_t total_read;
+    
+    pipeline_item_t *read_item;
+    io_block_t *read_block;
+    size_t read_item_count;
+    
+    // Seekable non-tar input is split by block number, each encoder reads
+    // its own
+    bool sharded;
+    off_t shard_start, shard_end;
+    
+    // Filled blocks, from the read-ahead thread to the tar parser
+    queue_t *read_ahead_q;
+    pool_job_t *read_ahead_job;
+    bool read_ahead_done;
+    
+    lzma_options_lzma opts;
+    lzma_filter filters[LZMA_FILTERS_MAX + 1];
+    
+    lzma_options_lzma level_opts[LEVEL_COUNT];
+    lzma_filter level_filters[LEVEL_COUNT][2];
+    int level_max;
+    atomic_int level;
+    
+    uint8_t fi_buf[CHUNKSIZE];
+    size_t fi_buf_pos;
+};
 
-static off_t gMultiHeaderStart = 0;
-static bool gMultiHeader = false;
-static off_t gTotalRead = 0;
+#define gWrite (gEngine->write)
 
-static pipeline_item_t *gReadItem = NULL;
-static io_block_t *gReadBlock = NULL;
-static size_t gReadItemCount = 0;
+// Where the archive ended before appending, to cut it back to if we fail.
+// Only the command appends, and its signal handlers need these.
+static int gAppendFD = -1;
+static off_t gAppendSize = 0;
 
-static lzma_filter gFilters[LZMA_FILTERS_MAX + 1];
 
-static uint8_t gFileIndexBuf[CHUNKSIZE];
-static size_t gFileIndexBufPos = 0;
+#pragma mark FUNCTION DECLARATIONS
 
+static void auto_block_size(lzma_options_lzma *opts);
+static void size_blocks(void);
+static void fit_memory(lzma_options_lzma *opts);
 
-#pragma mark FUNCTION DECLARATIONS
+static write_job_t *write_state_new(size_t count);
+static void write_state_free(void *state);
+static void write_jobs(bool tar, uint32_t level);
+static void start_job(write_job_t *job);
+static void finish_job(write_job_t *job);
 
 static void read_thread();
+static void read_job(write_job_t *job);
+static void read_ahead_thread(void *ignore);
+static void read_block_done(pipeline_item_t *pi);
+static size_t entry_cut(io_block_t *ib);
+static void read_thread_sharded(void);
+static pipeline_item_t *read_shard(void);
+
+static void append_setup(write_job_t *job);
+static void append_head(write_job_t *job);
+static void append_undo(void);
+static void append_signal(int sig);
 
 static void encode_thread(size_t thnum);
 static void encode_uncompressible(io_block_t *ib);
+static bool looks_uncompressible(io_block_t *ib);
 static size_t size_uncompressible(size_t insize);
 
 static void *block_create();
 static void block_free(void *data);
 
-typedef enum {
-	BLOCK_IN = 1,
-	BLOCK_OUT = 2,
-	BLOCK_ALL = BLOCK_IN | BLOCK_OUT,
-} block_parts;
-static void block_alloc(io_block_t *ib, block_parts parts);
-static void block_dealloc(io_block_t *ib, block_parts parts);
-
 static void add_file(off_t offset, const char *name);
 
 static archive_read_callback tar_read;
 static archive_open_callback tar_ok;
 static archive_close_callback tar_ok;
 
-static void block_init(lzma_block *block, size_t insize);
+static void adapt_setup(uint32_t preset, lzma_options_lzma *opts);
+static void adapt_level(int level, size_t insize, double secs);
+
+static void block_init(lzma_block *block, size_t insize, lzma_filter *filters);
 static void stream_edge(lzma_vli backward_size);
 static void write_block(pipeline_item_t *pi);
 static void encode_index(void);
 
-static void write_file_index(void);
+static void write_file_index(file_index_t *files);
+static void write_file_index_v2(file_index_t *files);
+static int file_name_cmp(const void *a, const void *b);
+static void file_index_block_start(lzma_block *block);
+static void file_index_block_finish(lzma_block *block);
+static void write_file_index_varint(uint64_t n);
 static void write_file_index_bytes(size_t size, uint8_t *buf);
 static void write_file_index_buf(lzma_action action);
 
@@ -76,55 +168,217 @@ static void write_file_index_buf(lzma_action action);
 #pragma mark FUNCTION DEFINITIONS
 
 void pixz_write(bool tar, uint32_t level) {
-    gTar = tar;
+    write_job_t *job = write_state_new(1);
+    job->in = gEngine->in_file;
+    job->out = gEngine->out_file;
+    write_jobs(tar, level);
+}
+
+void pixz_write_batch(bool tar, uint32_t level, size_t count,
+        char **ipaths, char **opaths) {
+    write_job_t *jobs = write_state_new(count);
+    for (size_t i = 0; i < count; ++i) {
+        jobs[i].ipath = ipaths[i];
+        jobs[i].opath = opaths[i];
+    }
+    write_jobs(tar, level);
+}
+
+static write_job_t *write_state_new(size_t count) {
+    struct write_state_t *w = calloc(1, sizeof(struct write_state_t));
+    write_job_t *jobs = count ? calloc(count, sizeof(write_job_t)) : NULL;
+    if (!w || (count && !jobs))
+        die("Can't allocate memory");
+    for (size_t i = 0; i + 1 < count; ++i)
+        jobs[i].next = &jobs[i + 1];
+    w->jobs = jobs;
+    engine_defer(&write_state_free, w);
+    gWrite = w;
+    return w->jobs;
+}
+
+// File lists not yet written go too. Only the command opens files for jobs,
+// and it can't fail without exiting.
+static void write_state_free(void *state) {
+    struct write_state_t *w = state;
+    for (write_job_t *job = w->jobs; job; job = job->next)
+        file_arena_free(job->arena);
+    free(w->jobs);
+    free(w);
+    gWrite = NULL;
+}
+
+static void write_jobs(bool tar, uint32_t level) {
+    engine_t *e = gEngine;
+    struct write_state_t *w = gWrite;
+    w->tar_wanted = w->tar = tar;
+    bool single = w->jobs && !w->jobs->next && w->jobs->in;
     
     // xz options
-    lzma_options_lzma lzma_opts;
-    if (lzma_lzma_preset(&lzma_opts, level))
+    if (lzma_lzma_preset(&w->opts, level))
         die("Error setting lzma options");
-    gFilters[0] = (lzma_filter){ .id = LZMA_FILTER_LZMA2,
-            .options = &lzma_opts };
-    gFilters[1] = (lzma_filter){ .id = LZMA_VLI_UNKNOWN, .options = NULL };
+    w->filters[0] = (lzma_filter){ .id = LZMA_FILTER_LZMA2,
+            .options = &w->opts };
+    w->filters[1] = (lzma_filter){ .id = LZMA_VLI_UNKNOWN, .options = NULL };
     
-    gBlockInSize = lzma_opts.dict_size * gBlockFraction;
-    if (gBlockInSize <= 0)
+    w->block_in_size = w->opts.dict_size * (e->block_fraction
+        ? e->block_fraction : BLOCK_FRACTION_DEFAULT);
+    if (w->block_in_size <= 0)
         die("Block size must be positive");
-    gBlockOutSize = lzma_block_buffer_bound(gBlockInSize);
+    if (!e->block_fraction && single)
+        auto_block_size(&w->opts);
+    size_blocks();
+    fit_memory(&w->opts);
+    w->level_max = level & LZMA_PRESET_LEVEL_MASK;
+    if (e->target_rate)
+        adapt_setup(level, &w->opts);
+    gStatsBlockSize = w->block_in_size;
     
-    pipeline_create(block_create, block_free, read_thread, encode_thread);
+    struct stat st;
+    w->sharded = false;
+    if (single && !w->tar && fstat(fileno(e->in_file), &st) == 0
+            && S_ISREG(st.st_mode)) {
+        w->shard_start = lseek(fileno(e->in_file), 0, SEEK_CUR);
+        w->shard_end = st.st_size;
+        w->sharded = (w->shard_start != -1);
+    }
+    
+    pipeline_create(block_create, block_free,
+        w->sharded ? read_thread_sharded : read_thread, encode_thread);
     debug("writer: start");
     
+    // Blocks arrive in job order, a block from a later job ends this one.
+    // Once the pipeline runs dry, any jobs left are empty files.
+    pipeline_item_t *pi = NULL;
+    bool stopped = false;
+    for (write_job_t *job = w->jobs; job; job = job->next) {
+        start_job(job);
+        while (pi || (!stopped && (pi = pipeline_merged()))) {
+            if (((io_block_t*)(pi->data))->job != job)
+                break;
+            debug("writer: received %zu", pi->seq);
+            write_block(pi);
+            queue_push(e->start_q, PIPELINE_ITEM, pi);
+            pi = NULL;
+        }
+        stopped = !pi;
+        finish_job(job);
+    }
+    
+    debug("writer: cleaning up reader");
+    pipeline_destroy();
+    engine_release(w);
+    write_state_free(w);
+    
+    debug("exit");
+}
+
+static void start_job(write_job_t *job) {
+    if (!job->out)
+        job->out = open_output(job->ipath, job->opath);
+    gEngine->out_file = job->out;
+    
     // pre-block setup: header, index
-    if (!(gIndex = lzma_index_init(NULL)))
+    if (!(gEngine->index = lzma_index_init(NULL)))
         die("Error creating index");
     stream_edge(LZMA_VLI_UNKNOWN);
-    
-    // write blocks
-    while (true) {
-        pipeline_item_t *pi = pipeline_merged();
-        if (!pi)
-            break;
-        
-        debug("writer: received %zu", pi->seq);
-        write_block(pi);
-        queue_push(gPipelineStartQ, PIPELINE_ITEM, pi);
-    }
-    
+}
+
+static void finish_job(write_job_t *job) {
+    engine_t *e = gEngine;
     // file index
-    if (gTar)
-        write_file_index();
-    free_file_index();
+    if (job->tar)
+        write_file_index(job->files);
+    file_arena_free(job->arena);
+    job->files = NULL;
+    job->arena = NULL;
     
     // post-block cleanup: index, footer
     encode_index();
-    stream_edge(lzma_index_size(gIndex));
-    lzma_index_end(gIndex, NULL);
-    fclose(gOutFile);
+    stream_edge(lzma_index_size(e->index));
+    lzma_index_end(e->index, NULL);
+    e->index = NULL;
+    if (job->append)
+        gAppendFD = -1; // it's all there, nothing to undo
+    close_file(e->out_file);
+    e->out_file = NULL;
+}
+
+
+#pragma mark MEMORY
+
+#define BLOCK_SIZE_MIN (256 * 1024)
+
+// Small files wouldn't make enough blocks to keep every thread busy, so use
+// smaller blocks when we know how much input there is
+static void auto_block_size(lzma_options_lzma *opts) {
+    struct write_state_t *w = gWrite;
+    struct stat st;
+    off_t pos;
+    if (fstat(fileno(gEngine->in_file), &st) != 0 || !S_ISREG(st.st_mode)
+            || (pos = lseek(fileno(gEngine->in_file), 0, SEEK_CUR)) == -1)
+        return;
     
-    debug("writer: cleaning up reader");
-    pipeline_destroy();
+    uint64_t want = (uint64_t)(st.st_size - pos)
+        / (pipeline_threads() * AUTO_BLOCKS_PER_THREAD);
+    if (want < AUTO_BLOCK_SIZE_MIN)
+        want = AUTO_BLOCK_SIZE_MIN;
+    if (want >= w->block_in_size)
+        return;
     
-    debug("exit");
+    w->block_in_size = want;
+    if (opts->dict_size > w->block_in_size) // the rest would be wasted
+        opts->dict_size = w->block_in_size;
+    debug("auto block size: %zu", w->block_in_size);
+}
+
+static void size_blocks(void) {
+    struct write_state_t *w = gWrite;
+    w->block_slack = w->tar ? w->block_in_size * gEngine->entry_align : 0;
+    w->block_out_size = lzma_block_buffer_bound(w->block_in_size
+        + w->block_slack);
+}
+
+static bool fit_memory_with(size_t min_threads) {
+    struct write_state_t *w = gWrite;
+    uint64_t encoder = lzma_raw_encoder_memusage(w->filters);
+    if (encoder == UINT64_MAX)
+        die("Error estimating encoder memory usage");
+    size_blocks();
+    return pipeline_fit(0, encoder,
+        w->block_in_size + w->block_slack + w->block_out_size,
+        min_threads);
+}
+
+// Scale the pipeline down until it fits in the memory limit. Prefer, in order:
+// a shorter queue, blocks no bigger than the dictionary, fewer threads, and
+// finally a smaller dictionary.
+static void fit_memory(lzma_options_lzma *opts) {
+    engine_t *e = gEngine;
+    struct write_state_t *w = gWrite;
+    if (!e->mem_limit)
+        return;
+    
+    size_t threads = pipeline_threads();
+    while (!fit_memory_with(threads)) {
+        if (w->block_in_size / 2 < opts->dict_size)
+            break;
+        w->block_in_size /= 2;
+    }
+    if (fit_memory_with(1))
+        return;
+    
+    while (!fit_memory_with(1)) {
+        if (w->block_in_size / 2 < BLOCK_SIZE_MIN) {
+            warn("Warning: can't fit in memory limit, using minimum settings");
+            e->process_max = 1;
+            e->qsize = 2;
+            return;
+        }
+        w->block_in_size /= 2;
+        if (opts->dict_size > w->block_in_size) // the rest would be wasted
+            opts->dict_size = w->block_in_size;
+    }
 }
 
 
@@ -132,11 +386,33 @@ void pixz_write(bool tar, uint32_t level) {
 
 static void read_thread() {
     debug("reader: start");
+    for (write_job_t *job = gWrite->jobs; job; job = job->next)
+        read_job(job);
+    
+    // stop the other threads
+    debug("reader: cleaning up encoders");
+    stats_thread_end("read");
+    pipeline_stop();
+    debug("reader: end");
+}
+
+static void read_job(write_job_t *job) {
+    engine_t *e = gEngine;
+    struct write_state_t *w = gWrite;
+    if (!job->in && !(job->in = fopen(job->ipath, "r")))
+        die("can not open input file: %s: %s", job->ipath, strerror(errno));
+    e->in_file = job->in;
+    w->read_job = job;
+    w->tar = w->tar_wanted;
+    w->total_read = 0;
+    w->multi_header = false;
+    w->read_ahead_done = false;
     
-    if (gTar) {
-		struct archive *ar = archive_read_new();
-	    prevent_compression(ar);
-	    archive_read_support_format_tar(ar);
+    w->read_ahead_q = queue_new(e->item_count + 1, NULL);
+    w->read_ahead_job = pool_run(gEngine, &read_ahead_thread, NULL);
+    
+    if (w->tar) {
+		struct archive *ar = tar_reader();
 	    archive_read_support_format_raw(ar);
 	    archive_read_open(ar, NULL, tar_ok, tar_read, tar_ok);
 	    struct archive_entry *entry;
@@ -146,76 +422,221 @@ static void read_thread() {
 	            break;
 	        } else if (aerr != ARCHIVE_OK && aerr != ARCHIVE_WARN) {
 	            // Some charset translations warn spuriously
-	            fprintf(stderr, "%s\n", archive_error_string(ar));
-	            die("Error reading archive entry");
+	            die("Error reading archive entry: %s",
+	                archive_error_string(ar));
 	        }
         
 	        if (archive_format(ar) == ARCHIVE_FORMAT_RAW) {
-	            gTar = false;
+	            w->tar = false;
 				break;
 			}
             add_file(archive_read_header_position(ar),
                 archive_entry_pathname(entry));
 	    }
 		if (archive_read_header_position(ar) == 0)
-			gTar = false; // probably spuriously identified as tar
-    	finish_reading(ar);
-	}
-	if (!feof(gInFile)) {
-		const void *dummy;
-		while (tar_read(NULL, NULL, &dummy) != 0)
-			; // just keep pumping
+			w->tar = false; // probably spuriously identified as tar
+    	tar_reader_free(ar);
 	}
-    fclose(gInFile);
+	if (job->append && !w->tar)
+		die("Can only append a tarball");
+	const void *dummy;
+	while (tar_read(NULL, NULL, &dummy) != 0)
+		; // just keep pumping
     
-	if (gTar)
-        add_file(gTotalRead, NULL);
+    pool_join(w->read_ahead_job);
+    queue_free(w->read_ahead_q);
+    close_file(e->in_file);
+    e->in_file = NULL;
     
-    // write last block, if necessary
-    if (gReadItem) {
-        // if this block had only one read, and it was EOF, it's waste
-        debug("reader: handling last block %zu", gReadItemCount);
-        if (gReadBlock->insize)
-            pipeline_split(gReadItem);
-        else
-            queue_push(gPipelineStartQ, PIPELINE_ITEM, gReadItem);
-        gReadItem = NULL;
-    }
+	if (w->tar)
+        add_file(w->total_read, NULL);
     
-    // stop the other threads
-    debug("reader: cleaning up encoders");
+    // Hand the file list to the writer, which only looks once it's moved on
+    job->tar = w->tar;
+    job->files = e->file_index;
+    job->arena = e->file_arena;
+    e->file_index = e->last_file = NULL;
+    e->file_arena = NULL;
+}
+
+// Fill whole blocks with big reads, so slow input or header parsing don't
+// stall each other
+static void read_ahead_thread(void *ignore) {
+    engine_t *e = gEngine;
+    struct write_state_t *w = gWrite;
+    int fd = fileno(e->in_file);
+    struct stat st;
+    bool file = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    size_t head = w->read_job->head_size; // already read, goes first
+    off_t pos = file ? lseek(fd, 0, SEEK_CUR) - head : 0;
+#ifdef POSIX_FADV_SEQUENTIAL
+    if (file)
+        posix_fadvise(fd, pos, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    
+    // For streaming, a block can end early so its data isn't held up
+    size_t limit = w->block_in_size;
+    if (e->flush_size && e->flush_size < limit)
+        limit = e->flush_size;
+    
+    bool eof = false;
+    while (!eof) {
+        pipeline_item_t *pi;
+        queue_pop(e->start_q, (void**)&pi);
+        io_block_t *ib = (io_block_t*)(pi->data);
+        debug("read-ahead: reading %zu", w->read_item_count);
+        uint64_t start = trace_now();
+        
+        ib->insize = 0;
+        if (head) {
+            memcpy(ib->input, w->read_job->head, head);
+            ib->insize = head;
+            head = 0;
+        }
+        while (ib->insize < limit) {
+            if (e->flush_idle && ib->insize && fd != -1) {
+                struct pollfd pfd = { .fd = fd, .events = POLLIN };
+                int ready = poll(&pfd, 1, e->flush_idle);
+                if (ready == -1 && errno == EINTR)
+                    continue;
+                if (ready == 0)
+                    break; // input went quiet, send what we have
+            }
+            ssize_t rd = read_input(ib->input + ib->insize,
+                limit - ib->insize);
+            if (rd == -1 && errno == EINTR)
+                continue;
+            if (rd == -1)
+                die("Error reading input file: %s", strerror(errno));
+            if (rd == 0) {
+                eof = true;
+                break;
+            }
+            ib->insize += rd;
+        }
+        pos += ib->insize;
+#ifdef POSIX_FADV_WILLNEED
+        if (file && !eof) // get the kernel started on the next block
+            posix_fadvise(fd, pos, limit, POSIX_FADV_WILLNEED);
+#endif
+        // tar parsing cuts blocks anew, so these don't have a seq yet
+        trace_span("read", start, TRACE_NO_SEQ, ib->insize, 0);
+        queue_push(w->read_ahead_q, PIPELINE_ITEM, pi);
+    }
+    queue_push(w->read_ahead_q, PIPELINE_STOP, NULL);
+    stats_thread_end("read-ahead");
+}
+
+// If an entry starts near the end of this block, where to cut it so that
+// the entry moves to the next block. Zero to keep the block whole.
+static size_t entry_cut(io_block_t *ib) {
+    struct write_state_t *w = gWrite;
+    if (!w->block_slack || !gEngine->last_file)
+        return 0;
+    off_t start = w->total_read - ib->insize;
+    off_t entry = w->multi_header ? w->multi_header_start
+        : gEngine->last_file->offset;
+    if (entry <= start || entry >= w->total_read
+            || w->total_read - entry > w->block_slack)
+        return 0;
+    return entry - start;
+}
+
+static void read_block_done(pipeline_item_t *pi) {
+    struct write_state_t *w = gWrite;
+    io_block_t *ib = (io_block_t*)(pi->data);
+    ib->job = w->read_job;
+    // if the block only saw EOF, it's waste
+    if (ib->insize) {
+        debug("reader: sending %zu", w->read_item_count);
+        pipeline_split(pi);
+        ++w->read_item_count;
+    } else {
+        queue_push(gEngine->start_q, PIPELINE_ITEM, pi);
+    }
+}
+
+static void read_thread_sharded(void) {
+    // Encoders do the reading, just wait for them to run out of input
     pipeline_stop();
-    debug("reader: end");
+    close_file(gEngine->in_file);
+    gEngine->in_file = NULL;
+}
+
+// Claim the next block of the input, and read it in
+static pipeline_item_t *read_shard(void) {
+    engine_t *e = gEngine;
+    struct write_state_t *w = gWrite;
+    pipeline_item_t *pi;
+    queue_pop(e->start_q, (void**)&pi);
+    uint64_t start = trace_now();
+    pipeline_claim(pi);
+    
+    off_t pos = w->shard_start + (off_t)pi->seq * w->block_in_size;
+    if (pos >= w->shard_end) {
+        queue_push(e->start_q, PIPELINE_ITEM, pi);
+        return NULL;
+    }
+    io_block_t *ib = (io_block_t*)(pi->data);
+    ib->job = w->jobs;
+    size_t size = w->block_in_size;
+    if (w->shard_end - pos < size)
+        size = w->shard_end - pos;
+    
+    ib->insize = 0;
+    while (ib->insize < size) {
+        ssize_t rd = pread(fileno(e->in_file), ib->input + ib->insize,
+            size - ib->insize, pos + ib->insize);
+        if (rd == -1 && errno == EINTR)
+            continue;
+        if (rd == -1)
+            die("Error reading input file: %s", strerror(errno));
+        if (rd == 0)
+            die("Input file shrank while reading");
+        ib->insize += rd;
+    }
+    trace_span("read", start, pi->seq, ib->insize, 0);
+    return pi;
 }
 
 static ssize_t tar_read(struct archive *ar, void *ref, const void **bufp) {
-    if (!gReadItem) {
-        queue_pop(gPipelineStartQ, (void**)&gReadItem);
-        gReadBlock = (io_block_t*)(gReadItem->data);
-        block_alloc(gReadBlock, BLOCK_IN);
-        gReadBlock->insize = 0;
-        debug("reader: reading %zu", gReadItemCount);
+    struct write_state_t *w = gWrite;
+    // libarchive is done with the previous block once it asks for more
+    pipeline_item_t *prev = w->read_item;
+    io_block_t *prevb = w->read_block;
+    w->read_item = NULL;
+    w->read_block = NULL;
+    if (prev && !w->block_slack) { // nothing to carry, don't wait for more
+        read_block_done(prev);
+        prev = NULL;
+    }
+    
+    if (w->read_ahead_done
+            || queue_pop(w->read_ahead_q, (void**)&w->read_item)
+                == PIPELINE_STOP) {
+        w->read_ahead_done = true;
+        if (prev)
+            read_block_done(prev);
+        return 0;
     }
+    w->read_block = (io_block_t*)(w->read_item->data);
+    size_t size = w->read_block->insize, carry = 0;
     
-    size_t space = gBlockInSize - gReadBlock->insize;
-    if (space > CHUNKSIZE)
-        space = CHUNKSIZE;    
-    uint8_t *buf = gReadBlock->input + gReadBlock->insize;
-    size_t rd = fread(buf, 1, space, gInFile);
-    if (ferror(gInFile))
-        die("Error reading input file");
-    gReadBlock->insize += rd;
-    gTotalRead += rd;
-    *bufp = buf;
-    
-    if (gReadBlock->insize == gBlockInSize) {
-        debug("reader: sending %zu", gReadItemCount);
-        pipeline_split(gReadItem);
-        ++gReadItemCount;
-        gReadItem = NULL;
+    // Move an entry that starts late in the previous block into this one
+    size_t cut = prev ? entry_cut(prevb) : 0;
+    if (cut && size) {
+        carry = prevb->insize - cut;
+        memmove(w->read_block->input + carry, w->read_block->input, size);
+        memcpy(w->read_block->input, prevb->input + cut, carry);
+        prevb->insize = cut;
+        w->read_block->insize += carry;
     }
+    if (prev)
+        read_block_done(prev);
     
-    return rd;
+    w->total_read += size;
+    *bufp = w->read_block->input + carry;
+    return size;
 }
 
 static int tar_ok(struct archive *ar, void *ref) {
@@ -223,58 +644,117 @@ static int tar_ok(struct archive *ar, void *ref) {
 }
 
 static void add_file(off_t offset, const char *name) {
+    struct write_state_t *w = gWrite;
     if (name && is_multi_header(name)) {
-        if (!gMultiHeader)
-            gMultiHeaderStart = offset;
-        gMultiHeader = true;
+        if (!w->multi_header)
+            w->multi_header_start = offset;
+        w->multi_header = true;
         return;
     }
     
-    file_index_t *f = malloc(sizeof(file_index_t));
-    f->offset = gMultiHeader ? gMultiHeaderStart : offset;
-    gMultiHeader = false;
-    f->name = name ? xstrdup(name) : NULL;
-    f->next = NULL;
-    
-    if (gLastFile) {
-        gLastFile->next = f;
-    } else { // new index
-        gFileIndex = f;
-    }
-    gLastFile = f;
+    file_index_append(w->multi_header ? w->multi_header_start : offset, name);
+    w->multi_header = false;
 }
 
 static void block_free(void *data) {
+    struct write_state_t *w = gWrite;
     io_block_t *ib = (io_block_t*)data;
-    free(ib->input);
-    free(ib->output);
+    buffer_free(ib->input, w->block_in_size + w->block_slack);
+    buffer_free(ib->output, w->block_out_size);
     free(ib);
 }
 
+// Buffers live as long as the pipeline, so we only fault them in once
 static void *block_create() {
+    struct write_state_t *w = gWrite;
     io_block_t *ib = malloc(sizeof(io_block_t));
-    ib->input = ib->output = NULL;
+    ib->input = buffer_alloc(w->block_in_size + w->block_slack);
+    ib->output = buffer_alloc(w->block_out_size);
     return ib;
 }
 
-static void block_alloc(io_block_t *ib, block_parts parts) {
-    if ((parts & BLOCK_IN) && !ib->input)
-        ib->input = malloc(gBlockInSize);
-    if ((parts & BLOCK_IN) && !ib->output)
-        ib->output = malloc(gBlockOutSize);
-    if (!ib->input || !ib->output)
-        die("Can't allocate blocks");
+
+#pragma mark APPEND
+
+// The new files get a stream of their own after the archive's last one, with
+// its own file index, so the archive's data is never touched. Readers merge
+// the indices, and skip the end-of-archive zeros where one tarball meets the
+// next.
+void pixz_append(uint32_t level, const char *apath) {
+    write_job_t *job = write_state_new(1);
+    job->in = gEngine->in_file;
+    job->append = true;
+    if (!(job->out = fopen(apath, "r+")))
+        die("can not open archive: %s: %s", apath, strerror(errno));
+    append_setup(job);
+    write_jobs(true, level);
 }
 
-static void block_dealloc(io_block_t *ib, block_parts parts) {
-    if (parts & BLOCK_IN) {
-		free(ib->input);
-		ib->input = NULL;
-	}
-    if (parts & BLOCK_OUT) {
-		free(ib->output);
-		ib->output = NULL;
-	}
+static void append_setup(write_job_t *job) {
+    engine_t *e = gEngine;
+    append_head(job);
+    FILE *in = e->in_file;
+    e->in_file = job->out;
+    if (!decode_index())
+        die("Can't read the archive's index");
+    if (!read_file_index())
+        die("Can only append to a tarball with a file index");
+    if (!e->index_format)
+        e->index_format = e->file_index_version;
+    free_file_index();
+    lzma_index_end(e->index, NULL);
+    e->index = NULL;
+    e->in_file = in;
+    
+    // From here on, failing must leave the archive as it was
+    int fd = fileno(job->out);
+    if ((gAppendSize = lseek(fd, 0, SEEK_END)) == -1)
+        die("Can't seek in archive: %s", strerror(errno));
+    gAppendFD = fd;
+    atexit(append_undo);
+    struct sigaction sa = { .sa_handler = append_signal };
+    sigemptyset(&sa.sa_mask);
+    int sigs[] = { SIGINT, SIGTERM, SIGHUP, SIGPIPE };
+    for (size_t i = 0; i < sizeof(sigs) / sizeof(*sigs); ++i)
+        sigaction(sigs[i], &sa, NULL);
+    debug("append: at %jd", (intmax_t)gAppendSize);
+}
+
+// Check the input starts with a tar header, before touching the archive
+static void append_head(write_job_t *job) {
+    while (job->head_size < sizeof(job->head)) {
+        ssize_t rd = read_input(job->head + job->head_size,
+            sizeof(job->head) - job->head_size);
+        if (rd == -1 && errno == EINTR)
+            continue;
+        if (rd == -1)
+            die("Error reading input file: %s", strerror(errno));
+        if (rd == 0)
+            break;
+        job->head_size += rd;
+    }
+    
+    uint64_t sum = 0;
+    for (size_t i = 0; i < job->head_size; ++i)
+        sum += (i >= 148 && i < 156) ? ' ' : job->head[i];
+    if (job->head_size < sizeof(job->head)
+            || sum != tar_number(job->head + 148, 8))
+        die("Can only append a tarball");
+}
+
+// Cut off a partly written stream, when we die before it's done
+static void append_undo(void) {
+    if (gAppendFD != -1 && ftruncate(gAppendFD, gAppendSize) != 0)
+        fprintf(stderr, "Can't restore the archive: %s\n", strerror(errno));
+}
+
+// Killed, not dying: undo what we can and go the way the signal meant
+static void append_signal(int sig) {
+    if (gAppendFD != -1 && ftruncate(gAppendFD, gAppendSize) != 0) {
+        // nothing safe to do about it here
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
 }
 
 
@@ -291,6 +771,36 @@ static size_t size_uncompressible(size_t insize) {
     return data_size;
 }
 
+// Byte entropy of the whole block. Costs a tiny fraction of an LZMA pass, and
+// lets us skip that pass entirely on already-compressed data. It can't see
+// repeated content, like the same JPEG twice in one block.
+static bool looks_uncompressible(io_block_t *ib) {
+    if (!gEngine->store_entropy || ib->insize < 4096)
+        return false;
+    
+    // Several tables, so repeated bytes don't serialize on one counter
+    size_t counts[4][256] = { { 0 } };
+    size_t i = 0;
+    for ( ; i + 4 <= ib->insize; i += 4) {
+        ++counts[0][ib->input[i]];
+        ++counts[1][ib->input[i + 1]];
+        ++counts[2][ib->input[i + 2]];
+        ++counts[3][ib->input[i + 3]];
+    }
+    for ( ; i < ib->insize; ++i)
+        ++counts[0][ib->input[i]];
+    
+    double bits = 0;
+    for (int c = 0; c < 256; ++c) {
+        size_t n = counts[0][c] + counts[1][c] + counts[2][c] + counts[3][c];
+        if (n) {
+            double p = (double)n / ib->insize;
+            bits -= p * log2(p);
+        }
+    }
+    return bits >= gEngine->store_entropy;
+}
+
 static void encode_uncompressible(io_block_t *ib) {
     // See http://en.wikipedia.org/wiki/Lzma#LZMA2_format
     const uint8_t control_uncomp = 1;
@@ -342,64 +852,128 @@ static void encode_uncompressible(io_block_t *ib) {
 }
 
 static void encode_thread(size_t thnum) {
-    lzma_stream stream = LZMA_STREAM_INIT;    
+    engine_t *e = gEngine;
+    struct write_state_t *w = gWrite;
+    lzma_stream *stream = stream_new();
     while (true) {
         pipeline_item_t *pi;
-        int msg = queue_pop(gPipelineSplitQ, (void**)&pi);
-        if (msg == PIPELINE_STOP)
+        if (w->sharded) {
+            if (!(pi = read_shard()))
+                break;
+        } else if (queue_pop(e->split_q, (void**)&pi) == PIPELINE_STOP) {
             break;
+        }
         
         debug("encoder %zu: received %zu", thnum, pi->seq);
         io_block_t *ib = (io_block_t*)(pi->data);
+        uint64_t start = trace_now();
         
-		block_alloc(ib, BLOCK_OUT);
-        block_init(&ib->block, ib->insize);
+        int level = w->level_max;
+        if (e->target_rate)
+            level = atomic_load(&w->level);
+        block_init(&ib->block, ib->insize,
+            e->target_rate ? w->level_filters[level] : w->filters);
         size_t header_size = ib->block.header_size;
         size_t uncompressible_size = size_uncompressible(ib->insize) +
             lzma_check_size(ib->block.check);
-		        
-        if (lzma_block_encoder(&stream, &ib->block) != LZMA_OK)
-            die("Error creating block encoder");
-        stream.next_in = ib->input;
-        stream.avail_in = ib->insize;
-        stream.next_out = ib->output + header_size;
-        stream.avail_out = uncompressible_size;
         
-        ib->block.uncompressed_size = LZMA_VLI_UNKNOWN; // for encoder to change
-        lzma_ret err = LZMA_OK;
-        while (err == LZMA_OK) {
-            err = lzma_code(&stream, LZMA_FINISH);
+        // Store it as-is if it would just come out bigger anyway
+        lzma_ret err = LZMA_BUF_ERROR;
+        if (!looks_uncompressible(ib)) {
+            struct timespec t0, t1;
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+            if (lzma_block_encoder(stream, &ib->block) != LZMA_OK)
+                die("Error creating block encoder");
+            stream->next_in = ib->input;
+            stream->avail_in = ib->insize;
+            stream->next_out = ib->output + header_size;
+            stream->avail_out = uncompressible_size;
+            
+            ib->block.uncompressed_size = LZMA_VLI_UNKNOWN; // for encoder to change
+            err = LZMA_OK;
+            while (err == LZMA_OK) {
+                err = lzma_code(stream, LZMA_FINISH);
+            }
+            
+            if (e->target_rate) {
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                adapt_level(level, ib->insize, (t1.tv_sec - t0.tv_sec)
+                    + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+            }
         }
         if (err == LZMA_BUF_ERROR) {
             debug("encoder: uncompressible %zu", pi->seq);
             encode_uncompressible(ib);
             ib->outsize = header_size + uncompressible_size;
+            stats_stored();
         } else if (err == LZMA_STREAM_END) {
-            ib->outsize = stream.next_out - ib->output;
+            ib->outsize = stream->next_out - ib->output;
         } else {
             die("Error encoding block");
         }
-        block_dealloc(ib, BLOCK_IN);
         
         if (lzma_block_header_encode(&ib->block, ib->output) != LZMA_OK)
             die("Error encoding block header");
         
+        stats_block(ib->insize, ib->outsize);
+        stats_level(level);
+        trace_span("encode", start, pi->seq, ib->insize, ib->outsize);
 		debug("encoder %zu: sending %zu", thnum, pi->seq);
-        queue_push(gPipelineMergeQ, PIPELINE_ITEM, pi);
+        queue_push(e->merge_q, PIPELINE_ITEM, pi);
+    }
+    
+    stream_free(stream);
+    stats_thread_end("encode");
+}
+
+
+#pragma mark ADAPTIVE LEVEL
+
+static void adapt_setup(uint32_t preset, lzma_options_lzma *opts) {
+    struct write_state_t *w = gWrite;
+    w->level_max = preset & LZMA_PRESET_LEVEL_MASK;
+    for (int l = 0; l <= w->level_max; ++l) {
+        if (lzma_lzma_preset(&w->level_opts[l],
+                l | (preset & ~LZMA_PRESET_LEVEL_MASK)))
+            die("Error setting lzma options");
+        w->level_opts[l].dict_size = opts->dict_size;
+        w->level_filters[l][0] = (lzma_filter){ .id = LZMA_FILTER_LZMA2,
+            .options = &w->level_opts[l] };
+        w->level_filters[l][1] = (lzma_filter){ .id = LZMA_VLI_UNKNOWN };
     }
+    atomic_init(&w->level, w->level_max);
+}
+
+// Step the level down when the encoders together fall short of the target,
+// and back up when they're well ahead of it and aren't falling behind input
+static void adapt_level(int level, size_t insize, double secs) {
+    engine_t *e = gEngine;
+    if (secs <= 0)
+        return;
+    size_t threads = e->pl_process_count; // encoders sharing the work
+    double rate = insize / secs * threads / (1024 * 1024);
+    size_t backlog = queue_length(e->split_q);
     
-    lzma_end(&stream);
+    int next = level;
+    if (rate < e->target_rate && level > 0)
+        next = level - 1;
+    else if (rate > e->target_rate * 1.5 && backlog < threads
+            && level < gWrite->level_max)
+        next = level + 1;
+    if (next != level
+            && atomic_compare_exchange_strong(&gWrite->level, &level, next))
+        debug("adapt: %.1f MiB/s, backlog %zu, level %d", rate, backlog, next);
 }
 
 
 #pragma mark WRITING
 
-static void block_init(lzma_block *block, size_t insize) {
+static void block_init(lzma_block *block, size_t insize, lzma_filter *filters) {
     block->version = 0;
     block->check = CHECK;
-    block->filters = gFilters;
+    block->filters = filters;
 	block->uncompressed_size = insize ? insize : LZMA_VLI_UNKNOWN;
-    block->compressed_size = insize ? gBlockOutSize : LZMA_VLI_UNKNOWN;
+    block->compressed_size = insize ? gWrite->block_out_size : LZMA_VLI_UNKNOWN;
 	
     if (lzma_block_header_size(block) != LZMA_OK)
         die("Error getting block header size");
@@ -417,117 +991,218 @@ static void stream_edge(lzma_vli backward_size) {
     if ((*encoder)(&flags, buf) != LZMA_OK)
         die("Error encoding stream edge");
     
-    if (fwrite(buf, LZMA_STREAM_HEADER_SIZE, 1, gOutFile) != 1)
+    if (!write_output(buf, LZMA_STREAM_HEADER_SIZE))
         die("Error writing stream edge");
 }
 
 static void write_block(pipeline_item_t *pi) {
     debug("writer: writing %zu", pi->seq);
     io_block_t *ib = (io_block_t*)(pi->data);
+    uint64_t start = trace_now();
     
-    // Does it make sense to chunk this?
-    size_t written = 0;
-    while (ib->outsize > written) {
-        size_t size = ib->outsize - written;
-        if (size > CHUNKSIZE)
-            size = CHUNKSIZE;
-        if (fwrite(ib->output + written, size, 1, gOutFile) != 1)
-            die("Error writing block data");
-        written += size;
-    }
+    if (!write_output(ib->output, ib->outsize))
+        die("Error writing block data");
     
-    if (lzma_index_append(gIndex, NULL,
+    if (lzma_index_append(gEngine->index, NULL,
             lzma_block_unpadded_size(&ib->block),
             ib->block.uncompressed_size) != LZMA_OK)
         die("Error adding to index");
 
-    block_dealloc(ib, BLOCK_ALL);
+    trace_span("write", start, pi->seq, 0, ib->outsize);
     debug("writer: writing %zu complete", pi->seq);
 }
 
 static void encode_index(void) {
-    if (lzma_index_encoder(&gStream, gIndex) != LZMA_OK)
+    engine_t *e = gEngine;
+    if (lzma_index_encoder(&e->stream, e->index) != LZMA_OK)
         die("Error creating index encoder");
     uint8_t obuf[CHUNKSIZE];
     lzma_ret err = LZMA_OK;
     while (err != LZMA_STREAM_END) {
-        gStream.next_out = obuf;
-        gStream.avail_out = CHUNKSIZE;
-        err = lzma_code(&gStream, LZMA_RUN);
+        e->stream.next_out = obuf;
+        e->stream.avail_out = CHUNKSIZE;
+        err = lzma_code(&e->stream, LZMA_RUN);
         if (err != LZMA_OK && err != LZMA_STREAM_END)
             die("Error encoding index");
-        if (gStream.avail_out != CHUNKSIZE) {
-            if (fwrite(obuf, CHUNKSIZE - gStream.avail_out, 1, gOutFile) != 1)
+        if (e->stream.avail_out != CHUNKSIZE) {
+            if (!write_output(obuf, CHUNKSIZE - e->stream.avail_out))
                 die("Error writing index data");
         }
     }
-    lzma_end(&gStream);
+    lzma_end(&e->stream);
 }
 
-static void write_file_index(void) {
-    lzma_block block;
-    block_init(&block, 0);
-    uint8_t hdrbuf[block.header_size];
-    if (lzma_block_header_encode(&block, hdrbuf) != LZMA_OK)
-        die("Error encoding file index header");
-    if (fwrite(hdrbuf, block.header_size, 1, gOutFile) != 1)
-        die("Error writing file index header");
-    
-    if (lzma_block_encoder(&gStream, &block) != LZMA_OK)
-        die("Error creating file index encoder");
+static void write_file_index(file_index_t *files) {
+    if (gEngine->index_format == 2) { // otherwise the original
+        write_file_index_v2(files);
+        return;
+    }
     
+    lzma_block block;
+    file_index_block_start(&block);
     uint8_t offbuf[sizeof(uint64_t)];
     xle64enc(offbuf, PIXZ_INDEX_MAGIC);
     write_file_index_bytes(sizeof(offbuf), offbuf);
-    for (file_index_t *f = gFileIndex; f != NULL; f = f->next) {
+    for (file_index_t *f = files; f != NULL; f = f->next) {
         char *name = f->name ? f->name : "";
         size_t len = strlen(name);
         write_file_index_bytes(len + 1, (uint8_t*)name);
         xle64enc(offbuf, f->offset);
         write_file_index_bytes(sizeof(offbuf), offbuf);
     }
-    write_file_index_buf(LZMA_FINISH);
+    file_index_block_finish(&block);
+}
 
-    if (lzma_index_append(gIndex, NULL, lzma_block_unpadded_size(&block),
-            block.uncompressed_size) != LZMA_OK)
+// Chunks of entries sorted by name, each its own block so a lookup only
+// decodes the chunk it needs, then a directory of the chunks' first names
+static void write_file_index_v2(file_index_t *files) {
+    size_t count = 0;
+    off_t end = 0;
+    for (file_index_t *f = files; f; f = f->next) {
+        if (f->name)
+            ++count;
+        else
+            end = f->offset;
+    }
+    file_index_t **sorted = malloc((count ? count : 1) * sizeof(*sorted));
+    size_t i = 0;
+    for (file_index_t *f = files; f; f = f->next) {
+        if (f->name)
+            sorted[i++] = f;
+    }
+    qsort(sorted, count, sizeof(*sorted), file_name_cmp);
+    
+    size_t nchunks = (count + INDEX_CHUNK_ENTRIES - 1) / INDEX_CHUNK_ENTRIES;
+    lzma_vli *usizes = malloc((nchunks ? nchunks : 1) * sizeof(lzma_vli));
+    uint8_t magic[sizeof(uint64_t)];
+    for (size_t c = 0; c < nchunks; ++c) {
+        lzma_block block;
+        file_index_block_start(&block);
+        xle64enc(magic, PIXZ_CHUNK_MAGIC);
+        write_file_index_bytes(sizeof(magic), magic);
+        
+        size_t first = c * INDEX_CHUNK_ENTRIES,
+            last = first + INDEX_CHUNK_ENTRIES;
+        if (last > count)
+            last = count;
+        write_file_index_varint(last - first);
+        const char *prev = "";
+        off_t prevoff = 0;
+        for (i = first; i < last; ++i) {
+            file_index_t *f = sorted[i];
+            size_t shared = 0;
+            while (prev[shared] && prev[shared] == f->name[shared])
+                ++shared;
+            size_t len = strlen(f->name + shared);
+            write_file_index_varint(shared);
+            write_file_index_varint(len);
+            write_file_index_bytes(len, (uint8_t*)f->name + shared);
+            
+            off_t delta = f->offset - prevoff; // zigzag, it may go backwards
+            write_file_index_varint(delta < 0 ? ((uint64_t)-delta << 1) - 1
+                : (uint64_t)delta << 1);
+            write_file_index_varint(f->next->offset - f->offset);
+            prev = f->name;
+            prevoff = f->offset;
+        }
+        file_index_block_finish(&block);
+        usizes[c] = block.uncompressed_size;
+    }
+    
+    lzma_block block;
+    file_index_block_start(&block);
+    xle64enc(magic, PIXZ_INDEX_V2_MAGIC);
+    write_file_index_bytes(sizeof(magic), magic);
+    write_file_index_varint(end);
+    write_file_index_varint(count);
+    write_file_index_varint(nchunks);
+    for (size_t c = 0; c < nchunks; ++c) {
+        size_t first = c * INDEX_CHUNK_ENTRIES;
+        size_t entries = count - first < INDEX_CHUNK_ENTRIES ? count - first
+            : INDEX_CHUNK_ENTRIES;
+        char *name = sorted[first]->name;
+        write_file_index_varint(entries);
+        write_file_index_varint(usizes[c]);
+        write_file_index_varint(strlen(name));
+        write_file_index_bytes(strlen(name), (uint8_t*)name);
+    }
+    file_index_block_finish(&block);
+    free(usizes);
+    free(sorted);
+}
+
+// By name, then by offset for names that appear more than once
+static int file_name_cmp(const void *a, const void *b) {
+    const file_index_t *fa = *(file_index_t * const *)a,
+        *fb = *(file_index_t * const *)b;
+    int cmp = strcmp(fa->name, fb->name);
+    if (cmp)
+        return cmp;
+    return (fa->offset > fb->offset) - (fa->offset < fb->offset);
+}
+
+static void file_index_block_start(lzma_block *block) {
+    block_init(block, 0, gWrite->filters);
+    uint8_t hdrbuf[block->header_size];
+    if (lzma_block_header_encode(block, hdrbuf) != LZMA_OK)
+        die("Error encoding file index header");
+    if (!write_output(hdrbuf, block->header_size))
+        die("Error writing file index header");
+    
+    if (lzma_block_encoder(&gEngine->stream, block) != LZMA_OK)
+        die("Error creating file index encoder");
+}
+
+static void file_index_block_finish(lzma_block *block) {
+    write_file_index_buf(LZMA_FINISH);
+    if (lzma_index_append(gEngine->index, NULL, lzma_block_unpadded_size(block),
+            block->uncompressed_size) != LZMA_OK)
         die("Error adding file-index to index");
-    lzma_end(&gStream);
+    lzma_end(&gEngine->stream);
+}
+
+static void write_file_index_varint(uint64_t n) {
+    uint8_t buf[VARINT_MAX];
+    write_file_index_bytes(xvarint_enc(buf, n), buf);
 }
 
 static void write_file_index_bytes(size_t size, uint8_t *buf) {
+    struct write_state_t *w = gWrite;
     size_t bufpos = 0;
     while (bufpos < size) {
         size_t len = size - bufpos;
-        size_t space = CHUNKSIZE - gFileIndexBufPos;
+        size_t space = CHUNKSIZE - w->fi_buf_pos;
         if (len > space)
             len = space;
-        memcpy(gFileIndexBuf + gFileIndexBufPos, buf + bufpos, len);
-        gFileIndexBufPos += len;
+        memcpy(w->fi_buf + w->fi_buf_pos, buf + bufpos, len);
+        w->fi_buf_pos += len;
         bufpos += len;
         
-        if (gFileIndexBufPos == CHUNKSIZE) {
+        if (w->fi_buf_pos == CHUNKSIZE) {
             write_file_index_buf(LZMA_RUN);
-            gFileIndexBufPos = 0;
+            w->fi_buf_pos = 0;
         }
     }
 }
 
 static void write_file_index_buf(lzma_action action) {
+    engine_t *e = gEngine;
+    struct write_state_t *w = gWrite;
     uint8_t obuf[CHUNKSIZE];
-    gStream.avail_in = gFileIndexBufPos;
-    gStream.next_in = gFileIndexBuf;
+    e->stream.avail_in = w->fi_buf_pos;
+    e->stream.next_in = w->fi_buf;
     lzma_ret err = LZMA_OK;
-    while (err != LZMA_STREAM_END && (action == LZMA_FINISH || gStream.avail_in)) {
-        gStream.avail_out = CHUNKSIZE;
-        gStream.next_out = obuf;
-        err = lzma_code(&gStream, action);
+    while (err != LZMA_STREAM_END && (action == LZMA_FINISH || e->stream.avail_in)) {
+        e->stream.avail_out = CHUNKSIZE;
+        e->stream.next_out = obuf;
+        err = lzma_code(&e->stream, action);
         if (err != LZMA_OK && err != LZMA_STREAM_END)
             die("Error encoding file index");
-        if (gStream.avail_out != CHUNKSIZE) {
-            if (fwrite(obuf, CHUNKSIZE - gStream.avail_out, 1, gOutFile) != 1)
+        if (e->stream.avail_out != CHUNKSIZE) {
+            if (!write_output(obuf, CHUNKSIZE - e->stream.avail_out))
                 die("Error writing file index");
         }
     }
     
-    gFileIndexBufPos = 0;
+    w->fi_buf_pos = 0;
 }
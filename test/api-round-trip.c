@@ -0,0 +1,195 @@
+// Compress and decompress buffers in-process, several times over
+
+#include "libpixz.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SIZE (3 * 1024 * 1024)
+
+static pixz_ret code_ret(pixz_action action, bool tar, const uint8_t *in,
+        size_t in_size, uint8_t **outp, size_t *out_size) {
+    pixz_ctx *ctx = pixz_new(action);
+    pixz_set_tar(ctx, tar);
+    pixz_set_level(ctx, 0);
+    pixz_set_threads(ctx, 3);
+
+    // Small pieces each way, to exercise partial progress
+    size_t cap = 1024, in_pos = 0, out_pos = 0;
+    uint8_t *out = malloc(cap);
+    pixz_ret ret = PIXZ_OK;
+    while (ret == PIXZ_OK) {
+        size_t in_end = in_pos + 10000 < in_size ? in_pos + 10000 : in_size;
+        if (out_pos == cap)
+            out = realloc(out, cap *= 2);
+        size_t out_end = out_pos + 7000 < cap ? out_pos + 7000 : cap;
+        ret = pixz_code(ctx, in, &in_pos, in_end, out, &out_pos, out_end,
+            in_end == in_size);
+    }
+    pixz_end(ctx);
+    *outp = out;
+    *out_size = out_pos;
+    return ret;
+}
+
+static uint8_t *code(pixz_action action, bool tar, const uint8_t *in,
+        size_t in_size, size_t *out_size) {
+    uint8_t *out;
+    if (code_ret(action, tar, in, in_size, &out, out_size) != PIXZ_STREAM_END) {
+        fprintf(stderr, "pixz_code failed\n");
+        exit(1);
+    }
+    return out;
+}
+
+typedef struct {
+    FILE *in, *out;
+} files_t;
+
+static ssize_t file_read(void *opaque, void *buf, size_t size) {
+    return fread(buf, 1, size, ((files_t*)opaque)->in);
+}
+
+static ssize_t file_write(void *opaque, const void *buf, size_t size) {
+    return fwrite(buf, 1, size, ((files_t*)opaque)->out) ? (ssize_t)size : -1;
+}
+
+int main(void) {
+    uint8_t *data = malloc(SIZE);
+    srand(1);
+    for (size_t i = 0; i < SIZE; ++i)
+        data[i] = (i / 4096) % 3 ? rand() % 16 : i;
+
+    for (int i = 0; i < 2; ++i) {
+        size_t xsize, psize;
+        uint8_t *xz = code(PIXZ_COMPRESS, false, data, SIZE, &xsize);
+        uint8_t *plain = code(PIXZ_DECOMPRESS, false, xz, xsize, &psize);
+        if (psize != SIZE || memcmp(plain, data, SIZE) != 0) {
+            fprintf(stderr, "buffer round trip differs\n");
+            return 1;
+        }
+        
+        // A damaged block must come back as an error, not end the process
+        if (i == 1) {
+            xz[xsize / 2] ^= 0x55;
+            uint8_t *bad;
+            if (code_ret(PIXZ_DECOMPRESS, false, xz, xsize, &bad, &psize)
+                    != PIXZ_DATA_ERROR) {
+                fprintf(stderr, "corrupt input not reported\n");
+                return 1;
+            }
+            free(bad);
+        }
+        free(xz);
+        free(plain);
+    }
+
+    // Two contexts at once, taking turns on this thread, then one given up
+    // part way through
+    pixz_ctx *both[2];
+    size_t in_pos[2] = { 0 }, out_pos[2] = { 0 }, cap = 2 * SIZE;
+    uint8_t *outs[2];
+    pixz_ret rets[2] = { PIXZ_OK, PIXZ_OK };
+    for (int i = 0; i < 2; ++i) {
+        both[i] = pixz_new(PIXZ_COMPRESS);
+        pixz_set_tar(both[i], false);
+        pixz_set_level(both[i], i);
+        outs[i] = malloc(cap);
+    }
+    while (rets[0] == PIXZ_OK || rets[1] == PIXZ_OK) {
+        for (int i = 0; i < 2; ++i) {
+            if (rets[i] != PIXZ_OK)
+                continue;
+            size_t in_end = in_pos[i] + 50000 < SIZE ? in_pos[i] + 50000
+                : SIZE;
+            rets[i] = pixz_code(both[i], data, &in_pos[i], in_end, outs[i],
+                &out_pos[i], cap, in_end == SIZE);
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        size_t psize;
+        uint8_t *plain = rets[i] == PIXZ_STREAM_END
+            ? code(PIXZ_DECOMPRESS, false, outs[i], out_pos[i], &psize) : NULL;
+        if (!plain || psize != SIZE || memcmp(plain, data, SIZE) != 0) {
+            fprintf(stderr, "concurrent round trip differs\n");
+            return 1;
+        }
+        pixz_end(both[i]);
+        free(plain);
+        free(outs[i]);
+    }
+    
+    pixz_ctx *ctx = pixz_new(PIXZ_COMPRESS);
+    uint8_t buf[4096];
+    size_t pos = 0, got = 0;
+    if (pixz_code(ctx, data, &pos, SIZE / 2, buf, &got, sizeof(buf), false)
+            != PIXZ_OK) {
+        fprintf(stderr, "pixz_code failed\n");
+        return 1;
+    }
+    pixz_end(ctx);
+
+    // Through callbacks and descriptors, with a seekable file
+    FILE *xz = tmpfile(), *out = tmpfile();
+    files_t files = { fmemopen(data, SIZE, "r"), xz };
+    ctx = pixz_new(PIXZ_COMPRESS);
+    pixz_set_tar(ctx, false);
+    pixz_set_callbacks(ctx, file_read, file_write, &files);
+    pixz_ret ret = pixz_run(ctx);
+    pixz_end(ctx);
+    fclose(files.in);
+    fflush(xz);
+    rewind(xz);
+
+    ctx = pixz_new(PIXZ_DECOMPRESS);
+    pixz_set_tar(ctx, false);
+    pixz_set_fds(ctx, fileno(xz), fileno(out));
+    if (ret != PIXZ_STREAM_END || pixz_run(ctx) != PIXZ_STREAM_END) {
+        fprintf(stderr, "pixz_run failed\n");
+        return 1;
+    }
+    pixz_end(ctx);
+
+    uint8_t *check = malloc(SIZE + 1);
+    if (pread(fileno(out), check, SIZE + 1, 0) != SIZE
+            || memcmp(check, data, SIZE) != 0) {
+        fprintf(stderr, "file round trip differs\n");
+        return 1;
+    }
+    
+    // Just a piece of it
+    FILE *part = tmpfile();
+    ctx = pixz_new(PIXZ_DECOMPRESS);
+    pixz_set_range(ctx, 1000000, 12345);
+    pixz_set_fds(ctx, fileno(xz), fileno(part));
+    if (pixz_run(ctx) != PIXZ_STREAM_END
+            || pread(fileno(part), check, SIZE, 0) != 12345
+            || memcmp(check, data + 1000000, 12345) != 0) {
+        fprintf(stderr, "range differs\n");
+        return 1;
+    }
+    pixz_end(ctx);
+
+    // Damage a block in the middle, where a decoder thread finds it
+    uint8_t junk[16] = { 0 };
+    off_t mid = lseek(fileno(xz), 0, SEEK_END) / 2;
+    if (pwrite(fileno(xz), junk, sizeof(junk), mid) != sizeof(junk)) {
+        fprintf(stderr, "can't damage file\n");
+        return 1;
+    }
+    rewind(xz);
+    ctx = pixz_new(PIXZ_DECOMPRESS);
+    pixz_set_tar(ctx, false);
+    pixz_set_fds(ctx, fileno(xz), fileno(part));
+    if (pixz_run(ctx) != PIXZ_DATA_ERROR || !pixz_message(ctx)) {
+        fprintf(stderr, "corrupt file not reported\n");
+        return 1;
+    }
+    pixz_end(ctx);
+    free(check);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,51 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+DIR=$INPUT.d
+trap "rm -rf $DIR $INPUT.*tar $INPUT.*tpxz" EXIT
+
+mkdir -p $DIR/old $DIR/new
+cat $INPUT > $DIR/old/small
+seq 1 100000 > $DIR/old/large
+seq 5 100000 > $DIR/new/large
+cat $INPUT > $DIR/new/small
+tar cf $INPUT.old.tar $DIR/old
+tar cf $INPUT.new.tar $DIR/new
+tar cf $INPUT.all.tar $DIR/old $DIR/new
+
+for format in 1 2; do
+    # Small blocks, so the old tar data ends within a block
+    $PIXZ -0 -f 0.1 --index-format=$format < $INPUT.old.tar > $INPUT.tpxz \
+        || exit 1
+    $PIXZ --append $INPUT.new.tar $INPUT.tpxz || exit 1
+    $PIXZ --test $INPUT.tpxz || exit 1
+    
+    [ "$($PIXZ -d < $INPUT.tpxz | tar t | md5sum)" = \
+        "$(tar tf $INPUT.all.tar | md5sum)" ] || exit 1
+    [ "$($PIXZ -l $INPUT.tpxz | md5sum)" = "$(tar tf $INPUT.all.tar | md5sum)" ] \
+        || exit 1
+    for f in old/large new/large new/small; do
+        [ "$($PIXZ -x $DIR/$f < $INPUT.tpxz | tar xO $DIR/$f | md5sum)" = \
+            "$(cat $DIR/$f | md5sum)" ] || exit 1
+    done
+done
+
+# A failed append leaves the archive just as it was
+head -c 30000 $INPUT.new.tar > $INPUT.bad.tar
+cp $INPUT.tpxz $INPUT.before.tpxz
+$PIXZ --append $INPUT.bad.tar $INPUT.tpxz 2>/dev/null && exit 1
+cmp $INPUT.tpxz $INPUT.before.tpxz || exit 1
+
+# Archives simply concatenated read as one tarball too
+$PIXZ < $INPUT.old.tar > $INPUT.old.tpxz || exit 1
+$PIXZ --index-format=2 < $INPUT.new.tar > $INPUT.new.tpxz || exit 1
+cat $INPUT.old.tpxz $INPUT.new.tpxz > $INPUT.tpxz
+[ "$($PIXZ -d < $INPUT.tpxz | tar t | md5sum)" = \
+    "$(tar tf $INPUT.all.tar | md5sum)" ] || exit 1
+[ "$($PIXZ -l $INPUT.tpxz | md5sum)" = "$(tar tf $INPUT.all.tar | md5sum)" ] \
+    || exit 1
+[ "$($PIXZ -x $DIR/old/small $DIR/new < $INPUT.tpxz | tar t | md5sum)" = \
+    "$(tar tf $INPUT.all.tar $DIR/old/small $DIR/new | md5sum)" ] || exit 1
@@ -0,0 +1,49 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+FIRST=$INPUT.1
+SECOND=$INPUT.2
+EMPTY=$INPUT.3
+LIST=$INPUT.list
+trap "rm -f $FIRST $SECOND $EMPTY $FIRST.xz $SECOND.xz $EMPTY.xz $LIST $INPUT.out*" EXIT
+
+cat $INPUT > $FIRST
+cat $INPUT $INPUT > $SECOND
+: > $EMPTY
+
+# Both go through one pipeline, but each must be a complete file of its own
+$PIXZ --batch -k $FIRST $SECOND || exit 1
+
+[ "$($PIXZ -d < $FIRST.xz | md5sum)" = "$(cat $FIRST | md5sum)" ] || exit 1
+[ "$($PIXZ -d < $SECOND.xz | md5sum)" = "$(cat $SECOND | md5sum)" ] || exit 1
+
+# An empty file last gets no blocks, after the pipeline has already run dry
+rm -f $FIRST.xz
+$PIXZ -t --batch -k $FIRST $EMPTY || exit 1
+[ "$($PIXZ -d < $FIRST.xz | md5sum)" = "$(cat $FIRST | md5sum)" ] || exit 1
+[ -z "$($PIXZ -d < $EMPTY.xz)" ] || exit 1
+
+# Decompressing names the outputs the same way, and removes the inputs
+rm -f $SECOND.xz
+$PIXZ --batch -k $FIRST $SECOND || exit 1
+mv $FIRST $INPUT.out1
+mv $SECOND $INPUT.out2
+$PIXZ -d --batch $FIRST.xz $SECOND.xz || exit 1
+[ ! -e $FIRST.xz ] && [ ! -e $SECOND.xz ] || exit 1
+cmp $FIRST $INPUT.out1 || exit 1
+cmp $SECOND $INPUT.out2 || exit 1
+
+# A list can name each output, and then keeps the inputs
+printf '%s\t%s\n%s\n\n%s\t%s\n' $FIRST $INPUT.out1.xz $SECOND \
+    $EMPTY $INPUT.out3.xz > $LIST
+$PIXZ -t -k --batch=$LIST || exit 1
+[ -e $FIRST ] && [ -e $SECOND ] && [ -e $SECOND.xz ] || exit 1
+printf '%s\t%s\n%s\t%s\n' $INPUT.out1.xz $INPUT.out1 \
+    $INPUT.out3.xz $INPUT.out3 | $PIXZ -d --batch=- || exit 1
+[ -e $INPUT.out1.xz ] || exit 1
+cmp $FIRST $INPUT.out1 || exit 1
+[ -e $INPUT.out3 ] && [ ! -s $INPUT.out3 ] || exit 1
+[ "$($PIXZ -d < $SECOND.xz | md5sum)" = "$(cat $SECOND | md5sum)" ] || exit 1
@@ -0,0 +1,604 @@
+// Time pixz over standard corpora and a sweep of settings, and write one
+// JSON object per run. Run it with `make bench`, BENCH_FLAGS passes options:
+//
+//   -s MIB       Size of each generated corpus (default 128)
+//   -r COUNT     Runs of each setting, the fastest is kept (default 3)
+//   -p LIST      Thread counts to sweep, like 1,2,8 (default powers of two
+//                up to the number of CPUs)
+//   -l LEVEL     Level for the sweeps that don't vary it (default 6)
+//   -c FILE      Use FILE as another corpus, a tarball if it ends in .tar
+//   -d DIR       Keep corpora and outputs in DIR (default bench-data)
+//   -o FILE      Write results to FILE (default stdout)
+//
+// Corpora come from a fixed seed, so every run sees the same bytes. A corpus
+// has to be several times the block size, twice the level's dictionary, for
+// the thread sweep to show any scaling.
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#pragma mark TYPES
+
+#define MAX_CORPORA 16
+#define MAX_THREADS 32
+#define MAX_RESULTS 1024
+
+typedef struct {
+    char name[64];
+    char path[4096];
+    bool tar;
+    char member[100]; // for extraction, in a tarball
+} corpus_t;
+
+typedef struct {
+    int threads, level, queue; // queue 0 for the default
+    double fraction; // 0 for the default
+} setting_t;
+
+typedef struct {
+    double seconds;
+    long max_rss_kib;
+    off_t out_bytes;
+} run_t;
+
+typedef struct {
+    const corpus_t *corpus;
+    const char *op;
+    setting_t set;
+    run_t run;
+} result_t;
+
+
+#pragma mark GLOBALS
+
+static const char *gPixz;
+static const char *gDir = "bench-data";
+static FILE *gOut;
+static size_t gSize = 128;
+static int gRepeat = 3;
+static int gLevel = 6;
+
+static corpus_t gCorpora[MAX_CORPORA];
+static size_t gCorpusCount = 0;
+static int gThreads[MAX_THREADS];
+static size_t gThreadCount = 0;
+
+// Each distinct run is done once, even if several sweeps include it
+static result_t gResults[MAX_RESULTS];
+static size_t gResultCount = 0;
+
+static uint64_t gRand;
+static uint32_t gRecord;
+
+
+#pragma mark FUNCTION DECLARATIONS
+
+static void die(const char *fmt, ...);
+static uint64_t rand_next(void);
+static FILE *corpus_open(corpus_t *c, const char *name, bool tar);
+static void corpus_close(corpus_t *c, FILE *f);
+static size_t gen_text(uint8_t *buf, size_t size);
+static size_t gen_binary(uint8_t *buf, size_t size);
+static void make_text(void);
+static void make_binary(void);
+static void make_random(void);
+static void make_tar(void);
+static void tar_header(uint8_t *h, const char *name, size_t size);
+static void tar_member(corpus_t *c);
+static double now(void);
+static run_t run(const char *in, const char *out, char **args);
+static run_t run_best(const char *in, const char *out, char **args);
+static off_t file_size(const char *path);
+static void same_files(const char *a, const char *b);
+static const result_t *bench(const corpus_t *c, const char *op, setting_t set);
+static void report(const result_t *r, const char *sweep, double efficiency);
+static void sweep_threads(const corpus_t *c);
+static void sweep_settings(const corpus_t *c);
+
+
+#pragma mark UTILS
+
+static void die(const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(1);
+}
+
+// xorshift64, from a fixed seed
+static uint64_t rand_next(void) {
+    gRand ^= gRand << 13;
+    gRand ^= gRand >> 7;
+    gRand ^= gRand << 17;
+    return gRand;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static off_t file_size(const char *path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? st.st_size : -1;
+}
+
+static void same_files(const char *a, const char *b) {
+    FILE *fa = fopen(a, "r"), *fb = fopen(b, "r");
+    if (!fa || !fb)
+        die("Can't open %s or %s", a, b);
+    static uint8_t ba[1 << 16], bb[1 << 16];
+    size_t ra, rb;
+    do {
+        ra = fread(ba, 1, sizeof(ba), fa);
+        rb = fread(bb, 1, sizeof(bb), fb);
+        if (ra != rb || memcmp(ba, bb, ra) != 0)
+            die("%s doesn't match %s", b, a);
+    } while (ra);
+    fclose(fa);
+    fclose(fb);
+}
+
+
+#pragma mark CORPORA
+
+// Returns NULL if the corpus is already there, at the right size
+static FILE *corpus_open(corpus_t *c, const char *name, bool tar) {
+    if (gCorpusCount == MAX_CORPORA)
+        die("Too many corpora");
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    snprintf(c->path, sizeof(c->path), "%s/%s-%zuM%s", gDir, name, gSize,
+        tar ? ".tar" : "");
+    c->tar = tar;
+    gRand = 0x9E3779B97F4A7C15ULL; // the same bytes every time
+    gRecord = 0;
+    ++gCorpusCount;
+
+    if (file_size(c->path) == (off_t)(gSize << 20))
+        return NULL;
+    FILE *f = fopen(c->path, "w");
+    if (!f)
+        die("Can't create %s: %s", c->path, strerror(errno));
+    fprintf(stderr, "bench: generating %s\n", c->path);
+    return f;
+}
+
+static void corpus_close(corpus_t *c, FILE *f) {
+    if (fclose(f) != 0)
+        die("Error writing %s: %s", c->path, strerror(errno));
+}
+
+// Words of a skewed frequency, in lines of prose
+static size_t gen_text(uint8_t *buf, size_t size) {
+    static const char *words[] = { "the", "of", "and", "to", "in", "a",
+        "is", "that", "for", "it", "as", "was", "with", "be", "by", "on",
+        "not", "he", "this", "are", "or", "his", "from", "at", "which",
+        "but", "have", "an", "had", "they", "you", "were", "their", "one",
+        "all", "we", "can", "her", "has", "there", "been", "if", "more",
+        "when", "will", "would", "who", "so", "compression", "parallel",
+        "index", "block", "archive", "stream", "thread", "decoder",
+        "dictionary", "tarball", "throughput", "queue", "buffer" };
+    size_t nwords = sizeof(words) / sizeof(*words), pos = 0, line = 0;
+    while (pos < size) {
+        uint64_t r = rand_next();
+        const char *w = words[r % ((r >> 32) % nwords + 1)];
+        size_t len = strlen(w);
+        for (size_t i = 0; i < len && pos < size; ++i)
+            buf[pos++] = w[i];
+        line += len + 1;
+        if (pos < size) {
+            if (line > 64 + (r >> 58)) {
+                buf[pos++] = '\n';
+                line = 0;
+            } else {
+                buf[pos++] = (r >> 20) % 11 ? ' ' : ',';
+            }
+        }
+    }
+    return size;
+}
+
+// Records of counters, small integers and repeating tags, like a table
+static size_t gen_binary(uint8_t *buf, size_t size) {
+    size_t pos = 0;
+    while (pos < size) {
+        uint64_t r = rand_next();
+        uint32_t id = gRecord++;
+        uint32_t rec[8] = { id, (uint32_t)(r % 1000), (uint32_t)(r >> 48),
+            0x7f000000 | (uint32_t)((r >> 10) & 0xffff), (id / 64) * 4096,
+            (uint32_t)(r >> 32) & 0xff, 0xdeadbeef, (uint32_t)r };
+        size_t n = sizeof(rec) < size - pos ? sizeof(rec) : size - pos;
+        memcpy(buf + pos, rec, n);
+        pos += n;
+    }
+    return size;
+}
+
+static void make_text(void) {
+    corpus_t *c = &gCorpora[gCorpusCount];
+    FILE *f = corpus_open(c, "text", false);
+    if (!f)
+        return;
+    static uint8_t buf[1 << 20];
+    for (size_t i = 0; i < gSize; ++i)
+        fwrite(buf, 1, gen_text(buf, sizeof(buf)), f);
+    corpus_close(c, f);
+}
+
+static void make_binary(void) {
+    corpus_t *c = &gCorpora[gCorpusCount];
+    FILE *f = corpus_open(c, "binary", false);
+    if (!f)
+        return;
+    static uint8_t buf[1 << 20];
+    for (size_t i = 0; i < gSize; ++i)
+        fwrite(buf, 1, gen_binary(buf, sizeof(buf)), f);
+    corpus_close(c, f);
+}
+
+static void make_random(void) {
+    corpus_t *c = &gCorpora[gCorpusCount];
+    FILE *f = corpus_open(c, "random", false);
+    if (!f)
+        return;
+    static uint64_t buf[1 << 17];
+    for (size_t i = 0; i < gSize; ++i) {
+        for (size_t j = 0; j < sizeof(buf) / sizeof(*buf); ++j)
+            buf[j] = rand_next();
+        fwrite(buf, 1, sizeof(buf), f);
+    }
+    corpus_close(c, f);
+}
+
+static void tar_header(uint8_t *h, const char *name, size_t size) {
+    memset(h, 0, 512);
+    snprintf((char*)h, 100, "%s", name);
+    memcpy(h + 100, "0000644", 8);
+    memcpy(h + 108, "0001750", 8);
+    memcpy(h + 116, "0001750", 8);
+    snprintf((char*)h + 124, 12, "%011zo", size);
+    snprintf((char*)h + 136, 12, "%011o", 1600000000);
+    h[156] = '0';
+    memcpy(h + 257, "ustar", 6);
+    memcpy(h + 263, "00", 2);
+    memcpy(h + 265, "bench", 6);
+    memcpy(h + 297, "bench", 6);
+
+    unsigned sum = 0;
+    memset(h + 148, ' ', 8);
+    for (size_t i = 0; i < 512; ++i)
+        sum += h[i];
+    snprintf((char*)h + 148, 8, "%06o", sum);
+}
+
+// Lots of small files, mostly text with some binary, exactly gSize MiB
+static void make_tar(void) {
+    corpus_t *c = &gCorpora[gCorpusCount];
+    FILE *f = corpus_open(c, "small-files", true);
+    size_t total = gSize << 20, pos = 0, files = 0;
+    static uint8_t buf[64 * 1024 + 512];
+    while (pos + 512 * 3 <= total) {
+        uint64_t r = rand_next();
+        size_t size = r % ((r >> 32) % (32 * 1024) + 1);
+        size_t room = total - pos - 512 * 3; // leave two blocks for the end
+        if (size > room)
+            size = room;
+        char name[100];
+        snprintf(name, sizeof(name), "dir%03zu/file%06zu.%s", files / 100,
+            files, r >> 63 ? "bin" : "txt");
+        // Name the member halfway through, to extract later
+        if (!c->member[0] && pos >= total / 2)
+            snprintf(c->member, sizeof(c->member), "%s", name);
+        ++files;
+
+        // Generate even if it's there, that keeps the member the same
+        size_t padded = (size + 511) & ~(size_t)511;
+        tar_header(buf, name, size);
+        memset(buf + 512, 0, padded);
+        if (r >> 63)
+            gen_binary(buf + 512, size);
+        else
+            gen_text(buf + 512, size);
+        if (f)
+            fwrite(buf, 1, 512 + padded, f);
+        pos += 512 + padded;
+    }
+    if (f) {
+        memset(buf, 0, total - pos);
+        fwrite(buf, 1, total - pos, f);
+        corpus_close(c, f);
+    }
+}
+
+// Find a regular file halfway through a tarball, skipping any metadata
+static void tar_member(corpus_t *c) {
+    FILE *f = fopen(c->path, "r");
+    if (!f)
+        die("Can't open %s: %s", c->path, strerror(errno));
+    off_t half = file_size(c->path) / 2, pos = 0;
+    uint8_t h[512];
+    while (fread(h, 1, sizeof(h), f) == sizeof(h) && h[0]) {
+        char size[13] = { 0 };
+        memcpy(size, h + 124, 12);
+        off_t data = (strtoull(size, NULL, 8) + 511) & ~(off_t)511;
+        if ((h[156] == '0' || h[156] == '\0') && h[345] == '\0'
+                && (pos >= half || !c->member[0]))
+            snprintf(c->member, sizeof(c->member), "%.99s", (char*)h);
+        if (pos >= half && c->member[0])
+            break;
+        pos += sizeof(h) + data;
+        if (fseeko(f, pos, SEEK_SET) != 0)
+            break;
+    }
+    fclose(f);
+    if (!c->member[0])
+        die("No file to extract in %s", c->path);
+}
+
+
+#pragma mark RUNNING
+
+static run_t run(const char *in, const char *out, char **args) {
+    double start = now();
+    pid_t pid = fork();
+    if (pid == -1)
+        die("Can't fork: %s", strerror(errno));
+    if (pid == 0) {
+        int ifd = open(in, O_RDONLY),
+            ofd = open(out, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (ifd == -1 || ofd == -1 || dup2(ifd, 0) == -1 || dup2(ofd, 1) == -1)
+            _exit(127);
+        execv(gPixz, args);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) == -1)
+        die("Can't wait for pixz: %s", strerror(errno));
+    run_t r = { now() - start, ru.ru_maxrss, 0 };
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        die("%s %s failed", gPixz, args[1]);
+    r.out_bytes = file_size(out);
+    return r;
+}
+
+static run_t run_best(const char *in, const char *out, char **args) {
+    run_t best = run(in, out, args);
+    for (int i = 1; i < gRepeat; ++i) {
+        run_t r = run(in, out, args);
+        if (r.seconds < best.seconds)
+            best.seconds = r.seconds;
+        if (r.max_rss_kib > best.max_rss_kib)
+            best.max_rss_kib = r.max_rss_kib;
+    }
+    return best;
+}
+
+// Compressing also decompresses, to check the round trip and time it
+static const result_t *bench(const corpus_t *c, const char *op,
+        setting_t set) {
+    for (size_t i = 0; i < gResultCount; ++i) {
+        result_t *r = &gResults[i];
+        if (r->corpus == c && strcmp(r->op, op) == 0
+                && memcmp(&r->set, &set, sizeof(set)) == 0)
+            return r;
+    }
+    if (gResultCount + 2 > MAX_RESULTS)
+        die("Too many results");
+
+    char level[8], threads[16], fraction[32], queue[16];
+    snprintf(level, sizeof(level), "-%d", set.level);
+    snprintf(threads, sizeof(threads), "-p%d", set.threads);
+    snprintf(fraction, sizeof(fraction), "-f%g", set.fraction);
+    snprintf(queue, sizeof(queue), "-q%d", set.queue);
+
+    char archive[sizeof(c->path) + 64], plain[sizeof(c->path) + 64];
+    // Threads and queue size don't change what's written
+    snprintf(archive, sizeof(archive), "%s/out-%s%s-f%g.xz", gDir, c->name,
+        level, set.fraction);
+    snprintf(plain, sizeof(plain), "%s/out-%s", gDir, c->name);
+    char *args[16] = { (char*)gPixz };
+    size_t n = 1;
+    if (strcmp(op, "compress") == 0) {
+        args[n++] = level;
+    } else if (strcmp(op, "decompress") == 0) {
+        args[n++] = "-d";
+    } else if (strcmp(op, "list") == 0) {
+        args[n++] = "-l";
+    } else {
+        args[n++] = "-x";
+        args[n++] = (char*)c->member;
+    }
+    args[n++] = threads;
+    if (set.fraction)
+        args[n++] = fraction;
+    if (set.queue)
+        args[n++] = queue;
+    if (!c->tar)
+        args[n++] = "-t";
+    args[n] = NULL;
+
+    fprintf(stderr, "bench: %s %s %s %s\n", c->name, op, level, threads);
+    result_t *r = &gResults[gResultCount++];
+    r->corpus = c;
+    r->op = op;
+    r->set = set;
+    if (strcmp(op, "compress") == 0) {
+        r->run = run_best(c->path, archive, args);
+        // Decompress it now, with the same settings
+        args[1] = "-d";
+        result_t *d = &gResults[gResultCount++];
+        *d = (result_t){ c, "decompress", set, run_best(archive, plain, args) };
+        same_files(c->path, plain);
+    } else {
+        // Use the archive at this level, with default threads otherwise
+        setting_t cset = { .threads = set.threads, .level = set.level,
+            .fraction = set.fraction };
+        bench(c, "compress", cset);
+        r->run = run_best(archive, plain, args);
+    }
+    return r;
+}
+
+static void report(const result_t *r, const char *sweep, double efficiency) {
+    off_t size = file_size(r->corpus->path);
+    if (strcmp(r->op, "extract") == 0) // just the one file
+        size = r->run.out_bytes;
+    fprintf(gOut, "{\"corpus\": \"%s\", \"sweep\": \"%s\", \"op\": \"%s\", "
+        "\"threads\": %d, \"level\": %d, \"fraction\": %g, \"queue\": %d, "
+        "\"bytes\": %jd, \"out_bytes\": %jd, \"seconds\": %.3f, "
+        "\"mb_s\": %.2f, \"max_rss_kib\": %ld",
+        r->corpus->name, sweep, r->op, r->set.threads, r->set.level,
+        r->set.fraction, r->set.queue, (intmax_t)size,
+        (intmax_t)r->run.out_bytes, r->run.seconds,
+        r->run.seconds > 0 ? size / r->run.seconds / (1 << 20) : 0,
+        r->run.max_rss_kib);
+    if (efficiency > 0)
+        fprintf(gOut, ", \"efficiency\": %.3f", efficiency);
+    fprintf(gOut, "}\n");
+    fflush(gOut);
+}
+
+
+#pragma mark SWEEPS
+
+// Efficiency is the speedup over one thread, per thread
+static void sweep_threads(const corpus_t *c) {
+    static const char *ops[] = { "compress", "decompress", "list", "extract" };
+    size_t nops = c->tar ? 4 : 2;
+    for (size_t o = 0; o < nops; ++o) {
+        double base = 0;
+        for (size_t t = 0; t < gThreadCount; ++t) {
+            setting_t set = { .threads = gThreads[t], .level = gLevel };
+            const result_t *r = bench(c, "compress", set);
+            if (o)
+                r = bench(c, ops[o], set);
+            if (gThreads[t] == 1)
+                base = r->run.seconds;
+            report(r, "threads", base && r->run.seconds
+                ? base / r->run.seconds / gThreads[t] : 0);
+        }
+    }
+}
+
+static void sweep_settings(const corpus_t *c) {
+    int threads = gThreads[gThreadCount - 1];
+    static const int levels[] = { 0, 3, 6, 9 };
+    for (size_t i = 0; i < sizeof(levels) / sizeof(*levels); ++i) {
+        setting_t set = { .threads = threads, .level = levels[i] };
+        report(bench(c, "compress", set), "level", 0);
+        report(bench(c, "decompress", set), "level", 0);
+    }
+
+    static const double fractions[] = { 0.5, 1, 2, 4 };
+    for (size_t i = 0; i < sizeof(fractions) / sizeof(*fractions); ++i) {
+        setting_t set = { .threads = threads, .level = gLevel,
+            .fraction = fractions[i] };
+        report(bench(c, "compress", set), "fraction", 0);
+        report(bench(c, "decompress", set), "fraction", 0);
+    }
+
+    static const int queues[] = { 1, 2, 4, 16 };
+    for (size_t i = 0; i < sizeof(queues) / sizeof(*queues); ++i) {
+        setting_t set = { .threads = threads, .level = gLevel,
+            .queue = queues[i] };
+        report(bench(c, "compress", set), "queue", 0);
+        report(bench(c, "decompress", set), "queue", 0);
+    }
+}
+
+
+#pragma mark MAIN
+
+int main(int argc, char **argv) {
+    const char *extra[MAX_CORPORA], *opath = NULL;
+    size_t nextra = 0;
+    int opt;
+    char *end;
+    const char *tok;
+    while ((opt = getopt(argc, argv, "s:r:p:l:c:d:o:")) != -1) {
+        switch (opt) {
+            case 's': gSize = strtoul(optarg, &end, 10); break;
+            case 'r': gRepeat = atoi(optarg); break;
+            case 'l': gLevel = atoi(optarg); break;
+            case 'd': gDir = optarg; break;
+            case 'o': opath = optarg; break;
+            case 'c':
+                if (nextra == MAX_CORPORA)
+                    die("Too many corpora");
+                extra[nextra++] = optarg;
+                break;
+            case 'p':
+                for (tok = optarg; *tok && gThreadCount < MAX_THREADS;
+                        tok = *end ? end + 1 : end)
+                    if ((gThreads[gThreadCount] = strtol(tok, &end, 10)) > 0)
+                        ++gThreadCount;
+                break;
+            default:
+                die("Usage: %s [-s MIB] [-r COUNT] [-p LIST] [-l LEVEL] "
+                    "[-c FILE] [-d DIR] [-o FILE] PIXZ", argv[0]);
+        }
+    }
+    if (optind != argc - 1 || gSize == 0 || gRepeat < 1 || gLevel < 0
+            || gLevel > 9)
+        die("Usage: %s [-s MIB] [-r COUNT] [-p LIST] [-l LEVEL] "
+            "[-c FILE] [-d DIR] [-o FILE] PIXZ", argv[0]);
+    gPixz = argv[optind];
+    if (access(gPixz, X_OK) != 0)
+        die("Can't run %s", gPixz);
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (!gThreadCount) {
+        for (int t = 1; t < cpus && gThreadCount < MAX_THREADS - 1; t *= 2)
+            gThreads[gThreadCount++] = t;
+        gThreads[gThreadCount++] = cpus > 0 ? cpus : 1;
+    }
+    gOut = stdout;
+    if (opath && !(gOut = fopen(opath, "w")))
+        die("Can't create %s: %s", opath, strerror(errno));
+    if (mkdir(gDir, 0755) != 0 && errno != EEXIST)
+        die("Can't create %s: %s", gDir, strerror(errno));
+
+    make_text();
+    make_binary();
+    make_random();
+    make_tar();
+    for (size_t i = 0; i < nextra; ++i) {
+        if (gCorpusCount == MAX_CORPORA)
+            die("Too many corpora");
+        corpus_t *c = &gCorpora[gCorpusCount++];
+        const char *base = strrchr(extra[i], '/');
+        snprintf(c->name, sizeof(c->name), "%s", base ? base + 1 : extra[i]);
+        snprintf(c->path, sizeof(c->path), "%s", extra[i]);
+        size_t len = strlen(c->path);
+        c->tar = len > 4 && strcmp(c->path + len - 4, ".tar") == 0;
+        if (c->tar)
+            tar_member(c);
+    }
+
+    fprintf(gOut, "{\"bench\": \"pixz\", \"cpus\": %ld, \"size_mib\": %zu, "
+        "\"repeat\": %d, \"level\": %d}\n", cpus, gSize, gRepeat, gLevel);
+    for (size_t i = 0; i < gCorpusCount; ++i) {
+        sweep_threads(&gCorpora[i]);
+        sweep_settings(&gCorpora[i]);
+    }
+    if (gOut != stdout && fclose(gOut) != 0)
+        die("Error writing %s: %s", opath, strerror(errno));
+    return 0;
+}
@@ -0,0 +1,22 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+trap "rm -f $INPUT.in $INPUT.xz $INPUT.out" EXIT
+
+seq 1 300000 > $INPUT.in
+# Small blocks, so ranges start, end and span within and across blocks
+$PIXZ -t -0 -f 0.1 < $INPUT.in > $INPUT.xz || exit 1
+
+for range in 0:100 5000:300000 99999:1 1000000:5000 2000000:1000; do
+    offset=${range%:*}
+    length=${range#*:}
+    expected=$(tail -c +$((offset + 1)) $INPUT.in | head -c $length | md5sum)
+    [ "$($PIXZ -d --range $range < $INPUT.xz | md5sum)" = "$expected" ] \
+        || exit 1
+    rm -f $INPUT.out
+    $PIXZ -d --range $range -i $INPUT.xz -o $INPUT.out || exit 1
+    [ "$(md5sum < $INPUT.out)" = "$expected" ] || exit 1
+done
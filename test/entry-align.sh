@@ -0,0 +1,25 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+DIR=$INPUT.d
+trap "rm -rf $DIR $INPUT.tar $INPUT.tpxz" EXIT
+
+# Entries of many sizes, so some start near the end of a block and move on
+mkdir -p $DIR
+for i in $(seq 1 40); do
+    seq 1 $((i * 997)) > $DIR/f$i
+done
+tar cf $INPUT.tar $DIR
+
+for align in 0.1 0.5 0.9; do
+    $PIXZ -0 -f 0.1 --entry-align=$align < $INPUT.tar > $INPUT.tpxz || exit 1
+    [ "$($PIXZ -d < $INPUT.tpxz | md5sum)" = "$(md5sum < $INPUT.tar)" ] \
+        || exit 1
+    for i in 1 7 20 33 40; do
+        [ "$($PIXZ -x $DIR/f$i < $INPUT.tpxz | tar xO $DIR/f$i | md5sum)" = \
+            "$(md5sum < $DIR/f$i)" ] || exit 1
+    done
+done
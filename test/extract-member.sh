@@ -0,0 +1,26 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+DIR=$INPUT.d
+trap "rm -rf $DIR $INPUT.tar $INPUT.tpxz" EXIT
+
+mkdir -p $DIR
+cat $INPUT > $DIR/small
+seq 1 100000 > $DIR/large
+cat $INPUT $INPUT > $DIR/after
+tar cf $INPUT.tar $DIR
+
+for format in 1 2; do
+    # Small blocks, so members start and end within blocks that go on past them
+    $PIXZ -0 -f 0.1 --index-format=$format < $INPUT.tar > $INPUT.tpxz || exit 1
+    
+    for f in small large after; do
+        [ "$($PIXZ -x $DIR/$f < $INPUT.tpxz | tar xO $DIR/$f | md5sum)" = \
+            "$(cat $DIR/$f | md5sum)" ] || exit 1
+    done
+    [ "$($PIXZ -l $INPUT.tpxz | md5sum)" = "$(tar tf $INPUT.tar | md5sum)" ] \
+        || exit 1
+done
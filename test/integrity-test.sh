@@ -0,0 +1,23 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+trap "rm -rf $INPUT.dir $INPUT.tpxz $INPUT.bad" EXIT
+
+mkdir -p $INPUT.dir
+for i in 1 2 3 4 5; do
+    seq 1 $((i * 40000)) > $INPUT.dir/f$i
+done
+tar -cf - $INPUT.dir | $PIXZ -0 -f 0.1 > $INPUT.tpxz || exit 1
+$PIXZ --test $INPUT.tpxz || exit 1
+$PIXZ --test < $INPUT.tpxz || exit 1
+[ -f $INPUT.tpxz ] || exit 1 # never removed
+
+# Damage a byte in the middle, where the blocks are
+size=$(wc -c < $INPUT.tpxz)
+cp $INPUT.tpxz $INPUT.bad
+printf 'X' | dd of=$INPUT.bad bs=1 seek=$((size / 2)) conv=notrunc 2> /dev/null
+$PIXZ --test $INPUT.bad 2> /dev/null && exit 1
+exit 0
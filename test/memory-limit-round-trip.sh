@@ -0,0 +1,23 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+COMPRESSED=$INPUT.xz
+UNCOMPRESSED=$INPUT.extracted
+BLOCKS=$INPUT.blocks
+trap "rm -f $COMPRESSED $UNCOMPRESSED $BLOCKS $BLOCKS.xz $BLOCKS.stats" EXIT
+
+# Far too little memory for -9, pixz must scale itself down rather than fail
+$PIXZ -9 -M 64MiB $INPUT $COMPRESSED || exit 1
+$PIXZ -d -M 1K $COMPRESSED $UNCOMPRESSED || exit 1
+
+[ "$(cat $INPUT | md5sum)" = "$(cat $UNCOMPRESSED | md5sum)" ] || exit 1
+
+# Under a limit, blocks too big to split still get a decoder of their own
+seq 1 1500000 > $BLOCKS
+xz -0 --block-list=4MiB,256KiB < $BLOCKS > $BLOCKS.xz || exit 1
+[ "$($PIXZ -d -M 8MiB --stats < $BLOCKS.xz 2> $BLOCKS.stats | md5sum)" = \
+    "$(md5sum < $BLOCKS)" ] || exit 1
+grep -q '"role": "stream"' $BLOCKS.stats || exit 1
@@ -0,0 +1,24 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+MOUNT=../src/pixz-mount
+
+INPUT=$(basename $0)
+
+# Only when pixz-mount is built, and this system lets us mount things
+[ -x $MOUNT ] && command -v fusermount3 > /dev/null && [ -c /dev/fuse ] \
+    || exit 77
+
+trap "fusermount3 -u $INPUT.mnt 2> /dev/null; rm -rf $INPUT.dir $INPUT.tpxz $INPUT.mnt" EXIT
+
+mkdir -p $INPUT.dir/sub/deeper $INPUT.mnt
+seq 1 200000 > $INPUT.dir/sub/deeper/seq
+head -c 100000 /dev/zero > $INPUT.dir/zeros
+ln -s sub/deeper/seq $INPUT.dir/link
+tar -cf - $INPUT.dir | $PIXZ -0 -f 0.1 > $INPUT.tpxz || exit 1
+
+$MOUNT --cache=100K $INPUT.tpxz $INPUT.mnt || exit 77
+diff -r $INPUT.dir $INPUT.mnt/$INPUT.dir || exit 1
+[ "$(readlink $INPUT.mnt/$INPUT.dir/link)" = "sub/deeper/seq" ] || exit 1
+touch $INPUT.mnt/$INPUT.dir/zeros 2> /dev/null && exit 1
+exit 0
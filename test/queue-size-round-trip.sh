@@ -0,0 +1,19 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+DIR=$INPUT.d
+trap "rm -rf $DIR $INPUT.tar $INPUT.tpxz" EXIT
+
+mkdir -p $DIR
+seq 1 100000 > $DIR/first
+seq 100000 -1 1 > $DIR/second
+tar cf $INPUT.tar $DIR
+
+# The tar pass holds one block while it waits for the next, so even a
+# one-item queue needs room for a second
+$PIXZ -0 -f 0.1 -q1 < $INPUT.tar > $INPUT.tpxz || exit 1
+[ "$($PIXZ -d -q1 < $INPUT.tpxz | md5sum)" = "$(cat $INPUT.tar | md5sum)" ] \
+    || exit 1
@@ -0,0 +1,30 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+trap "rm -f $INPUT.a $INPUT.b $INPUT.a.xz $INPUT.b.xz $INPUT.out" EXIT
+
+seq 1 200000 > $INPUT.a
+seq 300000 -1 1 > $INPUT.b
+$PIXZ -t -0 -f 0.1 < $INPUT.a > $INPUT.a.xz || exit 1
+$PIXZ -t -0 -f 0.1 < $INPUT.b > $INPUT.b.xz || exit 1
+
+# Each decompression into a shared file must leave it positioned after its
+# own output, for whatever writes next
+{
+    echo start
+    $PIXZ -d < $INPUT.a.xz || exit 1
+    $PIXZ -d < $INPUT.b.xz || exit 1
+    $PIXZ -d --range 1000:5000 < $INPUT.a.xz || exit 1
+    echo end
+} > $INPUT.out || exit 1
+
+expected=$({
+    echo start
+    cat $INPUT.a $INPUT.b
+    tail -c +1001 $INPUT.a | head -c 5000
+    echo end
+} | md5sum)
+[ "$(md5sum < $INPUT.out)" = "$expected" ] || exit 1
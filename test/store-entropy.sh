@@ -0,0 +1,20 @@
+#!/bin/sh
+
+PIXZ=../src/pixz
+
+INPUT=$(basename $0)
+
+trap "rm -f $INPUT.rand $INPUT.in $INPUT.xz" EXIT
+
+# Random data, repeated within one block: high byte entropy, yet it compresses
+head -c 131072 /dev/urandom > $INPUT.rand
+cat $INPUT.rand $INPUT.rand $INPUT.rand $INPUT.rand > $INPUT.in
+
+$PIXZ -t -0 -f 2 < $INPUT.in > $INPUT.xz || exit 1
+[ $(wc -c < $INPUT.xz) -lt 262144 ] || exit 1
+[ "$($PIXZ -d < $INPUT.xz | md5sum)" = "$(md5sum < $INPUT.in)" ] || exit 1
+
+# Asked to, it stores the block as it is
+$PIXZ -t -0 -f 2 --store-entropy=7.9 < $INPUT.in > $INPUT.xz || exit 1
+[ $(wc -c < $INPUT.xz) -gt 524288 ] || exit 1
+[ "$($PIXZ -d < $INPUT.xz | md5sum)" = "$(md5sum < $INPUT.in)" ] || exit 1